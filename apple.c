@@ -17,6 +17,9 @@
 // limitations under the License.
 //
 
+#define LOG_MODULE LOG_MODULE_PLATFORM
+
+#include <stdio.h>
 #include <stdint.h>
 #include <dlfcn.h>
 #include <CoreFoundation/CoreFoundation.h>
@@ -98,7 +101,7 @@ void __export BP_CreatePluginMIMETypesPreferences(void)
     // Every plugin should have a handle should have a CFBundle handle open,
     // which we can query for it's WebPluginMIMETypes CFDictionary, which we
     // simply merge with ours.
-    for (current = registry.plugins; current; current = current->next) {
+    for (current = registry_current()->plugins; current; current = current->next) {
         // Verify this handle exists, it can be NULL when LoadPlugin fails.
         if (current->handle) {
             // This should be a CFDictionary of all the MIME types supported by the plugin.
@@ -491,6 +494,24 @@ void platform_dlclose(void *handle)
     if (handle) CFRelease(handle);
 }
 
+// XXX: Memory accounting needs Mach-O support, which I haven't written.
+bool platform_module_info(void *handle __unused,
+                          uintptr_t *start __unused,
+                          uintptr_t *end __unused,
+                          size_t *mapped __unused)
+{
+    return false;
+}
+
+unsigned platform_patch_imports(void *handle __unused,
+                                const char *names[] __unused,
+                                void *replacements[] __unused,
+                                void *originals[] __unused,
+                                unsigned count __unused)
+{
+    return 0;
+}
+
 void __export DynamicRegistrationFunction(void)
 {
     // I don't need to do anything here, I just want to make sure I'm loaded so
@@ -0,0 +1,170 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Author: taviso@google.com
+//
+// Region allocation for the plugin registry.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#include "npapi.h"
+#include "npfunctions.h"
+#include "config.h"
+#include "arena.h"
+
+// The alignment of every record, a cache line so that the hot part of each
+// struct plugin never straddles two.
+#define kArenaAlignment     64
+
+// Chunks added when the arena is exhausted. The first chunk is allocated with
+// the arena itself, so a typical configuration is a single heap block.
+struct arena_chunk {
+    struct arena_chunk  *next;
+    char                 data[];
+};
+
+struct arena_block {
+    struct arena         arena;
+    char                 data[];
+};
+
+struct arena *arena_create(size_t size)
+{
+    struct arena_block *block;
+
+    if (!(block = malloc(sizeof *block + size)))
+        return NULL;
+
+    block->arena.low    = block->data;
+    block->arena.high   = block->data + size;
+    block->arena.size   = size;
+    block->arena.chunks = NULL;
+
+    return &block->arena;
+}
+
+// Make sure there are at least size bytes free, starting a new chunk if
+// necessary. The old chunk is abandoned, each chunk is twice as large as the
+// last so this wastes very little.
+static bool arena_reserve(struct arena *arena, size_t size)
+{
+    struct arena_chunk *chunk;
+    size_t              length;
+
+    if ((size_t)(arena->high - arena->low) >= size)
+        return true;
+
+    for (length = arena->size * 2; length < size; length *= 2)
+        ;
+
+    if (!(chunk = malloc(sizeof *chunk + length)))
+        return false;
+
+    chunk->next     = arena->chunks;
+    arena->chunks   = chunk;
+    arena->size     = length;
+    arena->low      = chunk->data;
+    arena->high     = chunk->data + length;
+
+    return true;
+}
+
+// Allocate a zeroed, aligned record.
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    void *result;
+
+    size = (size + kArenaAlignment - 1) & ~(kArenaAlignment - 1);
+
+    // Chunks are only as aligned as malloc() makes them, so allow for
+    // aligning the start of the record.
+    if (!arena_reserve(arena, size + kArenaAlignment))
+        return NULL;
+
+    result      = (void *)(((uintptr_t) arena->low + kArenaAlignment - 1)
+                                & ~(kArenaAlignment - 1));
+    arena->low  = (char *) result + size;
+
+    return memset(result, 0, size);
+}
+
+char *arena_strdup(struct arena *arena, const char *string)
+{
+    size_t length = strlen(string) + 1;
+
+    if (!arena_reserve(arena, length))
+        return NULL;
+
+    arena->high -= length;
+
+    return memcpy(arena->high, string, length);
+}
+
+void arena_destroy(struct arena *arena)
+{
+    struct arena_chunk *chunk;
+
+    if (!arena)
+        return;
+
+    while ((chunk = arena->chunks)) {
+        arena->chunks = chunk->next;
+        free(chunk);
+    }
+
+    free(arena);
+}
+
+#if defined(ENABLE_RUNTIME_TESTS)
+
+static void __constructor test_arena(void)
+{
+    struct arena *arena = arena_create(1024);
+    uint64_t *first;
+    uint64_t *second;
+    char *string;
+    unsigned i;
+
+    assert(arena);
+
+    first  = arena_alloc(arena, sizeof *first);
+    second = arena_alloc(arena, sizeof *second);
+    string = arena_strdup(arena, "hello");
+
+    // Records are contiguous, and strings don't come between them.
+    assert(first && second && string);
+    assert((char *) second - (char *) first == kArenaAlignment);
+    assert(((uintptr_t) second & (kArenaAlignment - 1)) == 0);
+    assert(*second == 0);
+    assert(strcmp(string, "hello") == 0);
+
+    // Overflow into new chunks, earlier allocations must not move.
+    for (i = 0; i < 1000; i++) {
+        assert(arena_alloc(arena, 100));
+        assert(arena_strdup(arena, "a string in a new chunk"));
+    }
+
+    assert(arena_alloc(arena, 65536));
+    assert(arena->chunks != NULL);
+    assert(strcmp(string, "hello") == 0);
+
+    arena_destroy(arena);
+}
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef __ARENA_H
+#define __ARENA_H
+
+// A region allocator for data that lives exactly as long as the registry.
+// Records are allocated upwards from the start of a chunk and strings
+// downwards from the end, so records allocated together are contiguous.
+// Nothing is freed individually, the whole arena is released at once.
+
+struct arena_chunk;
+
+struct arena {
+    char                *low;
+    char                *high;
+    size_t               size;
+    struct arena_chunk  *chunks;
+};
+
+struct arena *arena_create(size_t size);
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strdup(struct arena *arena, const char *string);
+void arena_destroy(struct arena *arena);
+
+#endif
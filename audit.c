@@ -0,0 +1,365 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Author: taviso@google.com
+//
+// Binary audit log of policy decisions.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#define LOG_MODULE LOG_MODULE_AUDIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "log.h"
+#include "npapi.h"
+#include "npfunctions.h"
+#include "config.h"
+#include "audit.h"
+
+// Every decision made in netscape_plugin_new() can be recorded here for
+// consumption by external monitoring. Formatting text is too expensive and
+// too difficult to parse reliably, so instead fixed size records are copied
+// into a shared mapping of a size-bounded ring file. The oldest records are
+// overwritten when the ring is full.
+
+static struct audit_header *audit_header;
+static struct audit_record *audit_ring;
+static size_t               audit_mapping_size;
+
+// Check the header written by another process matches this layout.
+static bool audit_compatible(const struct audit_header *header, uint32_t capacity)
+{
+    return header->magic == AUDIT_MAGIC
+        && header->version == AUDIT_VERSION
+        && header->record_size == sizeof(struct audit_record)
+        && header->capacity == capacity;
+}
+
+// Create an empty ring of capacity records in fd, which must be a new file.
+static struct audit_header *audit_initialize(int fd, size_t size, uint32_t capacity)
+{
+    struct audit_header *header;
+
+    if (ftruncate(fd, size) != 0) {
+        return NULL;
+    }
+
+    header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (header == MAP_FAILED) {
+        return NULL;
+    }
+
+    header->version     = AUDIT_VERSION;
+    header->record_size = sizeof(struct audit_record);
+    header->capacity    = capacity;
+
+    // Written last, so a reader never sees a valid partial header.
+    __atomic_store_n(&header->magic, AUDIT_MAGIC, __ATOMIC_RELEASE);
+
+    return header;
+}
+
+// Map the audit log at path, creating it if necessary. If the file already
+// exists with a compatible layout it is reused, so that multiple browser
+// processes can append to the same ring.
+//
+// Otherwise, other processes may still have the old ring mapped, so it can't
+// be resized (they would fault) or cleared (their records would be lost).
+// Instead a new ring is created beside it and renamed over it, and they
+// carry on writing to the old one until they're restarted.
+bool audit_open(const char *path, size_t size)
+{
+    struct audit_header *header;
+    struct stat          filestat;
+    struct stat          pathstat;
+    uint32_t             capacity;
+    char                 temporary[PATH_MAX];
+    int                  replacement;
+    int                  fd;
+
+    // Check this is big enough to hold at least one record.
+    if (size < sizeof(struct audit_header) + sizeof(struct audit_record)) {
+        l_warning("audit log size %zu is too small", size);
+        return false;
+    }
+
+    capacity = (size - sizeof(struct audit_header))
+                    / sizeof(struct audit_record);
+    size     = sizeof(struct audit_header)
+                    + capacity * sizeof(struct audit_record);
+
+  retry:
+    if ((fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600)) < 0) {
+        l_warning("failed to open audit log %s", path);
+        return false;
+    }
+
+    // Serialize initialization with other browser processes.
+    if (flock(fd, LOCK_EX) != 0 || fstat(fd, &filestat) != 0) {
+        l_warning("failed to lock audit log %s", path);
+        goto error;
+    }
+
+    // Another process may have replaced the log while we waited.
+    if (stat(path, &pathstat) != 0
+            || pathstat.st_dev != filestat.st_dev
+            || pathstat.st_ino != filestat.st_ino) {
+        flock(fd, LOCK_UN);
+        close(fd);
+        goto retry;
+    }
+
+    // A new file can be initialized in place, nobody else has mapped it.
+    if (filestat.st_size == 0) {
+        l_debug("initializing new audit log %s, %u records", path, capacity);
+
+        if (!(header = audit_initialize(fd, size, capacity))) {
+            l_warning("failed to initialize audit log %s", path);
+            goto error;
+        }
+
+        goto finished;
+    }
+
+    header = MAP_FAILED;
+
+    if ((size_t) filestat.st_size == size) {
+        header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+
+    if (header != MAP_FAILED && audit_compatible(header, capacity)) {
+        goto finished;
+    }
+
+    if (header != MAP_FAILED) {
+        munmap(header, size);
+    }
+
+    l_debug("replacing incompatible audit log %s, %u records", path, capacity);
+
+    if (snprintf(temporary, sizeof temporary, "%s.XXXXXX", path) >= (int) sizeof temporary
+            || (replacement = mkstemp(temporary)) < 0) {
+        l_warning("failed to create a new audit log beside %s", path);
+        goto error;
+    }
+
+    if (!(header = audit_initialize(replacement, size, capacity))
+            || rename(temporary, path) != 0) {
+        l_warning("failed to replace audit log %s", path);
+
+        if (header) {
+            munmap(header, size);
+        }
+
+        unlink(temporary);
+        close(replacement);
+        goto error;
+    }
+
+    close(replacement);
+
+  finished:
+    // Replace any existing mapping.
+    audit_close();
+
+    audit_header       = header;
+    audit_ring         = (struct audit_record *)(header + 1);
+    audit_mapping_size = size;
+
+    // The mapping holds a reference to the file, so the lock must be
+    // released explicitly.
+    flock(fd, LOCK_UN);
+    close(fd);
+    return true;
+
+  error:
+    flock(fd, LOCK_UN);
+    close(fd);
+    return false;
+}
+
+void audit_close(void)
+{
+    if (audit_header) {
+        munmap(audit_header, audit_mapping_size);
+    }
+
+    audit_header = NULL;
+    audit_ring   = NULL;
+}
+
+// Copy at most size - 1 bytes of source into destination, which must be
+// zeroed already.
+static void audit_copy_field(char *destination,
+                             size_t size,
+                             const char *source,
+                             size_t length)
+{
+    if (source) {
+        memcpy(destination, source, length < size ? length : size - 1);
+    }
+}
+
+// Record a policy decision. The record is assembled on the stack, a slot is
+// reserved with a single atomic increment, and then it's copied into place
+// with the sequence number written last, see audit.h.
+void audit_decision(const char *section,
+                    const char *mimetype,
+                    const char *url,
+                    unsigned verdict,
+                    unsigned reason)
+{
+    struct audit_record  record = {0};
+    struct audit_record *slot;
+    struct timespec      now;
+    const char          *host;
+    uint64_t             sequence;
+
+    // Auditing is not enabled.
+    if (__builtin_expect(audit_header == NULL, true)) {
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    record.timestamp = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    record.pid       = getpid();
+    record.verdict   = verdict;
+    record.reason    = reason;
+
+    // Only the origin is recorded, the path might be sensitive.
+    //
+    //  https://www.foo.com/blah?blah=blah => https://www.foo.com
+    //
+    if (url && (host = strstr(url, "://"))) {
+        audit_copy_field(record.origin,
+                         sizeof record.origin,
+                         url,
+                         host - url + 3 + strcspn(host + 3, "/?#"));
+    }
+
+    if (section) {
+        audit_copy_field(record.section,
+                         sizeof record.section,
+                         section,
+                         strlen(section));
+    }
+
+    if (mimetype) {
+        audit_copy_field(record.mimetype,
+                         sizeof record.mimetype,
+                         mimetype,
+                         strlen(mimetype));
+    }
+
+    // Sequence numbers start at one, so that unused slots can be recognised.
+    sequence = __atomic_fetch_add(&audit_header->sequence,
+                                  1,
+                                  __ATOMIC_RELAXED);
+    slot     = &audit_ring[sequence % audit_header->capacity];
+
+    // Readers must see the slot is unused before any of the changes.
+    __atomic_store_n(&slot->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy((char *) slot + sizeof slot->sequence,
+           (char *) &record + sizeof record.sequence,
+           sizeof record - sizeof record.sequence);
+
+    // Publish the record.
+    __atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELEASE);
+}
+
+static void __destructor fini_audit_log(void)
+{
+    audit_close();
+}
+
+#if defined(ENABLE_RUNTIME_TESTS)
+
+static void __constructor test_audit_log(void)
+{
+    char path[] = "/tmp/nssecurity-audit-test-XXXXXX";
+    size_t size = sizeof(struct audit_header) + 2 * sizeof(struct audit_record);
+    struct audit_header *other;
+    struct stat info;
+    int fd;
+
+    assert(sizeof(struct audit_header) == 64);
+    assert(sizeof(struct audit_record) == 256);
+
+    assert((fd = mkstemp(path)) >= 0);
+    close(fd);
+
+    assert(audit_open(path, 16) == false);
+    assert(audit_open(path, size) == true);
+    assert(audit_header->capacity == 2);
+
+    audit_decision("Test", "application/x-test", "https://www.foo.com/bar?baz",
+                   AUDIT_VERDICT_ALLOW, AUDIT_REASON_PERMITTED);
+    audit_decision("Test", "application/x-test", "http://evil.com",
+                   AUDIT_VERDICT_DENY, AUDIT_REASON_POLICY);
+    audit_decision(NULL, "application/x-test", NULL,
+                   AUDIT_VERDICT_DENY, AUDIT_REASON_NO_HANDLER);
+
+    assert(audit_header->sequence == 3);
+    assert(audit_ring[0].sequence == 3);
+    assert(audit_ring[1].sequence == 2);
+    assert(strcmp(audit_ring[1].origin, "http://evil.com") == 0);
+    assert(audit_ring[0].reason == AUDIT_REASON_NO_HANDLER);
+
+    // Reopening should preserve the ring.
+    assert(audit_open(path, size) == true);
+    assert(audit_header->sequence == 3);
+
+    audit_decision("Test", "application/x-test", "https://www.foo.com/bar?baz",
+                   AUDIT_VERDICT_ALLOW, AUDIT_REASON_PERMITTED);
+
+    assert(strcmp(audit_ring[1].origin, "https://www.foo.com") == 0);
+    assert(audit_ring[1].verdict == AUDIT_VERDICT_ALLOW);
+
+    // Another process still using the log keeps its ring when it's resized.
+    assert((fd = open(path, O_RDWR)) >= 0);
+    assert((other = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED);
+    close(fd);
+
+    assert(audit_open(path, size + sizeof(struct audit_record)) == true);
+    assert(audit_header->capacity == 3);
+    assert(audit_header->sequence == 0);
+    assert(stat(path, &info) == 0);
+    assert((size_t) info.st_size == size + sizeof(struct audit_record));
+    assert((info.st_mode & 0777) == 0600);
+
+    assert(other->sequence == 4);
+    assert(other->capacity == 2);
+    munmap(other, size);
+
+    audit_close();
+    unlink(path);
+}
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef __AUDIT_H
+#define __AUDIT_H
+
+// The on-disk layout of the audit log. This is shared with the
+// nssecurity-audit reader, so any incompatible change must bump the version.
+//
+// The file is a header followed by a ring of fixed size records. Writers
+// reserve a slot by atomically incrementing the sequence number in the
+// header, so multiple browser processes can share one file. The record's own
+// sequence number is cleared before it's written and set last, so readers
+// copy a record and check its sequence before and after, as in cache.c. A
+// writer that is lapped by the whole ring while copying can still leave a
+// mixed record behind.
+
+#define AUDIT_MAGIC             0x5541534e      // "NSAU"
+#define AUDIT_VERSION           1
+#define AUDIT_DEFAULT_SIZE      (1 << 20)
+
+enum {
+    AUDIT_VERDICT_DENY,
+    AUDIT_VERDICT_ALLOW,
+};
+
+enum {
+    AUDIT_REASON_PERMITTED,
+    AUDIT_REASON_INVALID_MIME,
+    AUDIT_REASON_UNKNOWN_URL,
+    AUDIT_REASON_POLICY,
+    AUDIT_REASON_NO_HANDLER,
+    AUDIT_REASON_MAP_FAILED,
+    AUDIT_REASON_MAX,
+};
+
+struct audit_header {
+    uint32_t    magic;
+    uint16_t    version;
+    uint16_t    record_size;
+    uint32_t    capacity;
+    uint32_t    reserved;
+    uint64_t    sequence;
+    uint8_t     padding[40];
+};
+
+struct audit_record {
+    uint64_t    sequence;
+    uint64_t    timestamp;
+    uint32_t    pid;
+    uint8_t     verdict;
+    uint8_t     reason;
+    uint16_t    reserved;
+    char        section[48];
+    char        mimetype[64];
+    char        origin[120];
+};
+
+bool audit_open(const char *path, size_t size);
+void audit_close(void);
+void audit_decision(const char *section,
+                    const char *mimetype,
+                    const char *url,
+                    unsigned verdict,
+                    unsigned reason);
+
+#endif
@@ -0,0 +1,298 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Author: taviso@google.com
+//
+// A shared domain matcher for every plugin.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#define LOG_MODULE LOG_MODULE_POLICY
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fnmatch.h>
+#include <assert.h>
+
+#include "npapi.h"
+#include "npfunctions.h"
+#include "config.h"
+#include "arena.h"
+#include "policy.h"
+#include "log.h"
+#include "automaton.h"
+
+// When a MIME type is claimed by several plugins, each plugin's domains used
+// to be matched against the same hostname separately, and many sections
+// share most of their domains. Instead, exact domains and *.suffix globs from
+// every plugin are inserted into one trie, keyed by the hostname read
+// backwards, so that common suffixes like .google.com are shared.
+//
+// Walking the hostname from the end, every node passed contributes the
+// plugins with a *suffix ending there, and the node reached at the start of
+// the hostname contributes the plugins with that exact domain. Anything else
+// is left to fnmatch(), exactly as policy_plugin_allowed_domain() would.
+
+// A node under construction, the trie is built in a temporary array and then
+// moved into the arena.
+struct automaton_builder {
+    struct automaton_node  *nodes;
+    uint32_t                count;
+    uint32_t                capacity;
+};
+
+static struct automaton_node *automaton_child(const struct automaton_node *nodes,
+                                              const struct automaton_node *node,
+                                              char c)
+{
+    uint32_t index;
+
+    for (index = node->child; index; index = nodes[index].sibling) {
+        if (nodes[index].c == c)
+            return (struct automaton_node *) &nodes[index];
+    }
+
+    return NULL;
+}
+
+// Find or create the node for the reverse of string.
+static struct automaton_node *automaton_insert(struct automaton_builder *builder,
+                                               const char *string)
+{
+    struct automaton_node *nodes;
+    struct automaton_node *child;
+    uint32_t               node = 0;
+    size_t                 length = strlen(string);
+
+    while (length--) {
+        if ((child = automaton_child(builder->nodes, &builder->nodes[node], string[length]))) {
+            node = child - builder->nodes;
+            continue;
+        }
+
+        if (builder->count == builder->capacity) {
+            if (!(nodes = realloc(builder->nodes,
+                                  builder->capacity * 2 * sizeof *nodes))) {
+                return NULL;
+            }
+
+            builder->nodes     = nodes;
+            builder->capacity *= 2;
+        }
+
+        child = &builder->nodes[builder->count];
+
+        memset(child, 0, sizeof *child);
+
+        child->c       = string[length];
+        child->sibling = builder->nodes[node].child;
+
+        builder->nodes[node].child = builder->count;
+
+        node = builder->count++;
+    }
+
+    return &builder->nodes[node];
+}
+
+// Compile the domains of every plugin, the bit for each plugin is its
+// position in the list.
+struct automaton *automaton_compile(struct arena *arena, const struct plugin *plugins)
+{
+    struct automaton_builder builder = {0};
+    struct automaton        *automaton = NULL;
+    struct automaton_node   *node;
+    const struct plugin     *current;
+    const char              *domain;
+    uint64_t                 bit;
+    uint32_t                 globs = 0;
+    uint32_t                 i;
+
+    if (!(builder.nodes = calloc(builder.capacity = 64, sizeof *builder.nodes))) {
+        goto cleanup;
+    }
+
+    builder.count = 1;
+
+    if (!(automaton = arena_alloc(arena, sizeof *automaton))) {
+        goto cleanup;
+    }
+
+    // Count the globs that need fnmatch(), so they can be allocated at once.
+    for (current = plugins, bit = 1; current && bit; current = current->next, bit <<= 1) {
+        for (i = 0; i < current->policy.domain_count; i++) {
+            domain = current->policy.domains[i];
+
+            if (strpbrk(domain[0] == '*' ? domain + 1 : domain, "*?["))
+                globs++;
+        }
+    }
+
+    if (globs && !(automaton->globs = arena_alloc(arena, globs * sizeof *automaton->globs))) {
+        automaton = NULL;
+        goto cleanup;
+    }
+
+    for (current = plugins, bit = 1; current && bit; current = current->next, bit <<= 1) {
+        if (current->policy.flags & POLICY_ALLOW_INSECURE)
+            automaton->insecure |= bit;
+
+        for (i = 0; i < current->policy.domain_count; i++) {
+            domain = current->policy.domains[i];
+
+            if (strpbrk(domain[0] == '*' ? domain + 1 : domain, "*?[")) {
+                automaton->globs[automaton->glob_count].pattern = domain;
+                automaton->globs[automaton->glob_count].plugin  = bit;
+                automaton->glob_count++;
+                continue;
+            }
+
+            if (!(node = automaton_insert(&builder, domain[0] == '*' ? domain + 1 : domain))) {
+                automaton = NULL;
+                goto cleanup;
+            }
+
+            if (domain[0] == '*') {
+                node->suffix |= bit;
+            } else {
+                node->exact |= bit;
+            }
+        }
+    }
+
+    if (!(automaton->nodes = arena_alloc(arena, builder.count * sizeof *builder.nodes))) {
+        automaton = NULL;
+        goto cleanup;
+    }
+
+    memcpy(automaton->nodes, builder.nodes, builder.count * sizeof *builder.nodes);
+
+    automaton->node_count = builder.count;
+
+    l_debug("compiled domains into %u nodes and %u globs",
+            automaton->node_count,
+            automaton->glob_count);
+
+  cleanup:
+    if (!automaton)
+        l_error("memory allocation failure compiling domains");
+
+    free(builder.nodes);
+    return automaton;
+}
+
+// Return the set of plugins whose domains match hostname. The hostname must
+// already have been reduced for the plugins of interest, see policy.c.
+uint64_t automaton_match(const struct automaton *automaton, const char *hostname)
+{
+    const struct automaton_node *node = automaton->nodes;
+    uint64_t                     allowed = node->suffix;
+    size_t                       length = strlen(hostname);
+    uint32_t                     i;
+
+    while (length && (node = automaton_child(automaton->nodes, node, hostname[--length]))) {
+        allowed |= node->suffix;
+    }
+
+    // Only an exact domain if the whole hostname was consumed.
+    if (node && length == 0) {
+        allowed |= node->exact;
+    }
+
+    for (i = 0; i < automaton->glob_count; i++) {
+        if (allowed & automaton->globs[i].plugin)
+            continue;
+
+        if (fnmatch(automaton->globs[i].pattern, hostname, FNM_NOESCAPE) == 0)
+            allowed |= automaton->globs[i].plugin;
+    }
+
+    return allowed;
+}
+
+#if defined(ENABLE_RUNTIME_TESTS)
+
+// The set must always agree with policy_plugin_allowed_url().
+static void __constructor test_automaton(void)
+{
+    static const char *kSections[][3] = {
+        { "Wildcard",   "*.google.com,google.com,*.safe.com",           NULL },
+        { "Shared",     "*.google.com,www.foo.com",                     "AllowInsecure" },
+        { "Globs",      "a?c.example.com,[ab]*.test.org,*.g*gle.com",   "AllowPort" },
+        { "Anything",   "*",                                            "AllowAuth" },
+        { "Suffix",     "*com,x.y",                                     "AllowPort" },
+        { "Nothing",    "",                                             NULL },
+        { "Exact",      "google.com,oogle.com,Google.com",              "AllowInsecure" },
+    };
+    static const char *kUrls[] = {
+        "https://google.com/", "https://www.google.com/x", "http://www.google.com/",
+        "https://google.com.evil.com/", "https://xgoogle.com/", "https://oogle.com",
+        "https://www.safe.com//", "http://www.foo.com/", "ftp://www.foo.com/",
+        "https://abc.example.com/", "https://a.c.example.com/", "https://b1.test.org",
+        "https://www.gooogle.com/", "https://com/", "https://x.y/",
+        "https://www.google.com:8443/", "https://user:pw@www.google.com/",
+        "https://www.google.com:@evil.com/", "https://www.google.com:80a/",
+        "https://WWW.GOOGLE.COM/", "data://www.google.com/,evil", "https:///",
+        "http://abc.example.com:8080/",
+    };
+    struct registry test = {0};
+    struct plugin  *plugin;
+    unsigned char   saved[LOG_MODULE_MAX];
+    uint64_t        allowed;
+    unsigned        i;
+    unsigned        j;
+
+    // Invalid URLs log warnings, which would just be noise here.
+    memcpy(saved, log_verbosity, sizeof saved);
+    log_set_verbosity("none");
+
+    for (i = 0; i < sizeof kSections / sizeof *kSections; i++) {
+        assert(config_set(&test, kSections[i][0], "AllowedDomains", kSections[i][1]) == true);
+
+        if (kSections[i][2])
+            assert(config_set(&test, kSections[i][0], kSections[i][2], "1") == true);
+    }
+
+    for (plugin = test.plugins; plugin; plugin = plugin->next) {
+        policy_compile(test.arena, plugin, NULL);
+    }
+
+    assert((test.automaton = automaton_compile(test.arena, test.plugins)));
+    assert(test.automaton->glob_count == 3);
+
+    for (j = 0; j < sizeof kUrls / sizeof *kUrls; j++) {
+        allowed = policy_allowed_set(&test, kUrls[j]);
+
+        for (plugin = test.plugins, i = 0; plugin; plugin = plugin->next, i++) {
+            assert(!!(allowed & (1ULL << i))
+                        == policy_plugin_allowed_url(plugin, (char *) kUrls[j]));
+        }
+    }
+
+    // Suffixes are shared between plugins.
+    allowed = policy_allowed_set(&test, "https://www.google.com/");
+    assert(allowed == ((1 << 0) | (1 << 1) | (1 << 2) | (1 << 3) | (1 << 4)));
+
+    // AllowAuth and AllowPort don't let credentials or a port match.
+    assert(policy_allowed_set(&test, "https://user:pw@www.google.com/") == 0);
+    assert(policy_allowed_set(&test, "https://www.google.com:8443/") == 0);
+
+    memcpy(log_verbosity, saved, sizeof saved);
+
+    config_destroy(&test);
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef __AUTOMATON_H
+#define __AUTOMATON_H
+
+// Every plugin's AllowedDomains compiled into one trie over the reversed
+// hostname, so that a single walk finds the set of plugins a hostname is
+// allowed to load. Only the first AUTOMATON_MAX_PLUGINS plugins are included,
+// any others are checked individually.
+#define AUTOMATON_MAX_PLUGINS   64
+
+struct automaton_node {
+    uint64_t        exact;          // plugins with a domain ending here.
+    uint64_t        suffix;         // plugins with *domain ending here.
+    uint32_t        child;          // first child, or zero.
+    uint32_t        sibling;        // next child of our parent, or zero.
+    char            c;
+};
+
+// A glob that isn't an exact domain or a *.suffix, matched with fnmatch().
+struct automaton_glob {
+    const char     *pattern;
+    uint64_t        plugin;
+};
+
+struct automaton {
+    uint32_t        node_count;
+    uint32_t        glob_count;
+    struct automaton_node *nodes;   // nodes[0] is the root.
+    struct automaton_glob *globs;
+    uint64_t        insecure;       // plugins with AllowInsecure.
+};
+
+struct automaton *automaton_compile(struct arena *arena, const struct plugin *plugins);
+uint64_t automaton_match(const struct automaton *automaton, const char *hostname);
+
+#endif
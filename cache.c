@@ -0,0 +1,451 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Author: taviso@google.com
+//
+// Policy decisions shared between processes.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#define LOG_MODULE LOG_MODULE_POLICY
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "npapi.h"
+#include "npfunctions.h"
+#include "config.h"
+#include "cache.h"
+
+// Browsers start a lot of processes, and each of them would otherwise make
+// the same decisions again. With DecisionCache set, every process of the same
+// user maps one POSIX shared memory segment, and publishes the verdicts it
+// makes there for the others.
+//
+// The segment is an open addressed table, and nothing ever waits for a lock.
+// Each entry has a sequence number, which a writer makes odd while it's
+// changing the entry and even again once it's finished. Readers copy the
+// entry and check the sequence didn't change, otherwise it's a miss. If two
+// writers want the same entry, the loser just doesn't publish.
+//
+// Every entry records the checksum of the policy that made it, and the header
+// records the newest policy to publish anything. Publishing a verdict from a
+// different policy replaces the checksum, which invalidates every entry at
+// once, and stale entries are reused as they're found.
+
+struct cache_segment *cache_segment;
+
+// Produce the segment name for this user.
+static void cache_segment_name(char *name, size_t size)
+{
+    snprintf(name, size, "/%s%u", CACHE_PREFIX, (unsigned) geteuid());
+}
+
+// Map the segment called name, creating it with capacity entries if it
+// doesn't already exist. If another process created it, its capacity is used.
+static struct cache_segment *cache_segment_map(const char *name, uint32_t capacity)
+{
+    struct cache_segment *segment;
+    struct stat           buf;
+    size_t                size;
+    bool                  created = true;
+    int                   fd;
+
+    size = sizeof *segment + capacity * sizeof(struct cache_entry);
+
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) < 0) {
+        if (errno != EEXIST || (fd = shm_open(name, O_RDWR | O_CLOEXEC, 0)) < 0) {
+            l_debug("failed to open decision cache %s", name);
+            return NULL;
+        }
+
+        created = false;
+    }
+
+    if (fstat(fd, &buf) != 0) {
+        l_debug("failed to stat decision cache %s", name);
+        goto error;
+    }
+
+    // Anything that can write to the segment can decide which sites load
+    // plugins, so it must be ours and nobody else's.
+    if (buf.st_uid != geteuid() || (buf.st_mode & (S_IRWXG | S_IRWXO))) {
+        l_warning("decision cache %s is accessible to other users, ignoring", name);
+        goto error;
+    }
+
+    if (created && ftruncate(fd, size) != 0) {
+        l_debug("failed to resize decision cache %s", name);
+        goto error;
+    }
+
+    // If another process is still creating it, don't wait.
+    if (!created) {
+        if (buf.st_size < (off_t) sizeof *segment) {
+            l_debug("decision cache %s is not ready yet", name);
+            goto error;
+        }
+
+        size = buf.st_size;
+    }
+
+    segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (segment == MAP_FAILED) {
+        l_debug("failed to map decision cache %s", name);
+        goto error;
+    }
+
+    close(fd);
+
+    if (created) {
+        segment->version  = CACHE_VERSION;
+        segment->capacity = capacity;
+        __atomic_store_n(&segment->magic, CACHE_MAGIC, __ATOMIC_RELEASE);
+        return segment;
+    }
+
+    if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != CACHE_MAGIC
+            || segment->version != CACHE_VERSION
+            || segment->capacity == 0
+            || segment->capacity & (segment->capacity - 1)
+            || sizeof *segment + segment->capacity * sizeof(struct cache_entry) > size) {
+        l_debug("decision cache %s is not ready, or from another version", name);
+        munmap(segment, size);
+        return NULL;
+    }
+
+    return segment;
+
+  error:
+    close(fd);
+    return NULL;
+}
+
+// Map the decision cache for this user, with at least capacity entries if
+// it has to be created. Only the first call does anything.
+bool cache_open(uint32_t capacity)
+{
+    struct cache_segment *segment;
+    char                  name[64];
+
+    if (cache_segment) {
+        return true;
+    }
+
+    // Round up to a power of two, so that the hash can be masked.
+    if (capacity < CACHE_PROBE_MAX || capacity > 1 << 20) {
+        l_warning("DecisionCache must be between %u and %u entries, not %u",
+                  CACHE_PROBE_MAX, 1 << 20, capacity);
+        return false;
+    }
+
+    capacity = 1U << (32 - __builtin_clz(capacity - 1));
+
+    cache_segment_name(name, sizeof name);
+
+    if (!(segment = cache_segment_map(name, capacity))) {
+        return false;
+    }
+
+    l_debug("mapped decision cache %s with %u entries", name, segment->capacity);
+
+    __atomic_store_n(&cache_segment, segment, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Everything that can change a decision, the section names in order, their
+// flags, their networks and their domains.
+uint64_t cache_checksum(const struct registry *registry)
+{
+    const struct plugin *current;
+    const char          *string;
+    uint64_t             hash = 0xcbf29ce484222325ULL ^ CACHE_VERSION;
+    uint32_t             i;
+
+    for (current = registry->plugins; current; current = current->next) {
+        hash ^= current->policy.flags;
+        hash *= 0x100000001b3ULL;
+
+        for (i = 0; i <= current->policy.domain_count + 1; i++) {
+            string = i == 0 ? current->section
+                   : i == 1 ? current->allow_networks ? current->allow_networks : ""
+                   : current->policy.domains[i - 2];
+
+            // Include the nul, so that the boundaries are part of the hash.
+            do {
+                hash ^= (unsigned char) *string;
+                hash *= 0x100000001b3ULL;
+            } while (*string++);
+        }
+
+        hash ^= 0xff;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+// Build the key for section and the origin of url, everything a decision
+// depends on. Returns zero if the url can't be cached, otherwise the length.
+static uint32_t cache_key(char *key,
+                          const char *section,
+                          const char *url,
+                          uint64_t *hash)
+{
+    const char *host;
+    size_t      prefix;
+    size_t      length;
+    uint32_t    i;
+
+    if (!(host = strstr(url, "://"))
+            || strspn(url, "abcdefghijklmnopqrstuvwxyz") != (size_t)(host - url)) {
+        return 0;
+    }
+
+    prefix = strlen(section) + 1;
+    length = host + 3 - url + strcspn(host + 3, "/");
+
+    if (prefix + length > CACHE_KEY_MAX) {
+        return 0;
+    }
+
+    memcpy(key, section, prefix);
+    memcpy(key + prefix, url, length);
+
+    for (i = 0; i < prefix + length; i++) {
+        *hash ^= (unsigned char) key[i];
+        *hash *= 0x100000001b3ULL;
+    }
+
+    return prefix + length;
+}
+
+// Find the verdict for section on url, made by the policy with checksum.
+bool cache_lookup(uint64_t checksum,
+                  const char *section,
+                  const char *url,
+                  uint64_t *verdict)
+{
+    struct cache_segment *segment = __atomic_load_n(&cache_segment, __ATOMIC_ACQUIRE);
+    struct cache_entry   *entry;
+    char                  key[CACHE_KEY_MAX];
+    uint64_t              hash = checksum;
+    uint64_t              value;
+    uint32_t              sequence;
+    uint32_t              length;
+    uint32_t              probe;
+    bool                  match;
+
+    if (!segment || __atomic_load_n(&segment->checksum, __ATOMIC_RELAXED) != checksum) {
+        return false;
+    }
+
+    if (!(length = cache_key(key, section, url, &hash))) {
+        return false;
+    }
+
+    for (probe = 0; probe < CACHE_PROBE_MAX; probe++) {
+        entry    = &segment->entries[(hash + probe) & (segment->capacity - 1)];
+        sequence = __atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE);
+
+        // Entries are never emptied, so nothing is beyond an empty one.
+        if (sequence == 0)
+            break;
+
+        if (sequence & 1)
+            continue;
+
+        match = __atomic_load_n(&entry->checksum, __ATOMIC_RELAXED) == checksum
+             && __atomic_load_n(&entry->length, __ATOMIC_RELAXED) == length
+             && memcmp(entry->key, key, length) == 0;
+        value = __atomic_load_n(&entry->verdict, __ATOMIC_RELAXED);
+
+        // If it changed while we were looking, what we saw is meaningless.
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&entry->sequence, __ATOMIC_RELAXED) != sequence)
+            continue;
+
+        if (match) {
+            *verdict = value;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Publish the verdict for section on url, made by the policy with checksum.
+// This is best effort, it gives up rather than wait for another writer.
+void cache_publish(uint64_t checksum,
+                   const char *section,
+                   const char *url,
+                   uint64_t verdict)
+{
+    struct cache_segment *segment = __atomic_load_n(&cache_segment, __ATOMIC_ACQUIRE);
+    struct cache_entry   *entry;
+    struct cache_entry   *victim = NULL;
+    char                  key[CACHE_KEY_MAX];
+    uint64_t              hash = checksum;
+    uint32_t              sequence;
+    uint32_t              length;
+    uint32_t              probe;
+
+    if (!segment || !(length = cache_key(key, section, url, &hash))) {
+        return;
+    }
+
+    // If another policy published last, invalidate everything it made.
+    if (__atomic_load_n(&segment->checksum, __ATOMIC_RELAXED) != checksum) {
+        l_debug("decision cache was made by another policy, invalidating");
+        __atomic_store_n(&segment->checksum, checksum, __ATOMIC_RELAXED);
+    }
+
+    // Prefer an empty or stale entry, or this key if it's already there,
+    // otherwise replace whatever is in the first slot.
+    for (probe = 0; probe < CACHE_PROBE_MAX && !victim; probe++) {
+        entry    = &segment->entries[(hash + probe) & (segment->capacity - 1)];
+        sequence = __atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE);
+
+        if (sequence & 1)
+            continue;
+
+        if (sequence == 0
+                || __atomic_load_n(&entry->checksum, __ATOMIC_RELAXED) != checksum
+                || (__atomic_load_n(&entry->length, __ATOMIC_RELAXED) == length
+                    && memcmp(entry->key, key, length) == 0)) {
+            victim = entry;
+        }
+    }
+
+    if (!victim) {
+        victim = &segment->entries[hash & (segment->capacity - 1)];
+    }
+
+    sequence = __atomic_load_n(&victim->sequence, __ATOMIC_RELAXED);
+
+    if ((sequence & 1) || !__atomic_compare_exchange_n(&victim->sequence,
+                                                       &sequence,
+                                                       sequence + 1,
+                                                       false,
+                                                       __ATOMIC_ACQUIRE,
+                                                       __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    // Readers must see the odd sequence before any of the changes.
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&victim->checksum, checksum, __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->length, length, __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->verdict, verdict, __ATOMIC_RELAXED);
+    memcpy(victim->key, key, length);
+
+    __atomic_store_n(&victim->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+#if defined(ENABLE_RUNTIME_TESTS)
+
+// Two mappings of the same segment behave like two processes.
+static void __constructor test_cache(void)
+{
+    struct cache_segment *first;
+    struct cache_segment *second;
+    char                  name[64];
+    char                  url[64];
+    uint64_t              verdict;
+    unsigned              i;
+    int                   fd;
+
+    snprintf(name, sizeof name, "/%stest.%u", CACHE_PREFIX, (unsigned) getpid());
+
+    shm_unlink(name);
+
+    assert((first = cache_segment_map(name, 64)) != NULL);
+    assert((second = cache_segment_map(name, 4096)) != NULL);
+    assert(second->capacity == 64);
+
+    cache_segment = first;
+
+    assert(cache_lookup(1, "Test", "https://www.google.com/", &verdict) == false);
+
+    cache_publish(1, "Test", "https://www.google.com/foo", true);
+    cache_publish(1, "Test", "http://www.google.com/", false);
+    cache_publish(1, "Other", "https://www.google.com/", 0x5);
+
+    // Unparseable and oversized origins are never cached.
+    cache_publish(1, "Test", "www.google.com", true);
+    cache_publish(1, "Test", "https://www.google.com.aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa.com/", true);
+    assert(cache_lookup(1, "Test", "www.google.com", &verdict) == false);
+    assert(cache_lookup(1, "Test", "https://www.google.com.aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa.com/", &verdict) == false);
+
+    // The other process sees them, only the origin is part of the key.
+    cache_segment = second;
+
+    assert(cache_lookup(1, "Test", "https://www.google.com/bar", &verdict) == true && verdict == true);
+    assert(cache_lookup(1, "Test", "http://www.google.com/", &verdict) == true && verdict == false);
+    assert(cache_lookup(1, "Other", "https://www.google.com", &verdict) == true && verdict == 0x5);
+    assert(cache_lookup(1, "Test", "https://www.google.com:443/", &verdict) == false);
+    assert(cache_lookup(1, "Tes", "https://www.google.com/", &verdict) == false);
+
+    // A different policy invalidates everything.
+    cache_publish(2, "Test", "https://evil.com/", false);
+    assert(cache_lookup(1, "Test", "https://www.google.com/", &verdict) == false);
+    assert(cache_lookup(2, "Test", "https://www.google.com/", &verdict) == false);
+    assert(cache_lookup(2, "Test", "https://evil.com/", &verdict) == true && verdict == false);
+
+    // Filling the table evicts entries, but never produces a wrong answer.
+    for (i = 0; i < 1024; i++) {
+        snprintf(url, sizeof url, "https://%u.example.com/", i);
+        cache_publish(2, "Test", url, i & 1);
+    }
+
+    for (i = 0; i < 1024; i++) {
+        snprintf(url, sizeof url, "https://%u.example.com/", i);
+        assert(cache_lookup(2, "Test", url, &verdict) == false || verdict == (i & 1));
+    }
+
+    // An entry left half written by a process that died is skipped.
+    for (i = 0; i < first->capacity; i++) {
+        first->entries[i].sequence |= 1;
+    }
+
+    cache_publish(2, "Test", "https://www.google.com/", true);
+    assert(cache_lookup(2, "Test", "https://www.google.com/", &verdict) == false);
+
+    cache_segment = NULL;
+
+    munmap(first, sizeof *first + first->capacity * sizeof(struct cache_entry));
+    munmap(second, sizeof *second + second->capacity * sizeof(struct cache_entry));
+
+    // Segments that other users can write to are refused.
+    assert(shm_unlink(name) == 0);
+    assert((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) >= 0);
+    assert(fchmod(fd, 0666) == 0);
+    assert(cache_segment_map(name, 64) == NULL);
+    assert(close(fd) == 0);
+    assert(shm_unlink(name) == 0);
+}
+
+#endif
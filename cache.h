@@ -0,0 +1,43 @@
+#ifndef __CACHE_H
+#define __CACHE_H
+
+// A table of policy decisions shared by every process of the same user, see
+// cache.c. Change CACHE_VERSION if the layout changes.
+#define CACHE_MAGIC         0x4e534443
+#define CACHE_VERSION       1
+#define CACHE_PREFIX        "nssecurity-cache."
+#define CACHE_KEY_MAX       104     // section, nul, origin.
+#define CACHE_PROBE_MAX     8       // slots examined for each key.
+
+struct cache_entry {
+    uint32_t        sequence;       // odd while being written.
+    uint32_t        length;         // of the key.
+    uint64_t        checksum;       // of the policy that made the decision.
+    uint64_t        verdict;
+    char            key[CACHE_KEY_MAX];
+};
+
+struct cache_segment {
+    uint32_t        magic;
+    uint32_t        version;
+    uint32_t        capacity;       // entries, a power of two.
+    uint32_t        reserved;
+    uint64_t        checksum;       // only entries made by this policy are valid.
+    struct cache_entry entries[] __attribute__((aligned(64)));
+};
+
+// The segment in use, or NULL if DecisionCache isn't enabled.
+extern struct cache_segment *cache_segment;
+
+bool cache_open(uint32_t capacity);
+uint64_t cache_checksum(const struct registry *registry);
+bool cache_lookup(uint64_t checksum,
+                  const char *section,
+                  const char *url,
+                  uint64_t *verdict);
+void cache_publish(uint64_t checksum,
+                   const char *section,
+                   const char *url,
+                   uint64_t verdict);
+
+#endif
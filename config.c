@@ -17,6 +17,8 @@
 // limitations under the License.
 //
 
+#define LOG_MODULE LOG_MODULE_CONFIG
+
 #include <assert.h>
 #include <dlfcn.h>
 #include <stdbool.h>
@@ -25,6 +27,12 @@
 #include <unistd.h>
 #include <string.h>
 #include <pwd.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <strings.h>
+#include <pthread.h>
 
 #include "npapi.h"
 #include "npfunctions.h"
@@ -32,21 +40,118 @@
 #include "platform.h"
 #include "instance.h"
 #include "log.h"
+#include "audit.h"
+#include "logsink.h"
+#include "trace.h"
+#include "watchdog.h"
+#include "flight.h"
+#include "record.h"
+#include "histogram.h"
+#include "shim.h"
+#include "stats.h"
+#include "memory.h"
+#include "arena.h"
+#include "policy.h"
+#include "util.h"
+#include "image.h"
+#include "reload.h"
+#include "matcher.h"
+#include "automaton.h"
+#include "cache.h"
+#include "daemon.h"
 #include "ini.h"
 
-// The global registry of known plugins.
-struct registry registry;
+// The registry of known plugins loaded at startup, any loaded later by
+// reload.c are allocated.
+static struct registry registry;
+
+struct registry *global_registry = &registry;
+
+// Defined by nssecurity-compile, which links this file but parses the
+// configuration itself.
+extern const bool config_compiler __attribute__((weak));
+
+// The initial size of the registry arena, enough for a few dozen plugins.
+static const size_t kRegistryArenaSize = 16384;
+
+// The initial size of the section index, this must be a power of two.
+static const uint32_t kSectionIndexSize = 64;
+
+// FNV-1a, which is plenty for section names.
+static uint32_t config_hash(const char *string)
+{
+    uint32_t hash = 0x811c9dc5;
+
+    while (*string) {
+        hash ^= (unsigned char) *string++;
+        hash *= 0x01000193;
+    }
+
+    return hash;
+}
+
+// Find the slot in the section index for section, which is either the plugin
+// with that name or empty.
+static struct plugin **config_section_slot(struct registry *registry,
+                                           const char *section)
+{
+    uint32_t index = config_hash(section) & registry->section_mask;
+
+    while (registry->sections[index]) {
+        if (strcmp(registry->sections[index]->section, section) == 0)
+            break;
+
+        index = (index + 1) & registry->section_mask;
+    }
+
+    return &registry->sections[index];
+}
+
+// Double the size of the section index. The old index is left in the arena,
+// the total wasted is never more than the size of the final index.
+static bool config_section_grow(struct registry *registry)
+{
+    struct plugin **previous = registry->sections;
+    uint32_t        size     = registry->section_mask + 1;
+    uint32_t        i;
+
+    size = previous ? size * 2 : kSectionIndexSize;
+
+    if (!(registry->sections = arena_alloc(registry->arena, size * sizeof *previous))) {
+        registry->sections = previous;
+        return false;
+    }
+
+    registry->section_mask = size - 1;
+
+    for (i = 0; previous && i < size / 2; i++) {
+        if (previous[i]) {
+            *config_section_slot(registry, previous[i]->section) = previous[i];
+        }
+    }
+
+    return true;
+}
 
 // Find the matching plugin structure for the section name `section`. If no
 // such section exists, a new one is allocated and returned. If the section
 // name matches the special name "Global", it is added to the appropriate list.
 //
 // Returns true on success, false on failure.
-static bool find_plugin_section(struct registry *registry,
-                                const char *section,
-                                struct plugin **plugin)
+bool find_plugin_section(struct registry *registry,
+                         const char *section,
+                         struct plugin **plugin)
 {
-    struct plugin *current;
+    struct plugin **slot;
+
+    // Everything derived from the configuration is allocated from the
+    // registry arena, so that it's compact and can be released at once.
+    if (registry->arena == NULL) {
+        if ((registry->arena = arena_create(kRegistryArenaSize)) == NULL) {
+            l_error("memory allocation failure");
+            return false;
+        }
+    }
 
     // Check if this is the special "Global" section used to specify default
     // parameters and other special values.
@@ -57,14 +162,15 @@ static bool find_plugin_section(struct registry *registry,
         if (registry->global == NULL) {
 
             // Allocate a new structure.
-            if ((*plugin = calloc(1, sizeof(**plugin))) == NULL) {
+            if ((*plugin = arena_alloc(registry->arena, sizeof(**plugin))) == NULL) {
                 l_error("memory allocation failure");
                 return false;
             }
 
             // Install as the global plugin.
             registry->global            = *plugin;
-            registry->global->section   = strdup(section);
+            registry->global->section   = string_intern(section);
+            registry->global->registry  = registry;
         }
 
         // Return pointer to parent.
@@ -72,60 +178,346 @@ static bool find_plugin_section(struct registry *registry,
 
         // Success.
         return !! registry->global->section;
-    } else {
-        // This is not the Global section, a regular plugin section.
-        current = registry->plugins;
-
-        for (current = registry->plugins; current; current = current->next) {
-            // Search to see if we already recognise this section.
-            if (strcmp(current->section, section) == 0) {
-                // Match found.
-                *plugin = current;
+    }
 
-                return true;
-            }
+    // This is not the Global section, a regular plugin section. Keep the
+    // index at most half full, so probe sequences stay short.
+    if (registry->section_count >= (registry->section_mask + 1) / 2) {
+        if (!config_section_grow(registry)) {
+            l_error("memory allocation failure");
+            return false;
         }
     }
 
+    slot = config_section_slot(registry, section);
+
+    // Search to see if we already recognise this section.
+    if (*slot) {
+        *plugin = *slot;
+        return true;
+    }
+
     // This is the first time we've seen this section, we have to set it up.
     l_debug("new plugin section %s discovered", section);
 
     // Allocate a new structure.
-    if ((*plugin = calloc(1, sizeof(**plugin))) == NULL) {
+    if ((*plugin = arena_alloc(registry->arena, sizeof(**plugin))) == NULL) {
         l_error("memory allocation failure");
         return false;
     }
 
-    // Check if we have any other plugins registered.
-    if (registry->plugins != NULL) {
+    // Section names are recorded by the flight recorder, the trace and the
+    // watchdog, which can outlive this registry, so they're never freed.
+    if (((*plugin)->section = string_intern(section)) == NULL) {
+        l_error("memory allocation failure");
+        return false;
+    }
 
-        // Find the tail of the plugin registry.
-        for (current = registry->plugins; current->next; current = current->next)
-            ;
+    (*plugin)->registry = registry;
 
-        // Add to the list.
-        current->next = *plugin;
-        current = current->next;
-        current->section = strdup(section);
+    // Add to the end of the list, so plugins are tried in the order they
+    // appear in the configuration.
+    if (registry->tail) {
+        registry->tail->next = *plugin;
     } else {
-        // This is the first plugin structure we've seen, create the list head.
         registry->plugins = *plugin;
-        registry->plugins->section = strdup(section);
-        current = registry->plugins;
     }
 
+    registry->tail = *plugin;
+    registry->section_count++;
+
+    *slot = *plugin;
+
     // Success.
-    return !! current->section;
+    return true;
 }
 
 
-// This is a callback for parsing the ini files.
-static int config_ini_handler(struct registry *registry,
-                              const char *section,
-                              const char *name,
+// Directives that are applied immediately, rather than stored.
+static bool config_log_level(struct registry *registry __unused,
+                             struct plugin *plugin __unused,
+                             const char *value)
+{
+    // This is applied immediately so that the rest of the file is parsed with
+    // it, but the environment always has the final say.
+    log_set_verbosity(value);
+    return true;
+}
+
+static bool config_log_target(struct registry *registry __unused,
+                              struct plugin *plugin __unused,
                               const char *value)
 {
-    struct plugin *plugin;
+    logsink_set_target(value);
+    return true;
+}
+
+static bool config_trace_file(struct registry *registry __unused,
+                              struct plugin *plugin __unused,
+                              const char *value)
+{
+    trace_open(value);
+    return true;
+}
+
+static bool config_cpu_report(struct registry *registry __unused,
+                              struct plugin *plugin __unused,
+                              const char *value)
+{
+    shim_cpu_accounting(strtoul(value, NULL, 0));
+    return true;
+}
+
+static bool config_watchdog_threshold(struct registry *registry __unused,
+                                      struct plugin *plugin __unused,
+                                      const char *value)
+{
+    watchdog_start(strtoul(value, NULL, 0));
+    return true;
+}
+
+static bool config_watchdog_sample(struct registry *registry __unused,
+                                   struct plugin *plugin __unused,
+                                   const char *value)
+{
+    watchdog_sampling(strtoul(value, NULL, 0) != 0);
+    return true;
+}
+
+static bool config_crash_log(struct registry *registry __unused,
+                             struct plugin *plugin __unused,
+                             const char *value)
+{
+    flight_install(value);
+    return true;
+}
+
+// Find the plugin loaded from path in the registry being replaced, if any.
+static struct plugin *config_previous_plugin(struct registry *registry,
+                                             const char *path)
+{
+    struct plugin *current;
+
+    if (!registry->previous)
+        return NULL;
+
+    for (current = registry->previous->plugins; current; current = current->next) {
+        if (current->handle && strcmp(current->plugin, path) == 0)
+            return current;
+    }
+
+    return NULL;
+}
+
+static bool config_load_plugin(struct registry *registry,
+                               struct plugin *plugin,
+                               const char *value)
+{
+    struct plugin *previous;
+    char *mime_description;
+
+    // This one is interesting, we've been told about a new plugin binary
+    // we can try to load. Let's load it now, and keep a reference around
+    // to it.
+    plugin->plugin = registry->image
+                   ? (char *) value
+                   : arena_strdup(registry->arena, value);
+    plugin->handle = platform_dlopen(value);
+
+    // If we're reloading and this plugin was already loaded, the browser has
+    // initialised it, so keep using the same function table and statistics.
+    // We don't call into the plugin again from this thread.
+    if (plugin->handle && (previous = config_previous_plugin(registry, value))) {
+        plugin->plugin_funcs     = previous->plugin_funcs;
+        plugin->stats            = previous->stats;
+        plugin->mime_description = previous->mime_description
+                                 ? arena_strdup(registry->arena,
+                                                previous->mime_description)
+                                 : NULL;
+        memory_track(plugin);
+        return true;
+    }
+
+    // Statistics for calls to this plugin, see stats.c. If there are too
+    // many plugins, calls are recorded as unresolved. This is allocated
+    // now so that memory the plugin uses while loading is attributed to
+    // it, see memory.c.
+    if (plugin->handle) {
+        plugin->stats = stats_plugin_slot(plugin->section);
+        memory_track(plugin);
+    }
+
+    // The compiled policy already has the MIME types, see image.c.
+    if (registry->image) {
+        return true;
+    }
+
+    // Call the exported function to retrieve the MIME types supported, and
+    // move it into the arena with everything else. The types of every plugin
+    // are combined by config_mime_aggregate() once parsing is complete.
+    if ((mime_description = platform_getmimedescription(plugin))) {
+        plugin->mime_description = arena_strdup(registry->arena,
+                                                mime_description);
+        free(mime_description);
+    }
+
+    return true;
+}
+
+#define config_string(field)    offsetof(struct plugin, field), NULL
+#define config_handler(handler) 0, handler
+
+// Every recognised directive, which must be kept sorted by name so that
+// directives can be found with bsearch(). Directives with a handler are
+// processed immediately, anything else is stored as a string in the plugin
+// (the last occurrence wins) and interpreted later.
+static const struct directive {
+    const char  *name;
+    size_t       offset;
+    bool       (*handler)(struct registry *registry,
+                          struct plugin *plugin,
+                          const char *value);
+    bool         global;
+} kDirectives[] = {
+    // If a domain appears to contain HTTP authentication credentials, allow
+    // it to match. This is not recommended due to some ambiguities parsing
+    // URLs it introduces.
+    { "AllowAuth",          config_string(allow_auth),          false },
+
+    // Disables mandatory https pages for AllowedDomains. This is not
+    // recommended, but can be used if absolutely necessary.
+    //  AllowInsecure=1
+    { "AllowInsecure",      config_string(allow_insecure),      false },
+
+    // If a domain contains a port specification, allow it to match. This has
+    // some security implications with AllowInsecure=1, and so is not
+    // recommended.
+    { "AllowPort",          config_string(allow_port),          false },
+
+    // A whitelist of domains allowed to load the specified plugin. It is
+    // passed to fnmatch(), so shell-style globbing is permitted.
+    //  AllowedDomains=*.corp.google.com
+    { "AllowedDomains",     config_string(allow_domains),       false },
+
+    // A whitelist of networks allowed to load the specified plugin from an IP
+    // address, in CIDR notation, see radix.c.
+    //  AllowedNetworks=10.4.0.0/16,2001:db8::/32
+    { "AllowedNetworks",    config_string(allow_networks),      false },
+
+    // A file to record every policy decision in, see audit.c. This is a
+    // binary format, use nssecurity-audit to read it.
+    //  AuditLog=/var/log/nssecurity.audit
+    { "AuditLog",           config_string(audit_log),           true },
+
+    // The maximum size of the AuditLog in bytes, after which the oldest
+    // records are overwritten.
+    //  AuditLogSize=1048576
+    { "AuditLogSize",       config_string(audit_log_size),      true },
+
+    // Measure the cpu time used by each plugin, and report each plugin's
+    // share of the main thread every CpuReportInterval seconds.
+    //  CpuReportInterval=300
+    { "CpuReportInterval",  config_handler(config_cpu_report),  true },
+
+    // If the process crashes, write the most recent calls through the
+    // wrapper to CrashLog.<pid>.log before passing the signal on.
+    //  CrashLog=/var/tmp/nssecurity-crash
+    { "CrashLog",           config_handler(config_crash_log),   true },
+
+    // Share policy decisions with every other process of the same user, in a
+    // table of this many entries, see cache.c.
+    //  DecisionCache=4096
+    { "DecisionCache",      config_string(decision_cache),      true },
+
+    // A message displayed to users when a plugin load is denied. It is
+    // intended to give users a clue about why their page isn't working, and
+    // how to ask for help.
+    { "FriendlyWarning",    config_string(warning),             false },
+
+    // Watch the configuration files, and apply any changes to the policy
+    // without restarting the browser, see reload.c.
+    //  HotReload=1
+    { "HotReload",          config_string(hot_reload),          true },
+
+    // The path to a plugin you want managed by this security wrapper.
+    { "LoadPlugin",         config_handler(config_load_plugin), false },
+
+    // The verbosity of the wrapper, optionally per module.
+    //  LogLevel=warning,policy:debug
+    { "LogLevel",           config_handler(config_log_level),   true },
+
+    // Where to send messages, one of stderr, syslog or journald. The system
+    // log is written to in batches from a background thread.
+    //  LogTarget=syslog
+    { "LogTarget",          config_handler(config_log_target),  true },
+
+    // A description shown to users in their about:plugins page, make it
+    // something descriptive and explain how to get help.
+    { "PluginDescription",  config_string(description),         false },
+
+    // The name displayed to users in their about:plugins page.
+    { "PluginName",         config_string(name),                false },
+
+    // A UNIX socket to ask about domains the configuration doesn't allow,
+    // see daemon.c.
+    //  PolicyDaemon=/run/nssecurity/policy.sock
+    { "PolicyDaemon",       config_string(policy_daemon),       true },
+
+    // How long to wait for an answer from the PolicyDaemon, in milliseconds,
+    // before denying the domain.
+    //  PolicyDaemonTimeout=100
+    { "PolicyDaemonTimeout", config_string(policy_daemon_timeout), true },
+
+    // A module generated by nssecurity-compile -c, which replaces fnmatch()
+    // for AllowedDomains with compiled code, see matcher.c.
+    //  PolicyModule=/usr/lib/nssecurity/policy.so
+    { "PolicyModule",       config_string(policy_module),       true },
+
+    // Record every call forwarded to a plugin to RecordFile.<pid>.nsrec,
+    // which can be replayed later with nssecurity-replay.
+    //  RecordFile=/tmp/nssecurity-session
+    { "RecordFile",         config_string(record_file),         true },
+
+    // The number of bytes of each NPP_Write to save in the recording, the
+    // default is none.
+    //  RecordPayload=65536
+    { "RecordPayload",      config_string(record_payload),      true },
+
+    // Record a timeline of calls through the wrapper, in the Chrome trace
+    // event format. Each process writes to TraceFile.<pid>.json, which can be
+    // loaded into about:tracing.
+    //  TraceFile=/tmp/nssecurity-trace
+    { "TraceFile",          config_handler(config_trace_file),  true },
+
+    // When a plugin hangs, also log the stack of the stuck thread.
+    //  WatchdogSample=1
+    { "WatchdogSample",     config_handler(config_watchdog_sample), true },
+
+    // Report calls into a plugin that take longer than this many
+    // milliseconds, which probably means it has hung the browser.
+    //  WatchdogThreshold=2000
+    { "WatchdogThreshold",  config_handler(config_watchdog_threshold), true },
+};
+
+static int config_directive_compare(const void *a, const void *b)
+{
+    return strcmp(((const struct directive *) a)->name,
+                  ((const struct directive *) b)->name);
+}
+
+// Apply a single directive to the registry. Strings are copied into the
+// arena, unless they're from a compiled policy, which lives as long as the
+// registry.
+bool config_set(struct registry *registry,
+                const char *section,
+                const char *name,
+                const char *value)
+{
+    struct directive  key = { .name = name };
+    const struct directive *directive;
+    struct config_directive *record;
+    struct plugin    *plugin;
+    char            **field;
 
     // Lookup this section in our configuration registry to see if we've seen
     // it before. If we havn't, this routine will create it.
@@ -134,122 +526,212 @@ static int config_ini_handler(struct registry *registry,
                   section,
                   name);
         return false;
-    } else if (strcmp(name, "AllowedDomains") == 0) {
-        // AllowedDomains is a whitelist of domains allowed to load the
-        // specified plugin. It is passed to fnmatch(), so shell-style globbing
-        // is permitted.
-        //  AllowedDomains=*.corp.google.com
-        plugin->allow_domains = strdup(value);
-    } else if (strcmp(name, "AllowInsecure") == 0) {
-        // AllowInsecure disables mandatory https pages for AllowedDomains.
-        // This is not recommended, but can be used if absolutely necessary.
-        //  AllowInsecure=1
-        plugin->allow_insecure = strdup(value);
-    } else if (strcmp(name, "FriendlyWarning") == 0) {
-        // FriendlyWarning is a message displayed to users when a plugin load
-        // is denied. It is intended to give users a clue about why their page
-        // isn't working, and how to ask for help.
-        plugin->warning = strdup(value);
-    } else if (strcmp(name, "PluginDescription") == 0) {
-        // A description shown to users in their about:plugins page, make it
-        // something descriptive and explain how to get help.
-        plugin->description = strdup(value);
-    } else if (strcmp(name, "PluginName") == 0) {
-        // The name displayed to users in their about:plugins page.
-        plugin->name = strdup(value);
-    } else if (strcmp(name, "AllowPort") == 0) {
-        // If a domain contains a port specification, allow it to match.
-        //
-        // This has some security implications with AllowInsecure=1, and so is
-        // not recommended.
-        plugin->allow_port = strdup(value);
-    } else if (strcmp(name, "AllowAuth") == 0) {
-        // If a domain appears to contain HTTP authentication credentials,
-        // allow it to match.
-        //
-        // This is not recommended due to some ambiguities parsing URLs it
-        // introduces.
-        plugin->allow_auth = strdup(value);
-    } else if (strcmp(name, "LoadPlugin") == 0) {
-        // The path to a plugin you want managed by this security wrapper.
-
-        // This one is interesting, we've been told about a new plugin binary
-        // we can try to load. Let's load it now, and keep a reference around
-        // to it.
-        plugin->plugin = strdup(value);
-        plugin->handle = platform_dlopen(value);
-
-        // We can do one more piece of housekeeping, we can generate the global
-        // MIME description list by appending this new plugins MIME types to
-        // the types we already know.
-
-        // Call the exported function to retrieve the MIME types supported.
-        plugin->mime_description = platform_getmimedescription(plugin);
-
-        // If that worked, we need to parse it.
-        if (plugin->mime_description) {
-            if (registry->mime_description) {
-                char *trailing_delimiter;
-                size_t new_length;
-
-                // This is not the first description we have, we need to append a
-                // ';' and realloc enough space to store the new one, the 2 is
-                // for the ';' and the terminating '\0'.
-                new_length = strlen(registry->mime_description)
-                                + strlen(plugin->mime_description)
-                                + 2;
-
-                registry->mime_description = realloc(registry->mime_description,
-                                                     new_length);
-
-                // Some plugins already have a semicolon, check for that.
-                trailing_delimiter = strrchr(registry->mime_description, ';');
-
-                // If there is no delimiter, or the last delimiter is *not* the
-                // last character, we need to append our own.
-                if (trailing_delimiter == NULL || *++trailing_delimiter != '\0') {
-                    // But is there an empty string in there (Firefox).
-                    if (strlen(registry->mime_description)) {
-                        // Okay, String is non-empty and there is no semi
-                        // colon, or not at the end. We need to add one.
-                        strcat(registry->mime_description, ";");
-                    }
-                }
+    }
 
-                // Now we can append the new type.
-                strcat(registry->mime_description, plugin->mime_description);
-            } else {
-                // This is the first description we've seen, just strdup it.
-                registry->mime_description = strdup(plugin->mime_description);
-            }
-        }
-    } else {
+    directive = bsearch(&key,
+                        kDirectives,
+                        sizeof kDirectives / sizeof *kDirectives,
+                        sizeof *kDirectives,
+                        config_directive_compare);
+
+    if (!directive) {
         l_warning("unrecognised directive %s found in section %s",
                   name,
                   section);
         return false;
     }
 
+    if (directive->global && plugin != registry->global) {
+        l_warning("%s is only valid in [Global], not in %s", name, section);
+        return false;
+    }
+
+    // Most settings that take effect immediately can't be changed safely
+    // while running, the verbosity is the exception.
+    if (registry->previous
+            && directive->handler
+            && directive->global
+            && directive->handler != config_log_level) {
+        l_debug("%s can't be changed without a restart, ignored", name);
+        return true;
+    }
+
+    if (directive->handler) {
+        if (!directive->handler(registry, plugin, value))
+            return false;
+    } else {
+        field  = (char **)((char *) plugin + directive->offset);
+        *field = registry->image
+               ? (char *) value
+               : arena_strdup(registry->arena, value);
+
+        if (!*field)
+            return false;
+    }
+
+    // Keep a record of the directive for nssecurity-compile.
+    if (registry->journal) {
+        if (!(record = arena_alloc(registry->arena, sizeof *record))) {
+            l_error("memory allocation failure");
+            return false;
+        }
+
+        record->section = plugin->section;
+        record->name    = directive->name;
+        record->value   = arena_strdup(registry->arena, value);
+
+        if (registry->directives_tail) {
+            registry->directives_tail->next = record;
+        } else {
+            registry->directives = record;
+        }
+
+        registry->directives_tail = record;
+    }
+
     return true;
 }
 
-// This is the initial constructor used to parse the configuration files.
-static void __constructor init_parse_config(void)
+// This is a callback for parsing the ini files.
+static int config_ini_handler(struct registry *registry,
+                              const char *section,
+                              const char *name,
+                              const char *value)
+{
+    return config_set(registry, section, name, value);
+}
+
+// Combine the MIME types of every plugin into the description returned from
+// NP_GetMIMEDescription. Each description is a ';' separated list of
+// type:extensions:description entries.
+//
+// If more than one plugin claims a type, the first plugin in the
+// configuration takes precedence, the same order netscape_plugin_new() tries
+// them in, and the later entries are dropped. This is one pass over the
+// descriptions, with a hash set of the types seen so far.
+static bool config_mime_aggregate(struct registry *registry)
+{
+    struct string_builder builder = {0};
+    struct plugin *current;
+    struct mime_type {
+        const char      *type;
+        size_t           length;
+        struct plugin   *plugin;
+    } *types, *slot;
+    const char *entry;
+    const char *p;
+    uint32_t    hash;
+    uint32_t    mask;
+    unsigned    count;
+    unsigned    duplicates;
+    bool        result = false;
+    size_t      length;
+    size_t      typelength;
+
+    // An upper bound on the number of types, so the set never fills.
+    for (count = 1, current = registry->plugins; current; current = current->next) {
+        for (p = current->mime_description; p && *p; p++) {
+            count += *p == ';';
+        }
+        count++;
+    }
+
+    for (mask = 15; mask < count * 2; mask = mask * 2 + 1)
+        ;
+
+    if (!(types = calloc(mask + 1, sizeof *types))) {
+        l_error("memory allocation failure");
+        return false;
+    }
+
+    count      = 0;
+    duplicates = 0;
+
+    for (current = registry->plugins; current; current = current->next) {
+        for (entry = current->mime_description; entry && *entry; entry += length) {
+            // Find the end of this entry, and the type within it.
+            length      = strcspn(entry, ";");
+            typelength  = strcspn(entry, ":;");
+
+            if (length == 0) {
+                length = 1;
+                continue;
+            }
+
+            // Types are compared without case, like netscape_plugin_new().
+            for (hash = 0x811c9dc5, p = entry; p < entry + typelength; p++) {
+                hash ^= (unsigned char) tolower(*p);
+                hash *= 0x01000193;
+            }
+
+            for (slot = &types[hash & mask]; slot->type; slot = &types[++hash & mask]) {
+                if (slot->length == typelength
+                        && strncasecmp(slot->type, entry, typelength) == 0) {
+                    break;
+                }
+            }
+
+            if (slot->type) {
+                l_message("plugin %s also handles %.*s, but %s takes precedence",
+                          current->section,
+                          (int) typelength,
+                          entry,
+                          slot->plugin->section);
+                duplicates++;
+                continue;
+            }
+
+            slot->type      = entry;
+            slot->length    = typelength;
+            slot->plugin    = current;
+
+            if ((count++ && !string_builder_append(&builder, ";", 1))
+                    || !string_builder_append(&builder, entry, length)) {
+                l_error("memory allocation failure");
+                goto cleanup;
+            }
+        }
+    }
+
+    l_debug("%u mime types registered, %u duplicates dropped", count, duplicates);
+
+    registry->mime_description = builder.data
+                               ? arena_strdup(registry->arena, builder.data)
+                               : NULL;
+
+    result = !builder.data || registry->mime_description;
+
+  cleanup:
+    free(builder.data);
+    free(types);
+    return result;
+}
+
+// Build a registry from the configuration files. If compiled is set, the
+// policy compiled by nssecurity-compile is used instead if it's up to date.
+bool config_load(struct registry *registry, bool compiled)
 {
     struct passwd *passwd_entry;
+    struct plugin *current;
     char *home_directory;
     char *user_path;
+    bool result = true;
 
-    // Find this users passwd entry.
-    passwd_entry = getpwuid(getuid());
+    if (compiled && image_load(registry, NSSECURITY_IMAGE_PATH, NSSECURITY_PATH)) {
+        goto finished;
+    }
 
     // Parse the system configuration.
-    if (ini_parse(NSSECURITY_PATH, (void *)(config_ini_handler), &registry)) {
+    if (ini_parse(NSSECURITY_PATH, (void *)(config_ini_handler), registry)) {
         l_warning("failed to parse the global configuration file");
+        result = false;
     }
 
     // If permitted, parse the user configuration.
-    if (registry.global && registry.global->allow_override) {
+    if (registry->global
+            && registry->global->allow_override
+            && policy_boolean("Global", "AllowOverride", registry->global->allow_override)
+            && (passwd_entry = getpwuid(getuid()))) {
         home_directory = passwd_entry->pw_dir;
         user_path      = alloca(strlen(home_directory)
                                     + strlen(NSSECURITY_USER_PATH)
@@ -260,65 +742,136 @@ static void __constructor init_parse_config(void)
         sprintf(user_path, "%s/%s", home_directory, NSSECURITY_USER_PATH);
 
         // Parse the file.
-        if (ini_parse(user_path, (void *)(config_ini_handler), &registry)) {
+        if (ini_parse(user_path, (void *)(config_ini_handler), registry)) {
             l_warning("failed to parse the user configuration file");
         }
     }
 
-    return;
+    // Now every section is known, resolve the policy for each plugin.
+    for (current = registry->plugins; current; current = current->next) {
+        policy_compile(registry->arena, current, registry->global);
+    }
+
+    if (registry->global) {
+        policy_compile(registry->arena, registry->global, NULL);
+    }
+
+    config_mime_aggregate(registry);
+
+  finished:
+    // Match the domains of every plugin in one pass, see automaton.c.
+    if (registry->arena) {
+        registry->automaton = automaton_compile(registry->arena, registry->plugins);
+    }
+
+    // Use the generated matchers, if they were generated from this policy.
+    if (registry->global && registry->global->policy_module) {
+        matcher_load(registry, registry->global->policy_module);
+    }
+
+    // Decisions are only shared with processes using the same policy.
+    registry->checksum = cache_checksum(registry);
+
+    if (registry->global && registry->global->decision_cache && !registry->journal) {
+        cache_open(strtoul(registry->global->decision_cache, NULL, 0));
+    }
+
+    return result;
 }
 
-bool netscape_plugin_list_destroy(void)
+// Release everything in a registry, except the browser function table.
+void config_destroy(struct registry *registry)
 {
-    struct plugin *current;
+    NPNetscapeFuncs *netscape_funcs = registry->netscape_funcs;
+    struct plugin   *current;
+
+    // Close any open handles, everything else is in the arena.
+    for (current = registry->plugins; current; current = current->next) {
+        if (current->handle)
+            memory_untrack(current);
 
-    while (registry.plugins) {
-        // Find the current head of the plugins list.
-        current = registry.plugins;
+        platform_dlclose(current->handle);
+    }
 
-        // Unlink this node from the list.
-        registry.plugins = current->next;
+    if (registry->global && registry->global->handle) {
+        memory_untrack(registry->global);
+        platform_dlclose(registry->global->handle);
+    }
 
-      freecurrent:
+    platform_dlclose(registry->matcher_handle);
+    image_unload(registry);
+    arena_destroy(registry->arena);
 
-        // Unused elements are NULL, so we don't have to test.
-        free(current->allow_insecure);
-        free(current->allow_domains);
-        free(current->allow_override);
-        free(current->allow_port);
-        free(current->allow_auth);
-        free(current->warning);
-        free(current->plugin);
-        free(current->section);
-        free(current->name);
-        free(current->mime_description);
+    memset(registry, 0, sizeof *registry);
 
-        // Close any open handles.
-        platform_dlclose(current->handle);
+    registry->netscape_funcs = netscape_funcs;
+}
 
-        // Free the node itself.
-        free(current);
+// This is the initial constructor used to parse the configuration files.
+static void __constructor init_parse_config(void)
+{
+    // nssecurity-compile parses the configuration itself.
+    if (&config_compiler) {
+        return;
     }
 
-    // Test if we also need to free the global plugin structure.
-    if (registry.global) {
-        current = registry.global;
+    // Apply any verbosity requested in the environment before we start, so
+    // that problems parsing the configuration can be debugged.
+    log_set_verbosity(getenv(NSSECURITY_LOG_ENV));
+
+    config_load(&registry, true);
 
-        // Set to NULL so we don't free twice.
-        registry.global = NULL;
+    // The environment overrides any LogLevel in the configuration files.
+    log_set_verbosity(getenv(NSSECURITY_LOG_ENV));
+
+    // Similarly, tracing can be enabled from the environment, overriding any
+    // TraceFile. The configuration is only traced when TraceFile is set.
+    if (getenv(NSSECURITY_TRACE_ENV)) {
+        trace_open(getenv(NSSECURITY_TRACE_ENV));
+    }
 
-        // Re-use the plugin code above.
-        goto freecurrent;
+    // If requested, start recording policy decisions.
+    if (registry.global && registry.global->audit_log) {
+        audit_open(registry.global->audit_log,
+                   registry.global->audit_log_size
+                        ? strtoul(registry.global->audit_log_size, NULL, 0)
+                        : AUDIT_DEFAULT_SIZE);
     }
 
+    // If requested, start recording calls for nssecurity-replay.
+    if (registry.global && registry.global->record_file) {
+        record_open(registry.global->record_file,
+                    registry.global->record_payload
+                        ? strtoul(registry.global->record_payload, NULL, 0)
+                        : 0);
+    }
+
+    return;
+}
+
+bool netscape_plugin_list_destroy(void)
+{
+    struct registry *current = registry_current();
+    bool allocated = current->allocated;
+
+    __atomic_store_n(&global_registry, &registry, __ATOMIC_RELEASE);
+
+    config_destroy(current);
+
+    if (allocated)
+        free(current);
+
     return true;
 }
 
 static void __destructor fini_clear_plugins(void)
 {
+    reload_stop();
+    daemon_stop();
+    shim_report();
+    trace_close();
     netscape_instance_list_destroy();
     netscape_plugin_list_destroy();
-    free(registry.mime_description);
     return;
 }
 
@@ -326,6 +879,57 @@ static void __destructor fini_clear_plugins(void)
 
 static void __constructor test_parse_config(void)
 {
+    struct registry test = {0};
+    struct plugin *plugin;
+    char section[32];
+    unsigned i;
+
+    // The directive table must be sorted for bsearch().
+    for (i = 1; i < sizeof kDirectives / sizeof *kDirectives; i++) {
+        assert(strcmp(kDirectives[i - 1].name, kDirectives[i].name) < 0);
+    }
+
+    // Enough sections to grow the index a few times.
+    for (i = 0; i < 1000; i++) {
+        sprintf(section, "Plugin %u", i);
+        assert(config_ini_handler(&test, section, "PluginName", section) == true);
+        assert(config_ini_handler(&test, section, "AllowInsecure", "1") == true);
+    }
+
+    assert(config_ini_handler(&test, "Global", "PluginName", "Global") == true);
+    assert(config_ini_handler(&test, "Plugin 1", "Unknown", "1") == false);
+    assert(config_ini_handler(&test, "Plugin 1", "TraceFile", "/") == false);
+    assert(config_ini_handler(&test, "Plugin 1", "AuditLog", "/") == false);
+    assert(config_ini_handler(&test, "Plugin 1", "RecordFile", "/") == false);
+
+    assert(test.section_count == 1000);
+    assert(test.global && strcmp(test.global->name, "Global") == 0);
+
+    // Sections are kept in the order they were first seen.
+    for (i = 0, plugin = test.plugins; plugin; plugin = plugin->next, i++) {
+        sprintf(section, "Plugin %u", i);
+        assert(strcmp(plugin->section, section) == 0);
+        assert(strcmp(plugin->name, section) == 0);
+        assert(strcmp(plugin->allow_insecure, "1") == 0);
+    }
+
+    assert(i == 1000);
+    assert(test.tail && strcmp(test.tail->section, "Plugin 999") == 0);
+
+    // Duplicate types are dropped, the first plugin wins.
+    test.plugins->mime_description = "application/x-a:a:A;application/x-b:b:B;";
+    test.plugins->next->mime_description = "Application/X-A:a:Other;;application/x-c:c:C";
+    test.plugins->next->next->mime_description = "application/x-b";
+
+    assert(config_mime_aggregate(&test) == true);
+    assert(strcmp(test.mime_description,
+                  "application/x-a:a:A;application/x-b:b:B;application/x-c:c:C") == 0);
+
+    arena_destroy(test.arena);
+
+    // The fields used on every call must share a cache line.
+    assert(offsetof(struct plugin, allow_insecure) <= 64);
+    assert(__alignof__(struct plugin) == 64);
 }
 
 #endif
@@ -5,36 +5,108 @@ struct registry;
 struct plugin;
 
 struct registry {
+    struct arena    *arena;
     char            *mime_description;
     NPNetscapeFuncs *netscape_funcs;
     struct plugin   *global;
     struct plugin   *plugins;
+    struct plugin   *tail;
+    struct plugin  **sections;      // open addressed, indexed by name.
+    uint32_t         section_mask;
+    uint32_t         section_count;
+    const struct image_header *image;   // compiled policy, see image.c.
+    size_t           image_size;
+    bool             journal;       // record directives for nssecurity-compile.
+    struct config_directive *directives;
+    struct config_directive *directives_tail;
+    const struct registry *previous;    // being replaced, see reload.c.
+    struct registry *retired;       // next registry waiting to be freed.
+    uint32_t         instances;     // mapped instances of our plugins.
+    bool             quiescent;     // no calls can still be using it.
+    bool             allocated;
+    void            *matcher_handle;    // PolicyModule, see matcher.c.
+    struct automaton *automaton;    // every plugin's domains, see automaton.c.
+    uint64_t         checksum;      // of the policy, see cache.c.
+};
+
+// Every directive parsed, in order, if the registry journal is enabled.
+struct config_directive {
+    const char      *section;
+    const char      *name;
+    const char      *value;
+    struct config_directive *next;
+};
+
+// The policy for a plugin, compiled from the configuration strings by
+// policy_compile() once the configuration has been parsed, with any [Global]
+// defaults already applied.
+#define POLICY_ALLOW_INSECURE   (1 << 0)
+#define POLICY_ALLOW_PORT       (1 << 1)
+#define POLICY_ALLOW_AUTH       (1 << 2)
+
+struct policy {
+    uint32_t         flags;
+    uint32_t         domain_count;
+    const char     **domains;
+    const char      *warning;
+    bool           (*matcher)(const char *hostname, size_t length);
 };
 
 struct plugin {
+    // Everything read while handling a call, which fits in one cache line.
+    struct policy    policy;
+    NPPluginFuncs   *plugin_funcs;
+    struct stats_plugin *stats;
+    char            *section;
+    struct plugin   *next;
+
+    // The configuration as written, only used while loading.
     char            *allow_insecure;
     char            *allow_domains;
+    char            *allow_networks;
     char            *allow_override;
     char            *allow_port;
     char            *allow_auth;
     char            *warning;
+    char            *audit_log;
+    char            *audit_log_size;
+    char            *record_file;
+    char            *record_payload;
     char            *plugin;
-    char            *section;
     char            *description;
     char            *name;
     char            *mime_description;
+    char            *hot_reload;
+    char            *policy_module;
+    char            *decision_cache;
+    char            *policy_daemon;
+    char            *policy_daemon_timeout;
+    struct radix_node *networks;    // AllowedNetworks, see radix.c.
     void            *handle;
-    NPPluginFuncs   *plugin_funcs;
-    struct plugin   *next;
-};
+    struct registry *registry;      // that this plugin belongs to.
+} __attribute__((aligned(64)));
+
+// The registry in use. It may be replaced at any time by reload.c, so load
+// it once with registry_current() and use that for the rest of the call.
+extern struct registry *global_registry;
 
-extern struct registry registry;
+#define registry_current() __atomic_load_n(&global_registry, __ATOMIC_ACQUIRE)
 
 bool netscape_plugin_list_destroy(void);
+bool config_load(struct registry *registry, bool compiled);
+void config_destroy(struct registry *registry);
+bool config_set(struct registry *registry,
+                const char *section,
+                const char *name,
+                const char *value);
+bool find_plugin_section(struct registry *registry,
+                         const char *section,
+                         struct plugin **plugin);
 
 #define NSSECURITY_REVISON      "$DateTime: 2012/02/20 07:36:10 $"
 #define NSSECURITY_PATH         "/etc/nssecurity.ini"
 #define NSSECURITY_USER_PATH    ".nssecurity.ini"
+#define NSSECURITY_IMAGE_PATH   "/etc/nssecurity.img"
 #define NSSECURITY_TAG          "nssecurity"
 
 #ifndef __export
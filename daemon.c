@@ -0,0 +1,793 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Author: taviso@google.com
+//
+// Ask a local policy daemon about domains the configuration doesn't allow.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#define LOG_MODULE LOG_MODULE_POLICY
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pwd.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__linux__)
+# include <sys/prctl.h>
+# include <sys/syscall.h>
+# include <linux/seccomp.h>
+#endif
+
+#include "log.h"
+#include "npapi.h"
+#include "npfunctions.h"
+#include "config.h"
+#include "histogram.h"
+#include "shim.h"
+#include "stats.h"
+#include "daemon.h"
+
+// Allowlists that change too often to be written into every configuration,
+// such as origins approved within the last hour, can be served by a daemon
+// listening on PolicyDaemon. A domain the configuration doesn't allow is sent
+// to the daemon, and its answer is cached for the ttl it gives, or a default.
+//
+// If the daemon doesn't answer within PolicyDaemonTimeout milliseconds, or
+// can't be reached at all, the domain is denied, and that is also cached for
+// a few seconds so that the browser isn't stalled on every page.
+//
+// Every domain the daemon answered for is appended to ~/.nssecurity.recent,
+// and when the browser starts a thread asks about the most recent ones, so
+// they're usually cached before they're needed.
+
+bool daemon_enabled;
+
+struct daemon_entry {
+    uint64_t        expires;        // milliseconds, see daemon_now().
+    uint32_t        length;
+    bool            verdict;
+    char            key[DAEMON_KEY_MAX];
+};
+
+static struct daemon_entry daemon_cache[DAEMON_CACHE_SIZE];
+static pthread_mutex_t     daemon_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sockaddr_un  daemon_address;
+static int                 daemon_timeout = DAEMON_TIMEOUT_DEFAULT;
+static int                 daemon_socket = -1;     // only used by the browser.
+static uint32_t            daemon_sequence;
+static char                daemon_recent[PATH_MAX];
+static pthread_t           daemon_thread;
+static bool                daemon_prefetching;
+static bool                daemon_stopping;
+
+enum {
+    DAEMON_DENY,
+    DAEMON_ALLOW,
+    DAEMON_FAILED,
+};
+
+// The coarse clock is always answered by the vdso, so checking the cache
+// never has to enter the kernel.
+static uint64_t daemon_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+    return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+// Build the cache key for hostname in section. Returns zero if it's too long
+// to be cached, otherwise the length.
+static uint32_t daemon_key(char *key,
+                           const char *section,
+                           const char *hostname,
+                           uint64_t *hash)
+{
+    size_t   prefix = strlen(section) + 1;
+    size_t   length = strlen(hostname);
+    uint32_t i;
+
+    if (prefix + length > DAEMON_KEY_MAX) {
+        return 0;
+    }
+
+    memcpy(key, section, prefix);
+    memcpy(key + prefix, hostname, length);
+
+    for (*hash = 0xcbf29ce484222325ULL, i = 0; i < prefix + length; i++) {
+        *hash ^= (unsigned char) key[i];
+        *hash *= 0x100000001b3ULL;
+    }
+
+    return prefix + length;
+}
+
+static bool daemon_cache_find(const char *key,
+                              uint32_t length,
+                              uint64_t hash,
+                              bool *verdict)
+{
+    struct daemon_entry *entry;
+    uint64_t             now = daemon_now();
+    uint32_t             probe;
+    bool                 found = false;
+
+    pthread_mutex_lock(&daemon_cache_lock);
+
+    for (probe = 0; probe < DAEMON_PROBE_MAX && !found; probe++) {
+        entry = &daemon_cache[(hash + probe) % DAEMON_CACHE_SIZE];
+
+        if (entry->expires > now
+                && entry->length == length
+                && memcmp(entry->key, key, length) == 0) {
+            *verdict = entry->verdict;
+            found    = true;
+        }
+    }
+
+    pthread_mutex_unlock(&daemon_cache_lock);
+
+    return found;
+}
+
+// Replace this key if it's already cached, or anything that has expired,
+// otherwise whatever would expire first.
+static void daemon_cache_insert(const char *key,
+                                uint32_t length,
+                                uint64_t hash,
+                                bool verdict,
+                                uint32_t ttl)
+{
+    struct daemon_entry *entry;
+    struct daemon_entry *victim = NULL;
+    uint64_t             now = daemon_now();
+    uint32_t             probe;
+
+    pthread_mutex_lock(&daemon_cache_lock);
+
+    for (probe = 0; probe < DAEMON_PROBE_MAX; probe++) {
+        entry = &daemon_cache[(hash + probe) % DAEMON_CACHE_SIZE];
+
+        if (entry->expires <= now
+                || (entry->length == length && memcmp(entry->key, key, length) == 0)) {
+            victim = entry;
+            break;
+        }
+
+        if (!victim || entry->expires < victim->expires)
+            victim = entry;
+    }
+
+    victim->expires = now + ttl * 1000ULL;
+    victim->length  = length;
+    victim->verdict = verdict;
+    memcpy(victim->key, key, length);
+
+    pthread_mutex_unlock(&daemon_cache_lock);
+}
+
+// Ask the daemon about hostname in section, using the connection in fd,
+// which is opened if necessary and closed on failure. Any late answers to
+// earlier questions are discarded.
+static int daemon_query(int *fd,
+                        const char *section,
+                        const char *hostname,
+                        uint32_t *ttl)
+{
+    struct {
+        struct daemon_request   header;
+        char                    payload[DAEMON_KEY_MAX];
+    } request;
+    struct daemon_response response;
+    struct pollfd          pfd;
+    uint64_t               deadline = daemon_now() + daemon_timeout;
+    uint64_t               now;
+    size_t                 section_length = strlen(section);
+    size_t                 hostname_length = strlen(hostname);
+    size_t                 size = sizeof request.header + section_length + hostname_length;
+    ssize_t                received;
+
+    if (section_length + hostname_length > sizeof request.payload) {
+        l_debug("hostname %s is too long to ask the policy daemon about", hostname);
+        return DAEMON_FAILED;
+    }
+
+    if (*fd < 0) {
+        if ((*fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0) {
+            l_warning_ratelimited("failed to create policy daemon socket, %m");
+            return DAEMON_FAILED;
+        }
+
+        if (connect(*fd, (struct sockaddr *) &daemon_address, sizeof daemon_address) != 0) {
+            l_warning_ratelimited("failed to connect to policy daemon %s, %m",
+                                  daemon_address.sun_path);
+            goto failure;
+        }
+    }
+
+    request.header.magic           = DAEMON_MAGIC;
+    request.header.version         = DAEMON_VERSION;
+    request.header.section_length  = section_length;
+    request.header.id              = __atomic_add_fetch(&daemon_sequence, 1, __ATOMIC_RELAXED);
+    request.header.hostname_length = hostname_length;
+    request.header.reserved        = 0;
+
+    memcpy(request.payload, section, section_length);
+    memcpy(request.payload + section_length, hostname, hostname_length);
+
+    if (send(*fd, &request, size, MSG_NOSIGNAL) != (ssize_t) size) {
+        l_warning_ratelimited("failed to send request to policy daemon, %m");
+        goto failure;
+    }
+
+    while ((now = daemon_now()) < deadline) {
+        pfd.fd     = *fd;
+        pfd.events = POLLIN;
+
+        if (poll(&pfd, 1, deadline - now) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            break;
+        }
+
+        if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+
+        received = recv(*fd, &response, sizeof response, MSG_DONTWAIT);
+
+        if (received != sizeof response || response.magic != DAEMON_MAGIC) {
+            l_warning_ratelimited("invalid response from policy daemon");
+            goto failure;
+        }
+
+        if (response.id != request.header.id)
+            continue;
+
+        *ttl = response.ttl;
+
+        return response.verdict == DAEMON_VERDICT_ALLOW
+             ? DAEMON_ALLOW
+             : DAEMON_DENY;
+    }
+
+    l_warning_ratelimited("policy daemon did not answer within %dms",
+                          daemon_timeout);
+
+  failure:
+    close(*fd);
+    *fd = -1;
+    return DAEMON_FAILED;
+}
+
+// Ask the daemon about hostname unless the answer is already cached, and
+// cache whatever it says. Returns the verdict, and sets ttl to how long it
+// was cached for.
+static int daemon_resolve(int *fd,
+                          const char *section,
+                          const char *hostname,
+                          const char *key,
+                          uint32_t length,
+                          uint64_t hash)
+{
+    uint32_t ttl = 0;
+    int      verdict;
+
+    verdict = daemon_query(fd, section, hostname, &ttl);
+
+    switch (verdict) {
+        case DAEMON_ALLOW:
+            ttl = ttl ? ttl : DAEMON_TTL_DEFAULT;
+            break;
+        case DAEMON_DENY:
+            ttl = ttl ? ttl : DAEMON_TTL_NEGATIVE;
+            break;
+        default:
+            ttl = DAEMON_TTL_FAILURE;
+            break;
+    }
+
+    if (length) {
+        daemon_cache_insert(key,
+                            length,
+                            hash,
+                            verdict == DAEMON_ALLOW,
+                            ttl < DAEMON_TTL_MAX ? ttl : DAEMON_TTL_MAX);
+    }
+
+    return verdict;
+}
+
+// Remember that hostname was seen, so that it can be prefetched next time.
+// The line is written in one call, so processes appending at the same time
+// don't interleave.
+static void daemon_remember(const char *section, const char *hostname)
+{
+    char line[DAEMON_KEY_MAX + 2];
+    int  length;
+    int  fd;
+
+    if (!*daemon_recent) {
+        return;
+    }
+
+    length = snprintf(line, sizeof line, "%s\t%s\n", hostname, section);
+
+    if (length < 0 || length >= (int) sizeof line) {
+        return;
+    }
+
+    if ((fd = open(daemon_recent, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+        l_debug("failed to open %s, %m", daemon_recent);
+        return;
+    }
+
+    if (write(fd, line, length) != length) {
+        l_debug("failed to write to %s, %m", daemon_recent);
+    }
+
+    close(fd);
+}
+
+// Decide whether the daemon allows hostname to load the plugin in section.
+// If the answer is cached, this doesn't make any system calls.
+bool daemon_allowed(const char *section, const char *hostname)
+{
+    char     key[DAEMON_KEY_MAX];
+    uint64_t hash;
+    uint32_t length;
+    bool     verdict;
+    int      result;
+
+    if ((length = daemon_key(key, section, hostname, &hash))
+            && daemon_cache_find(key, length, hash, &verdict)) {
+        return verdict;
+    }
+
+    result = daemon_resolve(&daemon_socket, section, hostname, key, length, hash);
+
+    if (result != DAEMON_FAILED) {
+        daemon_remember(section, hostname);
+    }
+
+    l_debug("policy daemon says %s %s load plugin %s",
+            hostname,
+            result == DAEMON_ALLOW ? "may" : "may not",
+            section);
+
+    return result == DAEMON_ALLOW;
+}
+
+// Ask about the most recent entries in path, then rewrite it with just those,
+// so that it doesn't grow forever.
+static void daemon_prefetch(const char *path)
+{
+    char     recent[DAEMON_PREFETCH_MAX][DAEMON_KEY_MAX + 2];
+    char     line[DAEMON_KEY_MAX + 2];
+    char     temporary[PATH_MAX];
+    char     key[DAEMON_KEY_MAX];
+    char    *section;
+    bool     verdict;
+    uint64_t hash;
+    uint32_t length;
+    uint32_t count = 0;
+    uint32_t i;
+    FILE    *file;
+    int      fd = -1;
+
+    if (!(file = fopen(path, "r"))) {
+        return;
+    }
+
+    // Keep the newest occurrence of each line, in order.
+    while (fgets(line, sizeof line, file)) {
+        if (!strchr(line, '\n') || !strchr(line, '\t'))
+            continue;
+
+        for (i = 0; i < count && strcmp(recent[i], line) != 0; i++)
+            ;
+
+        if (i == count && count == DAEMON_PREFETCH_MAX)
+            i = 0;
+        else if (i == count)
+            count++;
+
+        memmove(recent[i], recent[i + 1], (count - 1 - i) * sizeof *recent);
+        strcpy(recent[count - 1], line);
+    }
+
+    fclose(file);
+
+    for (i = 0; i < count && !__atomic_load_n(&daemon_stopping, __ATOMIC_RELAXED); i++) {
+        strcpy(line, recent[i]);
+
+        *strchr(line, '\n') = '\0';
+        *(section = strchr(line, '\t')) = '\0';
+        section++;
+
+        if ((length = daemon_key(key, section, line, &hash))
+                && !daemon_cache_find(key, length, hash, &verdict)) {
+            daemon_resolve(&fd, section, line, key, length, hash);
+        }
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    l_debug("prefetched %u recently seen domains from %s", i, path);
+
+    // Every browser process does this, so each needs its own temporary file,
+    // and mkstemp() creates it without following links, readable only by us.
+    if (snprintf(temporary, sizeof temporary, "%s.XXXXXX", path) >= (int) sizeof temporary
+            || (fd = mkstemp(temporary)) < 0) {
+        return;
+    }
+
+    if (!(file = fdopen(fd, "w"))) {
+        close(fd);
+        unlink(temporary);
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        fputs(recent[i], file);
+    }
+
+    if (fclose(file) != 0 || rename(temporary, path) != 0) {
+        l_debug("failed to rewrite %s, %m", path);
+        unlink(temporary);
+    }
+}
+
+static void *daemon_prefetch_worker(void *arg __unused)
+{
+    daemon_prefetch(daemon_recent);
+    return NULL;
+}
+
+// The prefetch thread doesn't exist in a child, and the cache lock may have
+// been held by a thread that doesn't either. The child gets its own connection,
+// so that it can't read answers meant for the parent; closing our copy of the
+// socket leaves the parent's open.
+static void daemon_atfork_child(void)
+{
+    pthread_mutex_init(&daemon_cache_lock, NULL);
+
+    daemon_prefetching = false;
+    daemon_stopping    = false;
+
+    if (daemon_socket >= 0) {
+        close(daemon_socket);
+        daemon_socket = -1;
+    }
+}
+
+// Parse PolicyDaemonTimeout, falling back to the default if it's not a
+// sensible number of milliseconds.
+static int daemon_parse_timeout(const char *value)
+{
+    unsigned long timeout;
+    char         *end;
+
+    timeout = strtoul(value, &end, 0);
+
+    if (*end || timeout < 1 || timeout > DAEMON_TIMEOUT_MAX) {
+        l_warning("PolicyDaemonTimeout must be between 1 and %u milliseconds, not %s",
+                  DAEMON_TIMEOUT_MAX, value);
+        return DAEMON_TIMEOUT_DEFAULT;
+    }
+
+    return timeout;
+}
+
+// Start using the daemon if PolicyDaemon is set, and prefetch recently seen
+// domains in the background.
+bool daemon_start(void)
+{
+    static bool      registered;
+    struct registry *current = registry_current();
+    struct passwd   *passwd_entry;
+    const char      *path;
+
+    if (daemon_enabled) {
+        return true;
+    }
+
+    if (!current->global || !(path = current->global->policy_daemon)) {
+        return false;
+    }
+
+    if (strlen(path) >= sizeof daemon_address.sun_path) {
+        l_warning("PolicyDaemon %s is too long for a socket path", path);
+        return false;
+    }
+
+    daemon_address.sun_family = AF_UNIX;
+    strcpy(daemon_address.sun_path, path);
+
+    if (current->global->policy_daemon_timeout) {
+        daemon_timeout = daemon_parse_timeout(current->global->policy_daemon_timeout);
+    }
+
+    if ((passwd_entry = getpwuid(getuid()))) {
+        snprintf(daemon_recent,
+                 sizeof daemon_recent,
+                 "%s/%s",
+                 passwd_entry->pw_dir,
+                 DAEMON_RECENT_PATH);
+    }
+
+    if (!registered) {
+        pthread_atfork(NULL, NULL, daemon_atfork_child);
+        registered = true;
+    }
+
+    daemon_enabled = true;
+
+    if (*daemon_recent
+            && pthread_create(&daemon_thread, NULL, daemon_prefetch_worker, NULL) == 0) {
+        daemon_prefetching = true;
+    }
+
+    l_debug("asking policy daemon %s, with a timeout of %dms", path, daemon_timeout);
+
+    return true;
+}
+
+// Wait for the prefetch to finish, which is only a few more queries at most.
+void daemon_stop(void)
+{
+    if (daemon_prefetching) {
+        __atomic_store_n(&daemon_stopping, true, __ATOMIC_RELAXED);
+        pthread_join(daemon_thread, NULL);
+        daemon_prefetching = false;
+    }
+
+    if (daemon_socket >= 0) {
+        close(daemon_socket);
+        daemon_socket = -1;
+    }
+}
+
+#if defined(ENABLE_RUNTIME_TESTS) && defined(__linux__)
+
+// A stand-in daemon, that allows anything in .allowed.com and is too slow to
+// answer about slow.com.
+static void test_daemon_server(int listener)
+{
+    struct {
+        struct daemon_request   header;
+        char                    payload[DAEMON_KEY_MAX];
+    } request;
+    struct daemon_response response = { .magic = DAEMON_MAGIC };
+    struct pollfd          fds[8] = { { .fd = listener, .events = POLLIN } };
+    const char            *hostname;
+    ssize_t                received;
+    nfds_t                 count = 1;
+    nfds_t                 i;
+
+    while (poll(fds, count, -1) > 0) {
+        if ((fds[0].revents & POLLIN) && count < 8) {
+            fds[count].fd       = accept(listener, NULL, NULL);
+            fds[count++].events = POLLIN;
+        }
+
+        for (i = 1; i < count; i++) {
+            if (!fds[i].revents)
+                continue;
+
+            if ((received = recv(fds[i].fd, &request, sizeof request, 0)) <= 0) {
+                close(fds[i].fd);
+                fds[i--] = fds[--count];
+                continue;
+            }
+
+            assert(received == (ssize_t) sizeof request.header
+                             + request.header.section_length
+                             + request.header.hostname_length);
+
+            request.payload[request.header.section_length
+                          + request.header.hostname_length] = '\0';
+
+            hostname         = request.payload + request.header.section_length;
+            response.id      = request.header.id;
+            response.ttl     = 0;
+            response.verdict = DAEMON_VERDICT_DENY;
+
+            if (strcmp(hostname, "slow.com") == 0) {
+                usleep(300000);
+            } else if (strlen(hostname) > strlen(".allowed.com")
+                    && strcmp(hostname + strlen(hostname) - strlen(".allowed.com"),
+                              ".allowed.com") == 0) {
+                response.verdict = DAEMON_VERDICT_ALLOW;
+                response.ttl     = 60;
+            }
+
+            send(fds[i].fd, &response, sizeof response, MSG_NOSIGNAL);
+        }
+    }
+
+    _exit(0);
+}
+
+// Wait for a child, and remove the statistics segment it was given when it
+// forked, see stats.c.
+static int test_daemon_reap(pid_t child)
+{
+    char name[64];
+    int  status;
+
+    assert(waitpid(child, &status, 0) == child);
+
+    snprintf(name, sizeof name, "/%s%u", STATS_PREFIX, (unsigned) child);
+    shm_unlink(name);
+
+    return status;
+}
+
+// Check the cached verdict for hostname without making any system calls, by
+// asking in a child that is killed if it tries.
+static bool test_daemon_cached(const char *hostname, bool expected)
+{
+    pid_t child;
+    int   status;
+
+    if ((child = fork()) == 0) {
+        prctl(PR_SET_SECCOMP, SECCOMP_MODE_STRICT);
+        syscall(SYS_exit, daemon_allowed("Test", hostname) == expected ? 0 : 1);
+    }
+
+    status = test_daemon_reap(child);
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void __constructor test_daemon(void)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    unsigned char      saved[LOG_MODULE_MAX];
+    char               contents[256] = {0};
+    struct stat        info;
+    uint64_t           start;
+    pid_t              server;
+    pid_t              child;
+    FILE              *file;
+    int                listener;
+    int                status;
+
+    // Failures log warnings, which would just be noise here.
+    memcpy(saved, log_verbosity, sizeof saved);
+    log_set_verbosity("none");
+
+    snprintf(address.sun_path, sizeof address.sun_path,
+             "/tmp/nssecurity-daemon-test.%u", (unsigned) getpid());
+    snprintf(daemon_recent, sizeof daemon_recent,
+             "/tmp/nssecurity-daemon-test.%u.recent", (unsigned) getpid());
+
+    unlink(address.sun_path);
+
+    assert((listener = socket(AF_UNIX, SOCK_SEQPACKET, 0)) >= 0);
+    assert(bind(listener, (struct sockaddr *) &address, sizeof address) == 0);
+    assert(listen(listener, 4) == 0);
+    assert((server = fork()) >= 0);
+
+    if (server == 0) {
+        test_daemon_server(listener);
+    }
+
+    close(listener);
+
+    // Out of range timeouts are ignored.
+    assert(daemon_parse_timeout("250") == 250);
+    assert(daemon_parse_timeout("0x10") == 16);
+    assert(daemon_parse_timeout("0") == DAEMON_TIMEOUT_DEFAULT);
+    assert(daemon_parse_timeout("-1") == DAEMON_TIMEOUT_DEFAULT);
+    assert(daemon_parse_timeout("10001") == DAEMON_TIMEOUT_DEFAULT);
+    assert(daemon_parse_timeout("fast") == DAEMON_TIMEOUT_DEFAULT);
+    assert(daemon_parse_timeout("") == DAEMON_TIMEOUT_DEFAULT);
+
+    daemon_address = address;
+    daemon_timeout = 100;
+    daemon_enabled = true;
+
+    assert(daemon_allowed("Test", "www.allowed.com") == true);
+    assert(daemon_allowed("Test", "evil.com") == false);
+
+    // Answers are cached, including denials.
+    assert(test_daemon_cached("www.allowed.com", true));
+    assert(test_daemon_cached("evil.com", false));
+    assert(!test_daemon_cached("new.allowed.com", true));
+
+    // No answer in time is a denial.
+    start = daemon_now();
+    assert(daemon_allowed("Test", "slow.com") == false);
+    assert(daemon_now() - start < 250);
+    assert(test_daemon_cached("slow.com", false));
+
+    // Once the daemon has caught up, it's asked again on a new connection.
+    usleep(250000);
+    assert(daemon_allowed("Test", "other.allowed.com") == true);
+
+    // Domains in the recent file are prefetched, and duplicates removed.
+    assert((file = fopen(daemon_recent, "a")));
+    fputs("prefetch.allowed.com\tTest\nevil.com\tTest\nbad line\n", file);
+    fclose(file);
+
+    daemon_prefetch(daemon_recent);
+
+    assert(test_daemon_cached("prefetch.allowed.com", true));
+    assert((file = fopen(daemon_recent, "r")));
+    assert(fread(contents, 1, sizeof contents - 1, file) > 0);
+    assert(strcmp(contents, "www.allowed.com\tTest\n"
+                            "other.allowed.com\tTest\n"
+                            "prefetch.allowed.com\tTest\n"
+                            "evil.com\tTest\n") == 0);
+    fclose(file);
+
+    // The rewritten file is private, whatever the umask.
+    assert(stat(daemon_recent, &info) == 0 && (info.st_mode & 077) == 0);
+
+    // A child forked while the cache was locked can still use it, and has to
+    // make its own connection, without closing ours.
+    pthread_mutex_lock(&daemon_cache_lock);
+
+    if ((child = fork()) == 0) {
+        daemon_atfork_child();
+        _exit(pthread_mutex_trylock(&daemon_cache_lock) == 0 && daemon_socket < 0 ? 0 : 1);
+    }
+
+    pthread_mutex_unlock(&daemon_cache_lock);
+
+    status = test_daemon_reap(child);
+
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    assert(daemon_socket >= 0 && fcntl(daemon_socket, F_GETFD) != -1);
+
+    // Fail closed if the daemon goes away.
+    kill(server, SIGKILL);
+    test_daemon_reap(server);
+    unlink(address.sun_path);
+
+    assert(daemon_allowed("Test", "gone.allowed.com") == false);
+    assert(daemon_allowed("Test", "www.allowed.com") == true);
+
+    unlink(daemon_recent);
+    daemon_stop();
+    memset(daemon_cache, 0, sizeof daemon_cache);
+    memset(daemon_recent, 0, sizeof daemon_recent);
+    daemon_enabled = false;
+
+    memcpy(log_verbosity, saved, sizeof saved);
+}
+
+#endif
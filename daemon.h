@@ -0,0 +1,49 @@
+#ifndef __DAEMON_H
+#define __DAEMON_H
+
+// The protocol spoken to the policy daemon, over a SOCK_SEQPACKET UNIX socket
+// so that every message is one packet. The request is followed by the section
+// and hostname, without nuls. Change DAEMON_VERSION if this changes.
+#define DAEMON_MAGIC            0x4e534450
+#define DAEMON_VERSION          1
+
+#define DAEMON_VERDICT_DENY     0
+#define DAEMON_VERDICT_ALLOW    1
+
+struct daemon_request {
+    uint32_t        magic;
+    uint16_t        version;
+    uint16_t        section_length;
+    uint32_t        id;
+    uint16_t        hostname_length;
+    uint16_t        reserved;
+};
+
+struct daemon_response {
+    uint32_t        magic;
+    uint32_t        id;             // of the request being answered.
+    uint32_t        ttl;            // seconds, or zero for the default.
+    uint8_t         verdict;
+    uint8_t         reserved[3];
+};
+
+#define DAEMON_TIMEOUT_DEFAULT  100     // milliseconds.
+#define DAEMON_TIMEOUT_MAX      10000
+#define DAEMON_TTL_DEFAULT      300     // seconds, for an allow.
+#define DAEMON_TTL_NEGATIVE     30      // seconds, for a deny.
+#define DAEMON_TTL_FAILURE      5       // seconds, if there was no answer.
+#define DAEMON_TTL_MAX          3600
+#define DAEMON_KEY_MAX          192     // section, nul, hostname.
+#define DAEMON_CACHE_SIZE       256
+#define DAEMON_PROBE_MAX        8
+#define DAEMON_PREFETCH_MAX     64
+#define DAEMON_RECENT_PATH      ".nssecurity.recent"
+
+// Set once PolicyDaemon has been configured, see daemon_start().
+extern bool daemon_enabled;
+
+bool daemon_start(void);
+void daemon_stop(void);
+bool daemon_allowed(const char *section, const char *hostname);
+
+#endif
@@ -17,6 +17,8 @@
 // limitations under the License.
 //
 
+#define LOG_MODULE LOG_MODULE_EXPORT
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -33,8 +35,14 @@
 #include "instance.h"
 #include "netscape.h"
 #include "util.h"
+#include "histogram.h"
+#include "shim.h"
+#include "stats.h"
+#include "probe.h"
 #include "export.h"
 #include "log.h"
+#include "reload.h"
+#include "daemon.h"
 
 // NP_GetMIMEDescription returns a supported MIME Type list for your plugin. It
 // works on Unix (Linux) and MacOS.
@@ -44,10 +52,23 @@
 // short description.
 //
 // I have already aggregated the mime types supported, so just hand it along
-// here.
+// here. The browser may keep the string, so it must outlive a reload.
 __export char * NP_GetMIMEDescription(void)
 {
-    return registry.mime_description;
+    struct registry *registry;
+    char            *description = NULL;
+
+    reload_enter();
+
+    registry = registry_current();
+
+    if (registry->mime_description) {
+        description = string_intern(registry->mime_description);
+    }
+
+    reload_leave();
+
+    return description;
 }
 
 __export char * NP_GetPluginVersion(void)
@@ -57,28 +78,37 @@ __export char * NP_GetPluginVersion(void)
 
 __export NPError NP_GetValue(NPP instance, NPPVariable variable, void *value)
 {
-    struct plugin *plugin;
-    char         **string = value;
+    struct registry *registry;
+    struct plugin   *plugin;
+    char           **string = value;
+    NPError          result;
+
+    reload_enter();
+
+    registry = registry_current();
 
     switch (variable) {
         case NPPVpluginNameString:
-            // This is a string displayed to the user in about:plugins
-            if (!registry.global || !registry.global->name) {
-                return NPERR_GENERIC_ERROR;
+            // This is a string displayed to the user in about:plugins, the
+            // browser may keep it after a reload has freed the registry.
+            if (!registry->global || !registry->global->name) {
+                result = NPERR_GENERIC_ERROR;
+                break;
             }
 
-            *string = registry.global->name;
-
-            return NPERR_NO_ERROR;
+            *string = string_intern(registry->global->name);
+            result  = *string ? NPERR_NO_ERROR : NPERR_OUT_OF_MEMORY_ERROR;
+            break;
         case NPPVpluginDescriptionString:
             // This is a string displayed to the user in about:plugins
-            if (!registry.global || !registry.global->name) {
-                return NPERR_GENERIC_ERROR;
+            if (!registry->global || !registry->global->description) {
+                result = NPERR_GENERIC_ERROR;
+                break;
             }
 
-            *string = registry.global->description;
-
-            return NPERR_NO_ERROR;
+            *string = string_intern(registry->global->description);
+            result  = *string ? NPERR_NO_ERROR : NPERR_OUT_OF_MEMORY_ERROR;
+            break;
         default:
             // I have no handler for this requested value, so pass it through
             // to the relevant instance if it exists.
@@ -86,19 +116,22 @@ __export NPError NP_GetValue(NPP instance, NPPVariable variable, void *value)
             // We need to lookup who owns this instance.
             if (!netscape_instance_resolve(instance, &plugin)) {
                 // Instance does not exist, and I don't want to handle it.
-                l_warning("failed to resolve instance %p for variable %u",
-                          instance,
-                          variable);
+                l_warning_ratelimited("failed to resolve instance %p for variable %u",
+                                      instance,
+                                      variable);
 
-                return NPERR_INVALID_INSTANCE_ERROR;
+                result = NPERR_INVALID_INSTANCE_ERROR;
+                break;
             }
 
             // Pass through the call to the plugin.
-            return plugin->plugin_funcs->getvalue(instance, variable, value);
+            result = plugin->plugin_funcs->getvalue(instance, variable, value);
+            break;
     }
 
-    // Unreachable.
-    return NPERR_GENERIC_ERROR;
+    reload_leave();
+
+    return result;
 }
 
 // Provides global initialization for a plug-in.
@@ -110,7 +143,7 @@ __export NPError NP_GetValue(NPP instance, NPPVariable variable, void *value)
 __export NPError NP_Initialize(NPNetscapeFuncs *aNPNFuncs,
                                NPPluginFuncs *aNPPFuncs __unused)
 {
-    struct plugin *current = registry.plugins;
+    struct plugin *current = registry_current()->plugins;
 
     // This is useful to log for compatability issues.
     l_debug("NPNetscapeFuncs version %u, size %u",
@@ -118,13 +151,14 @@ __export NPError NP_Initialize(NPNetscapeFuncs *aNPNFuncs,
             aNPNFuncs->size);
 
     // Record the netscape functions for future use.
-    registry.netscape_funcs = aNPNFuncs;
+    registry_current()->netscape_funcs = aNPNFuncs;
 
     // We need to pass the call through to all plugins.
     while (current) {
-        NPError         *(*np_initialize)(void *, void *);
-        NPError         *(*np_getentrypoints)(void *);
+        NPError          (*np_initialize)(NPNetscapeFuncs *, NPPluginFuncs *);
+        NPError          (*np_getentrypoints)(NPPluginFuncs *);
         NPPluginFuncs     *np_funcs;
+        NPError            result;
 
         // Verify the plugin has been dlopened.
         if (!current->handle) {
@@ -163,7 +197,13 @@ __export NPError NP_Initialize(NPNetscapeFuncs *aNPNFuncs,
         // Now we can initialize it, and populate the plugin function table.
         // On Apple, the second argument is ignored, we need to populate it
         // ourselves via NP_GetEntryPoints.
-        if (np_initialize(aNPNFuncs, current->plugin_funcs) != NPERR_NO_ERROR) {
+        PROBE1(initialize__entry, current->section);
+
+        result = np_initialize(aNPNFuncs, current->plugin_funcs);
+
+        PROBE2(initialize__return, current->section, result);
+
+        if (result != NPERR_NO_ERROR) {
             // Difficult to know what to do here, should I stop passing calls
             // to this plugin?
             l_warning("plugin %s returned error from NP_Initialize",
@@ -207,6 +247,14 @@ __export NPError NP_Initialize(NPNetscapeFuncs *aNPNFuncs,
     // At this point, everything looks good.
     l_debug("NP_Initialize completed");
 
+    // Only watch for changes now, so that a reload always sees the browser
+    // functions and the initialised plugins, see reload.c.
+    reload_start();
+
+    // Likewise, the prefetch thread only starts once we're initialised, see
+    // daemon.c.
+    daemon_start();
+
     // Return success.
     return NPERR_NO_ERROR;
 }
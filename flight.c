@@ -0,0 +1,333 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Author: taviso@google.com
+//
+// A record of the most recent calls, written out if the process crashes.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#define LOG_MODULE LOG_MODULE_CORE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include "npapi.h"
+#include "npfunctions.h"
+#include "config.h"
+#include "log.h"
+#include "histogram.h"
+#include "shim.h"
+#include "flight.h"
+
+// When the browser crashes inside a wrapped plugin, the stack tells you where
+// it died but not how it got there. Every call through a shim is recorded in
+// a small ring, which costs an atomic increment and a few stores, so it's
+// always enabled.
+//
+// If a CrashLog is configured, we install a handler for fatal signals that
+// writes the ring to CrashLog.<pid>.log, and then passes the signal on to
+// whatever handler was installed before us, usually the browser's crash
+// reporter. Everything in the handler must be async-signal safe, so there is
+// no stdio here.
+
+static struct flight_record flight_ring[FLIGHT_RECORDS];
+static uint64_t             flight_sequence;
+static char                 flight_prefix[PATH_MAX - 32];
+static int                  flight_dumped;
+
+// The signals we handle, and the handlers they replaced.
+static const int kFlightSignals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+static struct sigaction flight_previous[sizeof kFlightSignals / sizeof *kFlightSignals];
+
+// Claim the next record in the ring. The ring is only ever written by the
+// thread calling plugins, the atomic is for the benefit of the reader.
+struct flight_record *flight_begin(unsigned entry, NPP instance, uint64_t start)
+{
+    uint64_t sequence = __atomic_add_fetch(&flight_sequence, 1, __ATOMIC_RELAXED);
+    struct flight_record *record = &flight_ring[sequence & (FLIGHT_RECORDS - 1)];
+
+    record->sequence    = sequence;
+    record->start       = start;
+    record->elapsed     = 0;
+    record->instance    = instance;
+    record->section     = NULL;
+    record->entry       = entry;
+    record->stream_end  = 0;
+    record->offset      = 0;
+    record->length      = 0;
+    record->mimetype[0] = '\0';
+
+    return record;
+}
+
+static void flight_write_string(int fd, const char *string)
+{
+    if (write(fd, string, strlen(string)) < 0) {
+        return;
+    }
+}
+
+static void flight_write_number(int fd, uint64_t value, unsigned base)
+{
+    char buffer[32];
+    char *digit = &buffer[sizeof buffer - 1];
+
+    *digit = '\0';
+
+    do {
+        *--digit = "0123456789abcdef"[value % base];
+    } while (value /= base);
+
+    if (base == 16) {
+        *--digit = 'x';
+        *--digit = '0';
+    }
+
+    flight_write_string(fd, digit);
+}
+
+static void flight_write_field(int fd, const char *name, uint64_t value, unsigned base)
+{
+    flight_write_string(fd, name);
+    flight_write_number(fd, value, base);
+}
+
+// Write the ring to fd, oldest first. This is async-signal safe.
+void flight_dump(int fd, int signum)
+{
+    uint64_t last = __atomic_load_n(&flight_sequence, __ATOMIC_RELAXED);
+    uint64_t sequence;
+    struct flight_record *record;
+
+    flight_write_field(fd, "nssecurity flight recorder, pid ", getpid(), 10);
+    flight_write_field(fd, ", signal ", signum, 10);
+    flight_write_field(fd, ", calls ", last, 10);
+    flight_write_string(fd, "\n");
+
+    sequence = last > FLIGHT_RECORDS ? last - FLIGHT_RECORDS + 1 : 1;
+
+    for (; sequence && sequence <= last; sequence++) {
+        record = &flight_ring[sequence & (FLIGHT_RECORDS - 1)];
+
+        // Overwritten while we were dumping, or torn.
+        if (record->sequence != sequence) {
+            continue;
+        }
+
+        flight_write_field(fd, "#", record->sequence, 10);
+        flight_write_field(fd, " start=", record->start, 10);
+        flight_write_string(fd, " ");
+        flight_write_string(fd, record->entry < SHIM_MAX
+                                    ? kShimNames[record->entry]
+                                    : "<unknown>");
+        flight_write_field(fd, " instance=", (uintptr_t) record->instance, 16);
+
+        if (record->section) {
+            flight_write_string(fd, " section=\"");
+            flight_write_string(fd, record->section);
+            flight_write_string(fd, "\"");
+        }
+
+        if (record->mimetype[0]) {
+            flight_write_string(fd, " mimetype=");
+            flight_write_string(fd, record->mimetype);
+        }
+
+        if (record->stream_end) {
+            flight_write_field(fd, " end=", record->stream_end, 10);
+        }
+
+        if (record->length) {
+            flight_write_field(fd, " offset=", record->offset, 10);
+            flight_write_field(fd, " length=", record->length, 10);
+        }
+
+        if (record->elapsed) {
+            flight_write_field(fd, " elapsed=", record->elapsed, 10);
+            flight_write_string(fd, "ns\n");
+        } else {
+            flight_write_string(fd, " in progress\n");
+        }
+    }
+}
+
+static void flight_signal_handler(int signum, siginfo_t *info, void *context)
+{
+    char path[PATH_MAX];
+    char pid[32];
+    char *digit = &pid[sizeof pid - 1];
+    unsigned value = getpid();
+    unsigned i;
+    int fd;
+
+    // Only the first fatal signal is recorded.
+    if (__atomic_exchange_n(&flight_dumped, true, __ATOMIC_ACQ_REL) == false) {
+        *digit = '\0';
+
+        do {
+            *--digit = '0' + value % 10;
+        } while (value /= 10);
+
+        strcpy(path, flight_prefix);
+        strcat(path, ".");
+        strcat(path, digit);
+        strcat(path, ".log");
+
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+
+        if (fd >= 0) {
+            flight_dump(fd, signum);
+            close(fd);
+        }
+    }
+
+    // Restore the previous handler. For a fault, returning re-executes the
+    // faulting instruction and it is delivered again. For a signal that was
+    // sent to us, we have to send it again.
+    for (i = 0; i < sizeof kFlightSignals / sizeof *kFlightSignals; i++) {
+        if (kFlightSignals[i] == signum) {
+            sigaction(signum, &flight_previous[i], NULL);
+        }
+    }
+
+    if (info->si_code <= 0) {
+        raise(signum);
+    }
+
+    (void) context;
+}
+
+// Dump the ring to prefix.<pid>.log if the process crashes.
+bool flight_install(const char *prefix)
+{
+    struct sigaction action = {
+        .sa_sigaction   = flight_signal_handler,
+        .sa_flags       = SA_SIGINFO | SA_ONSTACK,
+    };
+    unsigned i;
+
+    if (strlen(prefix) >= sizeof flight_prefix) {
+        l_warning("CrashLog path is too long");
+        return false;
+    }
+
+    strcpy(flight_prefix, prefix);
+
+    sigemptyset(&action.sa_mask);
+
+    for (i = 0; i < sizeof kFlightSignals / sizeof *kFlightSignals; i++) {
+        struct sigaction previous;
+
+        if (sigaction(kFlightSignals[i], &action, &previous) != 0) {
+            l_warning("failed to install handler for signal %d", kFlightSignals[i]);
+            continue;
+        }
+
+        // Don't chain to ourselves if we're installed twice.
+        if (previous.sa_sigaction != flight_signal_handler) {
+            flight_previous[i] = previous;
+        }
+    }
+
+    __atomic_store_n(&flight_dumped, false, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+#if defined(ENABLE_RUNTIME_TESTS)
+
+static int test_flight_chained;
+
+static void test_flight_handler(int signum)
+{
+    test_flight_chained = signum;
+}
+
+static void __constructor test_flight_recorder(void)
+{
+    char prefix[] = "/tmp/nssecurity-flight-test-XXXXXX";
+    char path[sizeof prefix + 32];
+    char contents[1024 * 64];
+    struct sigaction saved;
+    struct sigaction action = {
+        .sa_handler = test_flight_handler,
+    };
+    struct flight_record *record;
+    ssize_t length;
+    unsigned i;
+    int fd;
+
+    assert((fd = mkstemp(prefix)) >= 0);
+    close(fd);
+    unlink(prefix);
+
+    sprintf(path, "%s.%u.log", prefix, getpid());
+
+    // Wrap around the ring a few times.
+    for (i = 0; i < FLIGHT_RECORDS * 3; i++) {
+        record = flight_begin(SHIM_WRITE, NULL, i);
+        record->elapsed = 1;
+    }
+
+    record = flight_begin(SHIM_NEWSTREAM, (NPP) 0x1234, 0);
+    record->section    = "Test \"Section\"";
+    record->stream_end = 4096;
+    strcpy(record->mimetype, "application/x-test");
+
+    // Install a handler to chain to.
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGABRT, &action, &saved);
+
+    assert(flight_install(prefix) == true);
+
+    raise(SIGABRT);
+
+    assert(test_flight_chained == SIGABRT);
+
+    sigaction(SIGABRT, &saved, NULL);
+
+    assert((fd = open(path, O_RDONLY)) >= 0);
+    assert((length = read(fd, contents, sizeof contents - 1)) > 0);
+    contents[length] = '\0';
+    close(fd);
+    unlink(path);
+
+    assert(strstr(contents, "NPP_NewStream instance=0x1234 section=\"Test \"Section\"\" "
+                            "mimetype=application/x-test end=4096 in progress\n"));
+    assert(strstr(contents, "NPP_Write instance=0x0 elapsed=1ns\n"));
+
+    // Only the most recent records should be present.
+    for (i = 0, length = 0; contents[length]; length++) {
+        i += contents[length] == '\n';
+    }
+
+    assert(i == FLIGHT_RECORDS + 1);
+
+    // Restore the other fatal signals.
+    for (i = 0; i < sizeof kFlightSignals / sizeof *kFlightSignals; i++) {
+        if (kFlightSignals[i] != SIGABRT) {
+            sigaction(kFlightSignals[i], &flight_previous[i], NULL);
+        }
+    }
+}
+
+#endif
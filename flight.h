@@ -0,0 +1,28 @@
+#ifndef __FLIGHT_H
+#define __FLIGHT_H
+
+// Number of calls remembered, must be a power of two.
+#define FLIGHT_RECORDS          256
+#define FLIGHT_MIME_MAX         40
+
+// One call through a shim. Records are written without locks, and may be
+// read from a signal handler at any time, so a record can be torn or still in
+// progress, in which case elapsed is zero.
+struct flight_record {
+    uint64_t            sequence;
+    uint64_t            start;
+    uint64_t            elapsed;
+    NPP                 instance;
+    const char         *section;        // interned, never freed.
+    uint32_t            entry;
+    uint32_t            stream_end;
+    int32_t             offset;
+    int32_t             length;
+    char                mimetype[FLIGHT_MIME_MAX];
+};
+
+struct flight_record *flight_begin(unsigned entry, NPP instance, uint64_t start);
+bool flight_install(const char *prefix);
+void flight_dump(int fd, int signum);
+
+#endif
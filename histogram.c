@@ -0,0 +1,168 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Author: taviso@google.com
+//
+// Log-linear latency histograms.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#include "npapi.h"
+#include "npfunctions.h"
+#include "config.h"
+#include "histogram.h"
+
+// Map a value to its bucket. Values below HISTOGRAM_SUB_BUCKETS get a bucket
+// each, above that the bucket is selected by the position of the most
+// significant bit, and the next HISTOGRAM_SUB_BITS bits.
+unsigned histogram_bucket(uint64_t value)
+{
+    unsigned exponent;
+
+    if (value > HISTOGRAM_MAX_VALUE) {
+        value = HISTOGRAM_MAX_VALUE;
+    }
+
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+
+    exponent = 63 - __builtin_clzll(value);
+
+    return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS
+         + ((value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+// The smallest value counted in a bucket.
+uint64_t histogram_bucket_value(unsigned bucket)
+{
+    unsigned exponent;
+
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    exponent = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+
+    return (uint64_t)(HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS)
+                << (exponent - HISTOGRAM_SUB_BITS);
+}
+
+// Record a value. This is called for every call through the wrapper, so it
+// must stay cheap, it's a few relaxed atomic additions.
+void histogram_record(struct histogram *histogram, uint64_t value)
+{
+    uint64_t max;
+
+    __atomic_add_fetch(&histogram->buckets[histogram_bucket(value)],
+                       1,
+                       __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->total, value, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+
+    // Usually the max does not change, so only then do we need a loop.
+    while (value > max) {
+        if (__atomic_compare_exchange_n(&histogram->max,
+                                        &max,
+                                        value,
+                                        true,
+                                        __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+}
+
+void histogram_merge(struct histogram *result, const struct histogram *source)
+{
+    unsigned i;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        result->buckets[i] += source->buckets[i];
+    }
+
+    result->count += source->count;
+    result->total += source->total;
+
+    if (source->max > result->max) {
+        result->max = source->max;
+    }
+}
+
+// Return the value below which percentile% of recorded values fall, this is
+// the lowest value of the bucket it falls in.
+uint64_t histogram_percentile(const struct histogram *histogram, double percentile)
+{
+    uint64_t target;
+    uint64_t seen;
+    unsigned i;
+
+    if (histogram->count == 0) {
+        return 0;
+    }
+
+    target = histogram->count * percentile / 100.0;
+
+    if (target >= histogram->count) {
+        return histogram->max;
+    }
+
+    for (seen = i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if ((seen += histogram->buckets[i]) > target) {
+            return histogram_bucket_value(i);
+        }
+    }
+
+    return histogram->max;
+}
+
+#if defined(ENABLE_RUNTIME_TESTS)
+
+static void __constructor test_histogram(void)
+{
+    struct histogram histogram = {0};
+    unsigned i;
+
+    assert(histogram_bucket(0) == 0);
+    assert(histogram_bucket(7) == 7);
+    assert(histogram_bucket(8) == 8);
+    assert(histogram_bucket(15) == 15);
+    assert(histogram_bucket(16) == 16);
+    assert(histogram_bucket(17) == 16);
+    assert(histogram_bucket(HISTOGRAM_MAX_VALUE) == HISTOGRAM_BUCKETS - 1);
+    assert(histogram_bucket(~0ULL) == HISTOGRAM_BUCKETS - 1);
+
+    // Every bucket should map back to itself.
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        assert(histogram_bucket(histogram_bucket_value(i)) == i);
+    }
+
+    for (i = 1; i <= 1000; i++) {
+        histogram_record(&histogram, i * 1000);
+    }
+
+    assert(histogram.count == 1000);
+    assert(histogram.max == 1000000);
+    assert(histogram_percentile(&histogram, 50) <= 501000);
+    assert(histogram_percentile(&histogram, 50) >= 501000 - 501000 / 8);
+    assert(histogram_percentile(&histogram, 100) == 1000000);
+}
+
+#endif
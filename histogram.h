@@ -0,0 +1,29 @@
+#ifndef __HISTOGRAM_H
+#define __HISTOGRAM_H
+
+// A log-linear latency histogram, in the style of HdrHistogram. Values are
+// nanoseconds, each power of two is split into eight linear buckets, so
+// every bucket is within 12.5% of the values it counts. Values above
+// HISTOGRAM_MAX_VALUE are counted in the last bucket.
+
+#define HISTOGRAM_SUB_BITS      3
+#define HISTOGRAM_SUB_BUCKETS   (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS      36
+#define HISTOGRAM_MAX_VALUE     ((1ULL << HISTOGRAM_MAX_BITS) - 1)
+#define HISTOGRAM_BUCKETS       ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) \
+                                    * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+    uint64_t    count;
+    uint64_t    total;
+    uint64_t    max;
+    uint32_t    buckets[HISTOGRAM_BUCKETS];
+};
+
+void histogram_record(struct histogram *histogram, uint64_t value);
+void histogram_merge(struct histogram *result, const struct histogram *source);
+uint64_t histogram_percentile(const struct histogram *histogram, double percentile);
+unsigned histogram_bucket(uint64_t value);
+uint64_t histogram_bucket_value(unsigned bucket);
+
+#endif
@@ -0,0 +1,497 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Author: taviso@google.com
+//
+// Compiled policy images, see nssecurity-compile.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#define LOG_MODULE LOG_MODULE_CONFIG
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "npapi.h"
+#include "npfunctions.h"
+#include "config.h"
+#include "log.h"
+#include "arena.h"
+#include "util.h"
+#include "image.h"
+#include "policy.h"
+
+// FNV-1a, hash is the result of the previous block or kImageChecksumSeed.
+static const uint64_t kImageChecksumSeed = 0xcbf29ce484222325ULL;
+
+static uint64_t image_checksum(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *p = data;
+
+    while (size--) {
+        hash ^= *p++;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+// Copy a string into the pool, returning the offset it will have in the
+// image, or zero for NULL.
+static bool image_intern(struct string_builder *pool,
+                         uint32_t base,
+                         const char *string,
+                         uint32_t *offset)
+{
+    if (string == NULL) {
+        *offset = 0;
+        return true;
+    }
+
+    *offset = base + pool->length;
+
+    return string_builder_append(pool, string, strlen(string) + 1);
+}
+
+// Record the compiled policy of plugin, the domains are appended to the
+// domain offset array.
+static bool image_section(struct string_builder *pool,
+                          uint32_t base,
+                          const struct plugin *plugin,
+                          struct image_section *section,
+                          uint32_t **domains,
+                          const char *image)
+{
+    uint32_t i;
+
+    section->flags        = plugin->policy.flags;
+    section->domain_count = plugin->policy.domain_count;
+    section->domains      = (const char *) *domains - image;
+
+    if (!image_intern(pool, base, plugin->section, &section->name)
+     || !image_intern(pool, base, plugin->policy.warning, &section->warning)
+     || !image_intern(pool, base, plugin->mime_description, &section->mime_description))
+        return false;
+
+    for (i = 0; i < plugin->policy.domain_count; i++) {
+        if (!image_intern(pool, base, plugin->policy.domains[i], (*domains)++))
+            return false;
+    }
+
+    return true;
+}
+
+// Resolve a string offset, the image is verified to end with a nul so any
+// offset inside it is terminated.
+static const char *image_string(const struct image_header *header, uint32_t offset)
+{
+    if (offset == 0 || offset >= header->size)
+        return NULL;
+
+    return (const char *) header + offset;
+}
+
+// Check an array of count elements of size at offset is inside the image.
+static bool image_bounds(const struct image_header *header,
+                         uint32_t offset,
+                         uint32_t count,
+                         size_t size)
+{
+    return offset >= sizeof *header
+        && offset <= header->size
+        && count <= (header->size - offset) / size;
+}
+
+// Serialise the registry, which must have been built with the journal
+// enabled. The source is the configuration file it was built from, so that
+// a stale image can be detected.
+bool image_write(struct registry *registry, const char *path, const char *source)
+{
+    struct image_header     *header;
+    struct image_section    *section;
+    struct image_directive  *directive;
+    struct config_directive *record;
+    struct string_builder    pool = {0};
+    struct plugin           *current;
+    struct stat              info;
+    uint32_t                *domains;
+    uint32_t                 section_count   = 0;
+    uint32_t                 directive_count = 0;
+    uint32_t                 domain_count    = 0;
+    uint32_t                 base;
+    size_t                   size;
+    char                    *image = NULL;
+    char                    *temporary;
+    FILE                    *output = NULL;
+    bool                     written;
+    bool                     result = false;
+
+    if (stat(source, &info) != 0) {
+        l_error("unable to stat configuration %s, %m", source);
+        return false;
+    }
+
+    // The global section is written last, as it's compiled last.
+    for (current = registry->plugins; current; current = current->next) {
+        section_count++;
+        domain_count += current->policy.domain_count;
+    }
+
+    if (registry->global) {
+        section_count++;
+        domain_count += registry->global->policy.domain_count;
+    }
+
+    for (record = registry->directives; record; record = record->next) {
+        directive_count++;
+    }
+
+    base = sizeof *header
+         + section_count * sizeof *section
+         + directive_count * sizeof *directive
+         + domain_count * sizeof *domains;
+
+    if ((image = calloc(1, base)) == NULL) {
+        l_error("memory allocation failure");
+        goto cleanup;
+    }
+
+    header    = (void *) image;
+    section   = (void *)(header + 1);
+    directive = (void *)(section + section_count);
+    domains   = (void *)(directive + directive_count);
+
+    header->magic           = IMAGE_MAGIC;
+    header->version         = IMAGE_VERSION;
+    header->source_mtime    = info.st_mtim.tv_sec * 1000000000ULL + info.st_mtim.tv_nsec;
+    header->source_size     = info.st_size;
+    header->section_count   = section_count;
+    header->sections        = (char *) section - image;
+    header->directive_count = directive_count;
+    header->directives      = (char *) directive - image;
+
+    if (!image_intern(&pool, base, registry->mime_description, &header->mime_description))
+        goto cleanup;
+
+    for (current = registry->plugins; current; current = current->next) {
+        if (!image_section(&pool, base, current, section++, &domains, image))
+            goto cleanup;
+    }
+
+    if (registry->global) {
+        if (!image_section(&pool, base, registry->global, section++, &domains, image))
+            goto cleanup;
+    }
+
+    for (record = registry->directives; record; record = record->next, directive++) {
+        if (!image_intern(&pool, base, record->section, &directive->section)
+         || !image_intern(&pool, base, record->name, &directive->name)
+         || !image_intern(&pool, base, record->value, &directive->value))
+            goto cleanup;
+    }
+
+    // Make sure the image always ends with a nul, even if there are no strings.
+    if (!string_builder_append(&pool, "", 1))
+        goto cleanup;
+
+    size = base + pool.length;
+
+    if (size > UINT32_MAX) {
+        l_error("compiled policy is too large");
+        goto cleanup;
+    }
+
+    header->size     = size;
+    header->checksum = image_checksum(kImageChecksumSeed, header + 1, base - sizeof *header);
+    header->checksum = image_checksum(header->checksum, pool.data, pool.length);
+
+    // Write it somewhere else first, so that a browser starting never sees
+    // a partial image.
+    temporary = alloca(strlen(path) + sizeof ".tmp");
+
+    sprintf(temporary, "%s.tmp", path);
+
+    if ((output = fopen(temporary, "w")) == NULL) {
+        l_error("failed to create %s, %m", temporary);
+        goto cleanup;
+    }
+
+    written = fwrite(image, base, 1, output) == 1
+           && fwrite(pool.data, pool.length, 1, output) == 1;
+
+    if (fclose(output) != 0)
+        written = false;
+
+    output = NULL;
+
+    if (!written) {
+        l_error("failed to write %s, %m", temporary);
+        unlink(temporary);
+        goto cleanup;
+    }
+
+    if (rename(temporary, path) != 0) {
+        l_error("failed to rename %s to %s, %m", temporary, path);
+        unlink(temporary);
+        goto cleanup;
+    }
+
+    l_debug("wrote %u sections and %u directives to %s",
+            section_count,
+            directive_count,
+            path);
+
+    result = true;
+
+  cleanup:
+    if (output)
+        fclose(output);
+
+    free(pool.data);
+    free(image);
+    return result;
+}
+
+// Map a compiled policy and build the registry from it. Returns false if the
+// image is missing, damaged or out of date, in which case the registry is
+// left empty and the ini files should be parsed instead.
+bool image_load(struct registry *registry, const char *path, const char *source)
+{
+    const struct image_header    *header = MAP_FAILED;
+    const struct image_section   *section;
+    const struct image_directive *directive;
+    const uint32_t               *domains;
+    struct plugin                *plugin;
+    struct stat                   info;
+    const char                  **strings;
+    size_t                        mapped = 0;
+    uint32_t                      i;
+    uint32_t                      j;
+    int                           fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        l_debug("no compiled policy at %s, %m", path);
+        return false;
+    }
+
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t) sizeof *header) {
+        l_warning("compiled policy %s is truncated, ignoring", path);
+        goto failure;
+    }
+
+    if ((header = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        l_warning("failed to map compiled policy %s, %m", path);
+        goto failure;
+    }
+
+    mapped = info.st_size;
+
+    if (header->magic != IMAGE_MAGIC || header->version != IMAGE_VERSION) {
+        l_warning("%s is not a compiled policy for this version, ignoring", path);
+        goto failure;
+    }
+
+    if (header->size != (uint64_t) info.st_size
+     || ((const char *) header)[header->size - 1] != '\0'
+     || !image_bounds(header, header->sections, header->section_count, sizeof *section)
+     || !image_bounds(header, header->directives, header->directive_count, sizeof *directive)
+     || header->checksum != image_checksum(kImageChecksumSeed,
+                                           header + 1,
+                                           header->size - sizeof *header)) {
+        l_warning("compiled policy %s is damaged, ignoring", path);
+        goto failure;
+    }
+
+    // Only use the image if it was compiled from the current configuration.
+    if (stat(source, &info) != 0
+     || header->source_size != (uint64_t) info.st_size
+     || header->source_mtime != info.st_mtim.tv_sec * 1000000000ULL + info.st_mtim.tv_nsec) {
+        l_message("compiled policy %s is out of date, ignoring", path);
+        goto failure;
+    }
+
+    section   = (const void *)((const char *) header + header->sections);
+    directive = (const void *)((const char *) header + header->directives);
+
+    close(fd);
+
+    fd                   = -1;
+    registry->image      = header;
+    registry->image_size = header->size;
+
+    // Replay the directives, which loads the plugins and sets the strings.
+    for (i = 0; i < header->directive_count; i++) {
+        if (!image_string(header, directive[i].section)
+         || !image_string(header, directive[i].name)
+         || !image_string(header, directive[i].value)
+         || !config_set(registry,
+                        image_string(header, directive[i].section),
+                        image_string(header, directive[i].name),
+                        image_string(header, directive[i].value))) {
+            l_warning("failed to apply directive %u from compiled policy %s", i, path);
+            goto failure;
+        }
+    }
+
+    // Now fill in everything that would have been computed after parsing.
+    for (i = 0; i < header->section_count; i++) {
+        if (!image_string(header, section[i].name)
+         || !find_plugin_section(registry, image_string(header, section[i].name), &plugin)
+         || !image_bounds(header, section[i].domains, section[i].domain_count, sizeof *domains)) {
+            l_warning("failed to apply section %u from compiled policy %s", i, path);
+            goto failure;
+        }
+
+        domains = (const void *)((const char *) header + section[i].domains);
+
+        strings = NULL;
+
+        if (section[i].domain_count
+                && !(strings = arena_alloc(registry->arena,
+                                           section[i].domain_count * sizeof *strings))) {
+            l_error("memory allocation failure");
+            goto failure;
+        }
+
+        for (j = 0; j < section[i].domain_count; j++) {
+            if (!(strings[j] = image_string(header, domains[j]))) {
+                l_warning("bad domain in section %u of compiled policy %s", i, path);
+                goto failure;
+            }
+        }
+
+        plugin->policy.flags        = section[i].flags;
+        plugin->policy.warning      = image_string(header, section[i].warning);
+        plugin->policy.domain_count = section[i].domain_count;
+        plugin->policy.domains      = strings;
+        plugin->mime_description    = (char *) image_string(header, section[i].mime_description);
+
+        // Pointers can't be stored in the image, so the networks are parsed
+        // again from AllowedNetworks, which the directives have restored.
+        if (!policy_compile_networks(registry->arena, plugin)) {
+            goto failure;
+        }
+    }
+
+    registry->mime_description = (char *) image_string(header, header->mime_description);
+
+    l_debug("loaded %u sections from compiled policy %s", header->section_count, path);
+
+    return true;
+
+  failure:
+    if (fd >= 0)
+        close(fd);
+
+    // Anything already applied is discarded, which also unmaps the image.
+    if (registry->image) {
+        config_destroy(registry);
+    } else if (header != MAP_FAILED) {
+        munmap((void *) header, mapped);
+    }
+
+    return false;
+}
+
+void image_unload(struct registry *registry)
+{
+    if (registry->image) {
+        munmap((void *) registry->image, registry->image_size);
+    }
+
+    registry->image      = NULL;
+    registry->image_size = 0;
+}
+
+#if defined(ENABLE_RUNTIME_TESTS)
+
+static void __constructor test_image(void)
+{
+    struct registry source   = { .journal = true };
+    struct registry compiled = {0};
+    struct plugin  *plugin;
+    char            config[] = "/tmp/nssecurity-image-test-XXXXXX";
+    char            path[sizeof config + 4];
+    int             fd;
+
+    assert((fd = mkstemp(config)) >= 0);
+    assert(write(fd, "[Global]\n", 9) == 9);
+    close(fd);
+
+    sprintf(path, "%s.img", config);
+
+    assert(config_set(&source, "Global", "FriendlyWarning", "blocked") == true);
+    assert(config_set(&source, "Example", "PluginName", "Example") == true);
+    assert(config_set(&source, "Example", "AllowedDomains", "*.example.com,example.org") == true);
+    assert(config_set(&source, "Example", "AllowPort", "yes") == true);
+    assert(config_set(&source, "Example", "AllowedNetworks", "10.4.0.0/16,2001:db8::/32") == true);
+
+    for (plugin = source.plugins; plugin; plugin = plugin->next)
+        policy_compile(source.arena, plugin, source.global);
+
+    policy_compile(source.arena, source.global, NULL);
+
+    source.plugins->mime_description = "application/x-example:ex:Example";
+    source.mime_description          = source.plugins->mime_description;
+
+    assert(image_write(&source, path, config) == true);
+    assert(image_load(&compiled, path, config) == true);
+
+    assert(compiled.image && compiled.plugins && compiled.global);
+    assert(strcmp(compiled.plugins->name, "Example") == 0);
+    assert(strcmp(compiled.plugins->allow_domains, "*.example.com,example.org") == 0);
+    assert(compiled.plugins->policy.flags == POLICY_ALLOW_PORT);
+    assert(compiled.plugins->policy.domain_count == 2);
+    assert(strcmp(compiled.plugins->policy.domains[1], "example.org") == 0);
+    assert(strcmp(compiled.plugins->policy.warning, "blocked") == 0);
+    assert(strcmp(compiled.mime_description, "application/x-example:ex:Example") == 0);
+    assert(compiled.plugins->networks != NULL);
+    assert(policy_plugin_allowed_url(compiled.plugins, "https://10.4.2.7/") == true);
+    assert(policy_plugin_allowed_url(compiled.plugins, "https://[2001:db8::1]/") == true);
+    assert(policy_plugin_allowed_url(compiled.plugins, "https://10.5.2.7/") == false);
+
+    config_destroy(&compiled);
+
+    assert(compiled.image == NULL && compiled.arena == NULL);
+
+    // A modified configuration makes the image stale.
+    assert((fd = open(config, O_WRONLY | O_APPEND)) >= 0);
+    assert(write(fd, "\n", 1) == 1);
+    close(fd);
+
+    assert(image_load(&compiled, path, config) == false);
+    assert(compiled.image == NULL && compiled.plugins == NULL);
+
+    // As does any damage.
+    assert(image_write(&source, path, config) == true);
+    assert((fd = open(path, O_WRONLY)) >= 0);
+    assert(pwrite(fd, "X", 1, sizeof(struct image_header) + 1) == 1);
+    close(fd);
+
+    assert(image_load(&compiled, path, config) == false);
+    assert(compiled.image == NULL && compiled.plugins == NULL);
+
+    config_destroy(&source);
+    unlink(path);
+    unlink(config);
+}
+
+#endif
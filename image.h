@@ -0,0 +1,46 @@
+#ifndef __IMAGE_H
+#define __IMAGE_H
+
+// A compiled policy, written by nssecurity-compile and mapped read-only at
+// startup instead of parsing the ini files. Everything is an offset from the
+// start of the image, zero means not present. Strings are nul terminated.
+#define IMAGE_MAGIC     0x4953534e      // "NSSI"
+#define IMAGE_VERSION   1
+
+struct image_header {
+    uint32_t    magic;
+    uint32_t    version;
+    uint64_t    size;               // of the whole image.
+    uint64_t    checksum;           // FNV-1a of everything after the header.
+    uint64_t    source_mtime;       // nanoseconds, of the system configuration.
+    uint64_t    source_size;
+    uint32_t    section_count;
+    uint32_t    sections;           // struct image_section[section_count]
+    uint32_t    directive_count;
+    uint32_t    directives;         // struct image_directive[directive_count]
+    uint32_t    mime_description;   // the aggregated description.
+    uint32_t    reserved;
+};
+
+// The compiled policy of a section, see struct policy.
+struct image_section {
+    uint32_t    name;
+    uint32_t    flags;
+    uint32_t    warning;
+    uint32_t    domain_count;
+    uint32_t    domains;            // uint32_t[domain_count] string offsets.
+    uint32_t    mime_description;
+};
+
+// The directives are replayed to load the plugins and fill in the strings.
+struct image_directive {
+    uint32_t    section;
+    uint32_t    name;
+    uint32_t    value;
+};
+
+bool image_write(struct registry *registry, const char *path, const char *source);
+bool image_load(struct registry *registry, const char *path, const char *source);
+void image_unload(struct registry *registry);
+
+#endif
@@ -17,21 +17,30 @@
 // limitations under the License.
 //
 
+#define LOG_MODULE LOG_MODULE_INSTANCE
+
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "log.h"
 #include "npfunctions.h"
 #include "npapi.h"
 #include "config.h"
 #include "instance.h"
+#include "histogram.h"
+#include "shim.h"
+#include "stats.h"
+#include "probe.h"
 
 struct instance {
     void *instance;
     void *plugin;
+    uint64_t cpu_time;
+    uint64_t wall_time;
 };
 
 static struct instance *global_instance_table;
@@ -72,6 +81,12 @@ bool netscape_instance_resolve(NPP instance, struct plugin **result)
     // Pass pointer back to caller.
     *result = match ? match->plugin : NULL;
 
+    if (match) {
+        stats_inc(global_stats->resolve_hits);
+    } else {
+        stats_inc(global_stats->resolve_misses);
+    }
+
     // Return result.
     return !! *result;
 }
@@ -91,10 +106,21 @@ bool netscape_instance_map(NPP instance, struct plugin *plugin)
     // Insert the new relationship.
     global_instance_table[global_instance_count].instance = instance;
     global_instance_table[global_instance_count].plugin = plugin;
+    global_instance_table[global_instance_count].cpu_time = 0;
+    global_instance_table[global_instance_count].wall_time = 0;
 
     // Increment list size
     global_instance_count++;
 
+    // The plugin record must outlive the instance, see reload.c.
+    if (plugin->registry) {
+        __atomic_add_fetch(&plugin->registry->instances, 1, __ATOMIC_RELAXED);
+    }
+
+    stats_instance_mapped(plugin);
+
+    PROBE2(instance__map, instance, plugin->section);
+
     // Sort the array so we can use bsearch.
     qsort(global_instance_table,
           global_instance_count,
@@ -123,6 +149,24 @@ bool netscape_instance_destroy(NPP instance)
 
     // Remove from array, no sort required.
     if (match) {
+        struct plugin *plugin = match->plugin;
+
+        stats_instance_destroyed(plugin);
+
+        if (plugin->registry) {
+            __atomic_sub_fetch(&plugin->registry->instances, 1, __ATOMIC_RELEASE);
+        }
+
+        PROBE1(instance__destroy, instance);
+
+        if (match->wall_time) {
+            l_debug("instance %p of %s used %llums cpu, %llums wall",
+                    instance,
+                    ((struct plugin *)(match->plugin))->section,
+                    (unsigned long long) match->cpu_time / 1000000,
+                    (unsigned long long) match->wall_time / 1000000);
+        }
+
         memmove(&match[0],
                 &match[1],
                 (&global_instance_table[global_instance_count]
@@ -152,6 +196,45 @@ bool netscape_instance_list_destroy(void)
     return true;
 }
 
+// Add the time spent in a call to instance, this is only used when
+// CpuReportInterval is set.
+void netscape_instance_account(NPP instance, uint64_t cpu, uint64_t wall)
+{
+    struct instance *match, key = {
+        .instance = instance,
+        .plugin   = NULL,
+    };
+
+    match = bsearch(&key,
+                    global_instance_table,
+                    global_instance_count,
+                    sizeof key,
+                    instance_compare);
+
+    if (match) {
+        match->cpu_time  += cpu;
+        match->wall_time += wall;
+    }
+}
+
+// Print the time used by each live instance.
+void netscape_instance_report(void)
+{
+    unsigned i;
+
+    if (!l_enabled(LOG_LEVEL_DEBUG)) {
+        return;
+    }
+
+    for (i = 0; i < global_instance_count; i++) {
+        l_debug("instance %p of %s has used %llums cpu, %llums wall",
+                global_instance_table[i].instance,
+                ((struct plugin *)(global_instance_table[i].plugin))->section,
+                (unsigned long long) global_instance_table[i].cpu_time / 1000000,
+                (unsigned long long) global_instance_table[i].wall_time / 1000000);
+    }
+}
+
 // Compare routine for bsearch and qsort.
 static int instance_compare(const void *key, const void *value)
 {
@@ -185,7 +268,7 @@ static void __unused netscape_instance_list_dump(void)
 
 static void __constructor test_instance_maps(void)
 {
-    struct plugin data1, data2, data3;
+    struct plugin data1 = {0}, data2 = {0}, data3 = {0};
     struct plugin *result1, *result2, *result3;
 
     void *key1 = &key1;
@@ -5,5 +5,7 @@ bool netscape_instance_resolve(NPP instance, struct plugin **result);
 bool netscape_instance_map(NPP instance, struct plugin *plugin);
 bool netscape_instance_destroy(NPP instance);
 bool netscape_instance_list_destroy(void);
+void netscape_instance_account(NPP instance, uint64_t cpu, uint64_t wall);
+void netscape_instance_report(void);
 
 #endif
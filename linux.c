@@ -17,9 +17,17 @@
 // limitations under the License.
 //
 
+#define LOG_MODULE LOG_MODULE_PLATFORM
+#define _GNU_SOURCE     // dlinfo()
+
 #include <stdio.h>
+#include <stdint.h>
 #include <dlfcn.h>
+#include <link.h>
+#include <elf.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "log.h"
 #include "npapi.h"
@@ -80,3 +88,220 @@ void platform_dlclose(void *handle)
     if (handle) dlclose(handle);
 }
 
+
+// The relocation types that reference a GOT slot we can safely rewrite.
+#if defined(__x86_64__)
+# define R_JUMP_SLOT    R_X86_64_JUMP_SLOT
+# define R_GLOB_DAT     R_X86_64_GLOB_DAT
+#elif defined(__i386__)
+# define R_JUMP_SLOT    R_386_JMP_SLOT
+# define R_GLOB_DAT     R_386_GLOB_DAT
+#elif defined(__aarch64__)
+# define R_JUMP_SLOT    R_AARCH64_JUMP_SLOT
+# define R_GLOB_DAT     R_AARCH64_GLOB_DAT
+#endif
+
+#if __ELF_NATIVE_CLASS == 64
+# define ELF_R_SYM      ELF64_R_SYM
+# define ELF_R_TYPE     ELF64_R_TYPE
+#else
+# define ELF_R_SYM      ELF32_R_SYM
+# define ELF_R_TYPE     ELF32_R_TYPE
+#endif
+
+struct module {
+    struct link_map *map;
+    uintptr_t        start;
+    uintptr_t        end;
+    uintptr_t        relro_start;
+    uintptr_t        relro_end;
+    size_t           mapped;
+    bool             found;
+};
+
+static int platform_module_phdr(struct dl_phdr_info *info,
+                               size_t size __unused,
+                               void *param)
+{
+    struct module *module = param;
+    uintptr_t      start;
+    uintptr_t      end;
+    ElfW(Half)     i;
+
+    if (info->dlpi_addr != module->map->l_addr
+            || strcmp(info->dlpi_name, module->map->l_name) != 0) {
+        return 0;
+    }
+
+    module->start = UINTPTR_MAX;
+
+    for (i = 0; i < info->dlpi_phnum; i++) {
+        start = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+        end   = start + info->dlpi_phdr[i].p_memsz;
+
+        switch (info->dlpi_phdr[i].p_type) {
+            case PT_LOAD:
+                module->mapped += info->dlpi_phdr[i].p_memsz;
+                module->start   = start < module->start ? start : module->start;
+                module->end     = end > module->end ? end : module->end;
+                break;
+            case PT_GNU_RELRO:
+                module->relro_start = start;
+                module->relro_end   = end;
+                break;
+        }
+    }
+
+    module->found = true;
+    return 1;
+}
+
+static bool platform_module_find(void *handle, struct module *module)
+{
+    memset(module, 0, sizeof *module);
+
+    if (dlinfo(handle, RTLD_DI_LINKMAP, &module->map) != 0) {
+        l_warning("unable to find link map for handle %p, %s", handle, dlerror());
+        return false;
+    }
+
+    dl_iterate_phdr(platform_module_phdr, module);
+
+    return module->found;
+}
+
+// Find the address range covered by the segments of a loaded module, and the
+// total size of those segments.
+bool platform_module_info(void *handle,
+                          uintptr_t *start,
+                          uintptr_t *end,
+                          size_t *mapped)
+{
+    struct module module;
+
+    if (!platform_module_find(handle, &module))
+        return false;
+
+    *start  = module.start;
+    *end    = module.end;
+    *mapped = module.mapped;
+    return true;
+}
+
+#if defined(R_JUMP_SLOT)
+// Rewrite the GOT slots a module uses to reach the named imports, so that
+// calls from that module (and only that module) go to the replacements. The
+// previous contents of each slot are stored in originals, if it's not NULL, so
+// the patch can be reversed by passing them back as replacements.
+//
+// With lazy binding the previous contents may be a PLT stub, so originals are
+// only useful for restoring the slot, not for calling.
+//
+// Returns the number of slots rewritten.
+unsigned platform_patch_imports(void *handle,
+                                const char *names[],
+                                void *replacements[],
+                                void *originals[],
+                                unsigned count)
+{
+    struct module    module;
+    ElfW(Dyn)       *dyn;
+    ElfW(Sym)       *symtab     = NULL;
+    const char      *strtab     = NULL;
+    uintptr_t        tables[2]  = { 0 };
+    size_t           sizes[2]   = { 0 };
+    size_t           entsize    = sizeof(ElfW(Rela));
+    size_t           pagesize   = sysconf(_SC_PAGESIZE);
+    unsigned         patched    = 0;
+    unsigned         table;
+    unsigned         i;
+
+    if (!platform_module_find(handle, &module))
+        return 0;
+
+    for (dyn = module.map->l_ld; dyn->d_tag != DT_NULL; dyn++) {
+        // The loader usually relocates these in place, but not everywhere.
+        uintptr_t ptr = dyn->d_un.d_ptr < module.map->l_addr
+                      ? dyn->d_un.d_ptr + module.map->l_addr
+                      : dyn->d_un.d_ptr;
+
+        switch (dyn->d_tag) {
+            case DT_SYMTAB:   symtab    = (ElfW(Sym) *) ptr; break;
+            case DT_STRTAB:   strtab    = (const char *) ptr; break;
+            case DT_JMPREL:   tables[0] = ptr; break;
+            case DT_PLTRELSZ: sizes[0]  = dyn->d_un.d_val; break;
+            case DT_RELA:     tables[1] = ptr; break;
+            case DT_RELASZ:   sizes[1]  = dyn->d_un.d_val; break;
+            case DT_REL:      tables[1] = ptr; break;
+            case DT_RELSZ:    sizes[1]  = dyn->d_un.d_val; break;
+            case DT_PLTREL:
+                entsize = dyn->d_un.d_val == DT_REL
+                        ? sizeof(ElfW(Rel))
+                        : sizeof(ElfW(Rela));
+                break;
+        }
+    }
+
+    if (!symtab || !strtab) {
+        l_warning("module %s has no dynamic symbol table", module.map->l_name);
+        return 0;
+    }
+
+    // Both ElfW(Rel) and ElfW(Rela) begin with r_offset and r_info, so I can
+    // walk either with the same code.
+    for (table = 0; table < 2; table++) {
+        uintptr_t reloc;
+
+        for (reloc = tables[table]; reloc < tables[table] + sizes[table]; reloc += entsize) {
+            ElfW(Rel)   *rel  = (ElfW(Rel) *) reloc;
+            const char  *name = strtab + symtab[ELF_R_SYM(rel->r_info)].st_name;
+            void       **slot = (void **)(module.map->l_addr + rel->r_offset);
+            uintptr_t    page = (uintptr_t) slot & ~(pagesize - 1);
+
+            if (ELF_R_TYPE(rel->r_info) != R_JUMP_SLOT
+                    && ELF_R_TYPE(rel->r_info) != R_GLOB_DAT) {
+                continue;
+            }
+
+            for (i = 0; i < count; i++) {
+                if (strcmp(name, names[i]) != 0)
+                    continue;
+
+                if (mprotect((void *) page, pagesize, PROT_READ | PROT_WRITE) != 0) {
+                    l_warning("unable to unprotect import %s in %s",
+                              name,
+                              module.map->l_name);
+                    break;
+                }
+
+                if (originals)
+                    originals[i] = *slot;
+
+                __atomic_store_n(slot, replacements[i], __ATOMIC_RELEASE);
+
+                // Slots covered by RELRO were read only before we started.
+                if ((uintptr_t) slot >= module.relro_start
+                        && (uintptr_t) slot < module.relro_end) {
+                    mprotect((void *) page, pagesize, PROT_READ);
+                }
+
+                patched++;
+                break;
+            }
+        }
+    }
+
+    l_debug("rewrote %u import slots in %s", patched, module.map->l_name);
+
+    return patched;
+}
+#else
+unsigned platform_patch_imports(void *handle __unused,
+                                const char *names[] __unused,
+                                void *replacements[] __unused,
+                                void *originals[] __unused,
+                                unsigned count __unused)
+{
+    return 0;
+}
+#endif
@@ -20,21 +20,215 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+#include <time.h>
+#include <stdint.h>
 
 #include "npapi.h"
 #include "npfunctions.h"
 #include "config.h"
 #include "log.h"
+#include "logsink.h"
+#include "histogram.h"
+#include "shim.h"
+#include "stats.h"
+#include "util.h"
+
+// Names accepted for each module in a verbosity specification.
+static const char *kLogModuleNames[LOG_MODULE_MAX] = {
+    [LOG_MODULE_CORE]       = "core",
+    [LOG_MODULE_AUDIT]      = "audit",
+    [LOG_MODULE_CONFIG]     = "config",
+    [LOG_MODULE_EXPORT]     = "export",
+    [LOG_MODULE_INSTANCE]   = "instance",
+    [LOG_MODULE_MEMORY]     = "memory",
+    [LOG_MODULE_NETSCAPE]   = "netscape",
+    [LOG_MODULE_PLATFORM]   = "platform",
+    [LOG_MODULE_POLICY]     = "policy",
+    [LOG_MODULE_SHIM]       = "shim",
+    [LOG_MODULE_STATS]      = "stats",
+    [LOG_MODULE_UTIL]       = "util",
+    [LOG_MODULE_WATCHDOG]   = "watchdog",
+};
+
+// Names accepted for each level in a verbosity specification.
+static const char *kLogLevelNames[] = {
+    [LOG_LEVEL_NONE]        = "none",
+    [LOG_LEVEL_ERROR]       = "error",
+    [LOG_LEVEL_WARNING]     = "warning",
+    [LOG_LEVEL_MESSAGE]     = "message",
+    [LOG_LEVEL_DEBUG]       = "debug",
+};
+
+// Each rate limited call site may print kLogSiteBurst messages every
+// kLogSiteInterval milliseconds.
+static const int32_t  kLogSiteBurst    = 10;
+static const uint64_t kLogSiteInterval = 5000;
+
+// By default everything except debugging messages is printed.
+unsigned char log_verbosity[LOG_MODULE_MAX] = {
+    [0 ... LOG_MODULE_MAX - 1] = LOG_LEVEL_MESSAGE,
+};
+
+static bool log_lookup_name(const char *name,
+                            const char **table,
+                            unsigned count,
+                            unsigned *result)
+{
+    for (*result = 0; *result < count; (*result)++) {
+        if (strcasecmp(name, table[*result]) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Parse a verbosity specification and apply it. This is a list of levels
+// separated by ',', each optionally prefixed with a module name, for example:
+//
+//      warning,policy:debug,netscape:debug
+//
+// A bare level applies to every module, so it should come first. Returns
+// false if any part of the specification was not recognised, but the valid
+// parts are still applied.
+bool log_set_verbosity(const char *spec)
+{
+    char *copy;
+    char *saveptr;
+    char *field;
+    char *level;
+    unsigned module;
+    unsigned value;
+    bool result;
+
+    // Nothing to do.
+    if (spec == NULL) {
+        return true;
+    }
+
+    copy    = strdupa(spec);
+    saveptr = NULL;
+    result  = true;
+
+    while ((field = strtok_r(copy, ", \t", &saveptr))) {
+        // Reset the string for strtok.
+        copy = NULL;
+
+        // Check if this is restricted to a module.
+        if ((level = strchr(field, ':'))) {
+            *level++ = '\0';
+
+            if (!log_lookup_name(field,
+                                 kLogModuleNames,
+                                 LOG_MODULE_MAX,
+                                 &module)) {
+                l_warning("unrecognised log module %s", field);
+                result = false;
+                continue;
+            }
+        } else {
+            level  = field;
+            module = LOG_MODULE_MAX;
+        }
+
+        if (!log_lookup_name(level,
+                             kLogLevelNames,
+                             sizeof kLogLevelNames / sizeof *kLogLevelNames,
+                             &value)) {
+            l_warning("unrecognised log level %s", level);
+            result = false;
+            continue;
+        }
+
+        // Apply to the requested module, or all of them.
+        if (module == LOG_MODULE_MAX) {
+            memset(log_verbosity, value, sizeof log_verbosity);
+        } else {
+            log_verbosity[module] = value;
+        }
+    }
+
+    return result;
+}
+
+// Decide if a rate limited call site may print another message. This is
+// called on every attempt, so must be cheap and must not block. The coarse
+// clock is read from the vDSO without a syscall, and the bucket is updated
+// with atomic operations.
+bool log_site_admit(struct log_site *site, const char *function)
+{
+    struct timespec now;
+    uint64_t stamp;
+    uint64_t current;
+    uint32_t suppressed;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+    current = now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+    stamp   = __atomic_load_n(&site->stamp, __ATOMIC_RELAXED);
+
+    // Refill the bucket if the interval has expired. If multiple threads
+    // race here, only the winner refills and prints the summary.
+    if (current - stamp >= kLogSiteInterval || stamp == 0) {
+        if (__atomic_compare_exchange_n(&site->stamp,
+                                        &stamp,
+                                        current,
+                                        false,
+                                        __ATOMIC_ACQ_REL,
+                                        __ATOMIC_RELAXED)) {
+            __atomic_store_n(&site->tokens, kLogSiteBurst, __ATOMIC_RELEASE);
+
+            suppressed = __atomic_exchange_n(&site->suppressed,
+                                             0,
+                                             __ATOMIC_RELAXED);
+
+            if (suppressed) {
+                l_warning_(function, "suppressed %u similar messages",
+                           suppressed);
+            }
+        }
+    }
+
+    // Take a token if one is available.
+    if (__atomic_sub_fetch(&site->tokens, 1, __ATOMIC_RELAXED) >= 0) {
+        return true;
+    }
+
+    // Otherwise, just count it. The bucket can't go far negative, as it's
+    // reset on every refill.
+    __atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+
+    stats_inc(global_stats->log_suppressed);
+    return false;
+}
+
+// All messages end up here, they're written to stderr unless a sink has been
+// configured with LogTarget.
+static void l_vprintf(unsigned level,
+                      const char *function,
+                      const char *format,
+                      va_list ap)
+{
+    if (logsink_enabled()) {
+        logsink_vqueue(level, function, format, ap);
+        return;
+    }
+
+    fprintf(stderr, "%s:%s(): ", NSSECURITY_TAG, function);
+    vfprintf(stderr, format, ap);
+    fputc('\n', stderr);
+}
 
 void l_message_(const char *function, const char *format, ...)
 {
     va_list ap;
 
-    fprintf(stderr, "%s:%s(): ", NSSECURITY_TAG, function);
     va_start(ap, format);
-        vfprintf(stderr, format, ap);
+        l_vprintf(LOG_LEVEL_MESSAGE, function, format, ap);
     va_end(ap);
-    fputc('\n', stderr);
     return;
 }
 
@@ -42,11 +236,9 @@ void l_warning_(const char *function, const char *format, ...)
 {
     va_list ap;
 
-    fprintf(stderr, "%s:%s(): ", NSSECURITY_TAG, function);
     va_start(ap, format);
-        vfprintf(stderr, format, ap);
+        l_vprintf(LOG_LEVEL_WARNING, function, format, ap);
     va_end(ap);
-    fputc('\n', stderr);
     return;
 }
 
@@ -54,11 +246,9 @@ void l_error_(const char *function, const char *format, ...)
 {
     va_list ap;
 
-    fprintf(stderr, "%s:%s(): ", NSSECURITY_TAG, function);
     va_start(ap, format);
-        vfprintf(stderr, format, ap);
+        l_vprintf(LOG_LEVEL_ERROR, function, format, ap);
     va_end(ap);
-    fputc('\n', stderr);
     return;
 }
 
@@ -66,10 +256,57 @@ void l_debug_(const char *function, const char *format, ...)
 {
     va_list ap;
 
-    fprintf(stderr, "%s:%s(): ", NSSECURITY_TAG, function);
     va_start(ap, format);
-        vfprintf(stderr, format, ap);
+        l_vprintf(LOG_LEVEL_DEBUG, function, format, ap);
     va_end(ap);
-    fputc('\n', stderr);
     return;
 }
+
+#if defined(ENABLE_RUNTIME_TESTS)
+
+static void __constructor test_log_verbosity(void)
+{
+    unsigned char saved[LOG_MODULE_MAX];
+
+    memcpy(saved, log_verbosity, sizeof saved);
+
+    assert(log_set_verbosity("warning") == true);
+    assert(log_verbosity[LOG_MODULE_POLICY] == LOG_LEVEL_WARNING);
+    assert(log_verbosity[LOG_MODULE_CORE] == LOG_LEVEL_WARNING);
+
+    assert(log_set_verbosity("error,policy:debug, netscape:message") == true);
+    assert(log_verbosity[LOG_MODULE_POLICY] == LOG_LEVEL_DEBUG);
+    assert(log_verbosity[LOG_MODULE_NETSCAPE] == LOG_LEVEL_MESSAGE);
+    assert(log_verbosity[LOG_MODULE_CONFIG] == LOG_LEVEL_ERROR);
+
+    assert(log_set_verbosity("none,bogus:debug,policy:loud") == false);
+    assert(log_verbosity[LOG_MODULE_POLICY] == LOG_LEVEL_NONE);
+
+    assert(log_set_verbosity(NULL) == true);
+
+    memcpy(log_verbosity, saved, sizeof saved);
+}
+
+static void __constructor test_log_ratelimit(void)
+{
+    struct log_site site = {0};
+    unsigned admitted;
+    unsigned i;
+
+    for (admitted = i = 0; i < 100; i++) {
+        admitted += log_site_admit(&site, __FUNCTION__);
+    }
+
+    assert(admitted == (unsigned) kLogSiteBurst);
+    assert(site.suppressed == (uint32_t) (100 - kLogSiteBurst));
+
+    // Pretend the interval expired, the summary should be printed and the
+    // bucket refilled.
+    site.stamp -= kLogSiteInterval;
+
+    assert(log_site_admit(&site, __FUNCTION__) == true);
+    assert(site.suppressed == 0);
+    assert(site.tokens == kLogSiteBurst - 1);
+}
+
+#endif
@@ -1,24 +1,93 @@
 #ifndef __LOG_H
 #define __LOG_H
 
-#ifdef NDEBUG
-# define l_debug(format...)
-#else
-# define l_debug(format...) do {                \
-         l_debug_(__FUNCTION__, ## format);     \
-     } while (false)
+#include <stdbool.h>
+#include <stdint.h>
+
+// Verbosity levels, a message is printed if the verbosity of the module it
+// originates from is at least its level.
+enum {
+    LOG_LEVEL_NONE,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_MESSAGE,
+    LOG_LEVEL_DEBUG,
+};
+
+// Each source file can select the module it logs as by defining LOG_MODULE
+// before including this header.
+enum {
+    LOG_MODULE_CORE,
+    LOG_MODULE_AUDIT,
+    LOG_MODULE_CONFIG,
+    LOG_MODULE_EXPORT,
+    LOG_MODULE_INSTANCE,
+    LOG_MODULE_MEMORY,
+    LOG_MODULE_NETSCAPE,
+    LOG_MODULE_PLATFORM,
+    LOG_MODULE_POLICY,
+    LOG_MODULE_SHIM,
+    LOG_MODULE_STATS,
+    LOG_MODULE_UTIL,
+    LOG_MODULE_WATCHDOG,
+    LOG_MODULE_MAX,
+};
+
+#ifndef LOG_MODULE
+# define LOG_MODULE LOG_MODULE_CORE
 #endif
 
+// The environment variable that overrides the LogLevel directive.
+#define NSSECURITY_LOG_ENV      "NSSECURITY_LOG"
+
+// The current verbosity of every module. This is checked before formatting
+// anything, so a disabled level costs a load and a compare.
+extern unsigned char log_verbosity[LOG_MODULE_MAX];
+
+#define l_enabled(level)                                        \
+    __builtin_expect(log_verbosity[LOG_MODULE] >= (level), 0)
+
+#define l_debug(format...) do {                 \
+        if (l_enabled(LOG_LEVEL_DEBUG))         \
+            l_debug_(__FUNCTION__, ## format);  \
+    } while (false)
+
 #define l_message(format...) do {               \
-        l_message_(__FUNCTION__, ## format);    \
+        if (l_enabled(LOG_LEVEL_MESSAGE))       \
+            l_message_(__FUNCTION__, ## format);\
     } while (false)
 
 #define l_warning(format...) do {               \
-        l_warning_(__FUNCTION__, ## format);    \
+        if (l_enabled(LOG_LEVEL_WARNING))       \
+            l_warning_(__FUNCTION__, ## format);\
     } while (false)
 
 #define l_error(format...) do {                 \
-        l_error_(__FUNCTION__, ## format);      \
+        if (l_enabled(LOG_LEVEL_ERROR))         \
+            l_error_(__FUNCTION__, ## format);  \
+    } while (false)
+
+// Rate limited variants for messages that can be triggered by untrusted pages.
+// Each call site has its own token bucket, once exhausted messages are
+// counted instead of printed, and a summary is printed when it refills.
+struct log_site {
+    uint64_t    stamp;
+    int32_t     tokens;
+    uint32_t    suppressed;
+};
+
+#define l_warning_ratelimited(format...) do {                           \
+        static struct log_site log_site_;                               \
+        if (l_enabled(LOG_LEVEL_WARNING)                                \
+                && log_site_admit(&log_site_, __FUNCTION__))            \
+            l_warning_(__FUNCTION__, ## format);                        \
+    } while (false)
+
+#define l_debug_ratelimited(format...) do {                             \
+        static struct log_site log_site_;                               \
+        if (l_enabled(LOG_LEVEL_DEBUG)                                  \
+                && log_site_admit(&log_site_, __FUNCTION__))            \
+            l_debug_(__FUNCTION__, ## format);                          \
     } while (false)
 
 void l_message_(const char *function, const char *format, ...);
@@ -26,4 +95,7 @@ void l_debug_(const char *function, const char *format, ...);
 void l_warning_(const char *function, const char *format, ...);
 void l_error_(const char *function, const char *format, ...);
 
+bool log_set_verbosity(const char *spec);
+bool log_site_admit(struct log_site *site, const char *function);
+
 #endif
@@ -0,0 +1,541 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Author: taviso@google.com
+//
+// Batched delivery of log messages to syslog or journald.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#define LOG_MODULE LOG_MODULE_CORE
+#define _GNU_SOURCE     // sendmmsg()
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+
+#include "npapi.h"
+#include "npfunctions.h"
+#include "config.h"
+#include "log.h"
+#include "logsink.h"
+#include "histogram.h"
+#include "shim.h"
+#include "stats.h"
+
+// Administrators want our messages in the system log rather than on whatever
+// stderr the browser was started with. Sending a datagram per message from
+// the browser thread would make a burst of policy denials very expensive, so
+// instead messages are formatted into a queue, and a background thread
+// delivers them in batches.
+//
+// If the socket is unavailable (syslog is restarting, or not running), the
+// thread backs off and retries, messages accumulate in the queue and are
+// discarded when it's full. Discarded messages are counted in the statistics.
+
+// Maximum length of a single message, longer messages are truncated.
+#define kLogRecordMax   480
+
+// Number of messages the queue can hold, must be a power of two.
+#define kLogQueueSize   256
+
+// Maximum number of messages sent in a single batch.
+#define kLogBatchSize   32
+
+// Bounds of the exponential backoff used when the socket is unavailable, in
+// milliseconds.
+static const unsigned kLogBackoffMin = 100;
+static const unsigned kLogBackoffMax = 30000;
+
+struct log_record {
+    uint16_t    level;
+    uint16_t    length;
+    char        message[kLogRecordMax];
+};
+
+// Syslog severities for each level.
+static const int kSyslogPriority[] = {
+    [LOG_LEVEL_NONE]    = 7,
+    [LOG_LEVEL_ERROR]   = 3,
+    [LOG_LEVEL_WARNING] = 4,
+    [LOG_LEVEL_MESSAGE] = 6,
+    [LOG_LEVEL_DEBUG]   = 7,
+};
+
+// The user facility, as in syslog.h.
+static const int kSyslogFacility = 1 << 3;
+
+static struct log_record *logsink_queue;
+static uint32_t           logsink_head;
+static uint32_t           logsink_tail;
+static unsigned           logsink_target;
+static char              *logsink_path;
+static bool               logsink_stopping;
+static bool               logsink_running;
+static pthread_t          logsink_thread;
+static pthread_mutex_t    logsink_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t     logsink_cond  = PTHREAD_COND_INITIALIZER;
+
+static void *logsink_worker(void *param);
+
+// Select the target by name, as used in the LogTarget directive.
+bool logsink_set_target(const char *target)
+{
+    if (strcasecmp(target, "stderr") == 0) {
+        logsink_close();
+        return true;
+    } else if (strcasecmp(target, "syslog") == 0) {
+        return logsink_open(LOG_TARGET_SYSLOG, LOGSINK_SYSLOG_PATH);
+    } else if (strcasecmp(target, "journald") == 0) {
+        return logsink_open(LOG_TARGET_JOURNALD, LOGSINK_JOURNALD_PATH);
+    }
+
+    l_warning("unrecognised log target %s", target);
+    return false;
+}
+
+bool logsink_enabled(void)
+{
+    return __atomic_load_n(&logsink_queue, __ATOMIC_ACQUIRE) != NULL;
+}
+
+// The worker thread doesn't exist in a child, and the queue may have been
+// locked by a thread that doesn't either. Anything already queued will be
+// delivered by the parent, so the child starts with an empty queue and a
+// worker of its own.
+static void logsink_atfork_child(void)
+{
+    pthread_mutex_init(&logsink_mutex, NULL);
+    pthread_cond_init(&logsink_cond, NULL);
+
+    if (!logsink_running) {
+        return;
+    }
+
+    logsink_head     = logsink_tail;
+    logsink_stopping = false;
+
+    // If that isn't possible, go back to stderr. The queue is leaked, but
+    // there's no thread for logsink_close() to wait for.
+    if (pthread_create(&logsink_thread, NULL, logsink_worker, NULL) != 0) {
+        __atomic_store_n(&logsink_queue, NULL, __ATOMIC_RELEASE);
+        logsink_running = false;
+    }
+}
+
+// Start delivering messages to the datagram socket at path. The socket does
+// not need to exist yet.
+bool logsink_open(unsigned target, const char *path)
+{
+    static bool registered;
+
+    // Replace any existing sink.
+    logsink_close();
+
+    if (!registered) {
+        pthread_atfork(NULL, NULL, logsink_atfork_child);
+        registered = true;
+    }
+
+    if (!(logsink_path = strdup(path))) {
+        return false;
+    }
+
+    if (!(logsink_queue = calloc(kLogQueueSize, sizeof *logsink_queue))) {
+        free(logsink_path);
+        logsink_path = NULL;
+        return false;
+    }
+
+    logsink_target   = target;
+    logsink_head     = 0;
+    logsink_tail     = 0;
+    logsink_stopping = false;
+
+    if (pthread_create(&logsink_thread, NULL, logsink_worker, NULL) != 0) {
+        free(logsink_queue);
+        free(logsink_path);
+        logsink_queue = NULL;
+        logsink_path  = NULL;
+        return false;
+    }
+
+    logsink_running = true;
+    return true;
+}
+
+// Stop the background thread, giving it a chance to deliver anything still
+// queued, and return to logging on stderr.
+void logsink_close(void)
+{
+    struct log_record *queue;
+
+    if (!logsink_running) {
+        return;
+    }
+
+    pthread_mutex_lock(&logsink_mutex);
+        logsink_stopping = true;
+        pthread_cond_signal(&logsink_cond);
+    pthread_mutex_unlock(&logsink_mutex);
+
+    pthread_join(logsink_thread, NULL);
+
+    pthread_mutex_lock(&logsink_mutex);
+        queue           = logsink_queue;
+        logsink_queue   = NULL;
+        logsink_running = false;
+    pthread_mutex_unlock(&logsink_mutex);
+
+    free(queue);
+    free(logsink_path);
+    logsink_path = NULL;
+}
+
+// Format a message into the queue. This is called on the browser thread, so
+// it only formats and copies, the background thread does everything else.
+void logsink_vqueue(unsigned level,
+                    const char *function,
+                    const char *format,
+                    va_list ap)
+{
+    struct log_record *record;
+    int                length;
+    int                prefix;
+
+    pthread_mutex_lock(&logsink_mutex);
+
+    // Check there's room, if not the message is discarded.
+    if (!logsink_queue || logsink_tail - logsink_head >= kLogQueueSize) {
+        stats_inc(global_stats->log_dropped);
+        pthread_mutex_unlock(&logsink_mutex);
+        return;
+    }
+
+    record = &logsink_queue[logsink_tail % kLogQueueSize];
+    prefix = snprintf(record->message, kLogRecordMax, "%s(): ", function);
+    length = vsnprintf(record->message + prefix,
+                       kLogRecordMax - prefix,
+                       format,
+                       ap);
+
+    // Check if the message was truncated.
+    if (length < 0 || prefix + length >= kLogRecordMax) {
+        length = kLogRecordMax - prefix - 1;
+    }
+
+    record->level  = level;
+    record->length = prefix + length;
+
+    // Only wake the thread if it might be waiting for work.
+    if (logsink_tail++ == logsink_head) {
+        pthread_cond_signal(&logsink_cond);
+    }
+
+    pthread_mutex_unlock(&logsink_mutex);
+}
+
+// Connect to the configured socket, returns a file descriptor or -1.
+static int logsink_connect(void)
+{
+    struct sockaddr_un address = {
+        .sun_family = AF_UNIX,
+    };
+    int fd;
+
+    if (strlen(logsink_path) >= sizeof address.sun_path) {
+        return -1;
+    }
+
+    strcpy(address.sun_path, logsink_path);
+
+    if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *) &address, sizeof address) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Produce the datagram for a record in the format required by the target.
+static size_t logsink_encode(const struct log_record *record,
+                             char *buffer,
+                             size_t size)
+{
+    char   message[kLogRecordMax];
+    int    length;
+    size_t i;
+
+    // Neither format permits newlines in the message.
+    memcpy(message, record->message, record->length);
+    message[record->length] = '\0';
+
+    for (i = 0; i < record->length; i++) {
+        if (message[i] == '\n') {
+            message[i] = ' ';
+        }
+    }
+
+    if (logsink_target == LOG_TARGET_JOURNALD) {
+        length = snprintf(buffer, size,
+                          "PRIORITY=%d\n"
+                          "SYSLOG_IDENTIFIER=%s\n"
+                          "MESSAGE=%s\n",
+                          kSyslogPriority[record->level],
+                          NSSECURITY_TAG,
+                          message);
+    } else {
+        length = snprintf(buffer, size,
+                          "<%d>%s[%d]: %s",
+                          kSyslogFacility | kSyslogPriority[record->level],
+                          NSSECURITY_TAG,
+                          getpid(),
+                          message);
+    }
+
+    return length < 0 ? 0 : (size_t) length < size ? (size_t) length : size - 1;
+}
+
+// Send a batch of records, returns false if the socket failed.
+static bool logsink_send(int fd, struct log_record *batch, unsigned count)
+{
+    static char   buffers[kLogBatchSize][kLogRecordMax + 64];
+    struct iovec  iov[kLogBatchSize];
+    unsigned      i;
+
+    for (i = 0; i < count; i++) {
+        iov[i].iov_base = buffers[i];
+        iov[i].iov_len  = logsink_encode(&batch[i],
+                                         buffers[i],
+                                         sizeof buffers[i]);
+    }
+
+#if defined(__linux__)
+    {
+        struct mmsghdr messages[kLogBatchSize];
+        int            sent;
+
+        memset(messages, 0, sizeof messages);
+
+        for (i = 0; i < count; i++) {
+            messages[i].msg_hdr.msg_iov    = &iov[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        // Deliver the whole batch with one system call.
+        for (i = 0; i < count; i += sent) {
+            if ((sent = sendmmsg(fd, &messages[i], count - i, 0)) <= 0) {
+                return errno == EINTR;
+            }
+        }
+    }
+#else
+    for (i = 0; i < count; i++) {
+        if (send(fd, iov[i].iov_base, iov[i].iov_len, 0) < 0) {
+            return false;
+        }
+    }
+#endif
+
+    return true;
+}
+
+static void *logsink_worker(void *param __unused)
+{
+    struct log_record  batch[kLogBatchSize];
+    struct timespec    deadline;
+    unsigned           backoff;
+    unsigned           count;
+    int                fd;
+
+    fd      = -1;
+    backoff = kLogBackoffMin;
+
+    pthread_mutex_lock(&logsink_mutex);
+
+    while (true) {
+        // Wait for some work.
+        while (!logsink_stopping && logsink_head == logsink_tail) {
+            pthread_cond_wait(&logsink_cond, &logsink_mutex);
+        }
+
+        // If we're stopping and there's nothing left, we're finished.
+        if (logsink_head == logsink_tail) {
+            break;
+        }
+
+        // Make sure we have a socket, otherwise back off and try again later.
+        if (fd < 0) {
+            pthread_mutex_unlock(&logsink_mutex);
+                fd = logsink_connect();
+            pthread_mutex_lock(&logsink_mutex);
+
+            if (fd < 0) {
+                // Don't wait around if we've been asked to stop, just discard
+                // what's left.
+                if (logsink_stopping) {
+                    stats_add(global_stats->log_dropped,
+                              logsink_tail - logsink_head);
+                    logsink_head     = logsink_tail;
+                    break;
+                }
+
+                clock_gettime(CLOCK_REALTIME, &deadline);
+
+                deadline.tv_sec  += backoff / 1000;
+                deadline.tv_nsec += (backoff % 1000) * 1000000;
+
+                if (deadline.tv_nsec >= 1000000000) {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000;
+                }
+
+                pthread_cond_timedwait(&logsink_cond, &logsink_mutex, &deadline);
+
+                backoff = backoff * 2 > kLogBackoffMax ? kLogBackoffMax
+                                                       : backoff * 2;
+                continue;
+            }
+
+            backoff = kLogBackoffMin;
+        }
+
+        // Take a batch from the queue.
+        for (count = 0; count < kLogBatchSize && logsink_head != logsink_tail; count++) {
+            batch[count] = logsink_queue[logsink_head++ % kLogQueueSize];
+        }
+
+        // Deliver it without holding the lock.
+        pthread_mutex_unlock(&logsink_mutex);
+
+        if (!logsink_send(fd, batch, count)) {
+            close(fd);
+            fd = -1;
+
+            stats_add(global_stats->log_dropped, count);
+        }
+
+        pthread_mutex_lock(&logsink_mutex);
+    }
+
+    pthread_mutex_unlock(&logsink_mutex);
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return NULL;
+}
+
+static void __destructor fini_logsink(void)
+{
+    logsink_close();
+}
+
+#if defined(ENABLE_RUNTIME_TESTS)
+
+static void __constructor test_logsink(void)
+{
+    struct sockaddr_un address = {
+        .sun_family = AF_UNIX,
+    };
+    char buffer[1024];
+    struct timeval timeout = { 5, 0 };
+    unsigned char saved[LOG_MODULE_MAX];
+    char name[64];
+    ssize_t length;
+    unsigned i;
+    pid_t child;
+    int status;
+    int fd;
+
+    memcpy(saved, log_verbosity, sizeof saved);
+    log_set_verbosity("message");
+
+    snprintf(address.sun_path, sizeof address.sun_path,
+             "/tmp/nssecurity-logsink-test-%d", getpid());
+    unlink(address.sun_path);
+
+    // Start the sink before the socket exists, to test the backoff.
+    assert(logsink_open(LOG_TARGET_SYSLOG, address.sun_path) == true);
+
+    l_message("test message %d", 1);
+    l_debug("this should not be delivered");
+
+    // Now create our stand-in for syslog.
+    assert((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) >= 0);
+    assert(bind(fd, (struct sockaddr *) &address, sizeof address) == 0);
+    assert(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout) == 0);
+
+    for (i = 2; i <= 8; i++) {
+        l_warning("test message %u", i);
+    }
+
+    for (i = 1; i <= 8; i++) {
+        assert((length = recv(fd, buffer, sizeof buffer - 1, 0)) > 0);
+        buffer[length] = '\0';
+        assert(strstr(buffer, "nssecurity[") != NULL);
+        assert(strstr(buffer, "test_logsink(): test message") != NULL);
+    }
+
+    assert(strncmp(buffer, "<12>", 4) == 0);
+
+    // A child forked while the queue is locked gets a worker of its own.
+    pthread_mutex_lock(&logsink_mutex);
+        if ((child = fork()) == 0) {
+            l_warning("test message from child");
+            logsink_close();
+            _exit(0);
+        }
+    pthread_mutex_unlock(&logsink_mutex);
+
+    assert(waitpid(child, &status, 0) == child);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    snprintf(name, sizeof name, "/%s%u", STATS_PREFIX, (unsigned) child);
+    shm_unlink(name);
+
+    assert((length = recv(fd, buffer, sizeof buffer - 1, 0)) > 0);
+    buffer[length] = '\0';
+    snprintf(name, sizeof name, "nssecurity[%u]: ", (unsigned) child);
+    assert(strstr(buffer, name) != NULL);
+    assert(strstr(buffer, "test message from child") != NULL);
+
+    logsink_close();
+
+    assert(logsink_enabled() == false);
+
+    close(fd);
+    unlink(address.sun_path);
+    memcpy(log_verbosity, saved, sizeof saved);
+}
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef __LOGSINK_H
+#define __LOGSINK_H
+
+enum {
+    LOG_TARGET_STDERR,
+    LOG_TARGET_SYSLOG,
+    LOG_TARGET_JOURNALD,
+};
+
+#define LOGSINK_SYSLOG_PATH     "/dev/log"
+#define LOGSINK_JOURNALD_PATH   "/run/systemd/journal/socket"
+
+bool logsink_set_target(const char *target);
+bool logsink_open(unsigned target, const char *path);
+bool logsink_enabled(void);
+void logsink_close(void);
+void logsink_vqueue(unsigned level,
+                    const char *function,
+                    const char *format,
+                    va_list ap);
+
+#endif
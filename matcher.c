@@ -0,0 +1,371 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Author: taviso@google.com
+//
+// Generate and load compiled domain matchers.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#define LOG_MODULE LOG_MODULE_POLICY
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fnmatch.h>
+#include <assert.h>
+
+#include "npapi.h"
+#include "npfunctions.h"
+#include "config.h"
+#include "platform.h"
+#include "policy.h"
+#include "log.h"
+#include "matcher.h"
+
+// The AllowedDomains globs are interpreted with fnmatch() for every page, but
+// most of them are one of two simple forms, an exact hostname or *.suffix.
+// For large policies, nssecurity-compile -c can generate C that tests those
+// directly, which is compiled into a module named by PolicyModule=.
+//
+// The generated matcher switches on the length of the hostname for exact
+// names, compares the tail for *.suffix, and calls fnmatch() for anything
+// else, so it always makes exactly the same decision as the globs.
+
+// Binds a module to the policy it was generated from, the section names and
+// domains of every plugin, in order.
+uint64_t matcher_checksum(const struct registry *registry)
+{
+    const struct plugin *current;
+    const char          *string;
+    uint64_t             hash = 0xcbf29ce484222325ULL;
+    uint32_t             i;
+
+    for (current = registry->plugins; current; current = current->next) {
+        for (i = 0; i <= current->policy.domain_count; i++) {
+            string = i ? current->policy.domains[i - 1] : current->section;
+
+            // Include the nul, so that the boundaries are part of the hash.
+            do {
+                hash ^= (unsigned char) *string;
+                hash *= 0x100000001b3ULL;
+            } while (*string++);
+        }
+
+        hash ^= 0xff;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+// Write string as a C string literal.
+static void matcher_literal(FILE *output, const char *string, size_t length)
+{
+    size_t i;
+
+    fputc('"', output);
+
+    for (i = 0; i < length; i++) {
+        unsigned char c = string[i];
+
+        if (c == '"' || c == '\\') {
+            fprintf(output, "\\%c", c);
+        } else if (c < 0x20 || c >= 0x7f || c == '?') {
+            // Octal, so that trigraphs can't appear.
+            fprintf(output, "\\%03o", c);
+        } else {
+            fputc(c, output);
+        }
+    }
+
+    fputc('"', output);
+}
+
+// Generate the matcher for one plugin.
+static void matcher_function(FILE *output, const struct plugin *plugin, unsigned index)
+{
+    const char *domain;
+    size_t      length;
+    size_t      longest = 0;
+    size_t      size;
+    uint32_t    i;
+
+    fprintf(output, "\n// [%s]\n", plugin->section);
+    fprintf(output, "static bool match_%u(const char *h, size_t n)\n{\n", index);
+
+    // Exact hostnames, grouped by length.
+    for (i = 0; i < plugin->policy.domain_count; i++) {
+        domain = plugin->policy.domains[i];
+
+        if (strpbrk(domain, "*?[") == NULL && strlen(domain) > longest)
+            longest = strlen(domain);
+    }
+
+    if (longest) {
+        fprintf(output, "    switch (n) {\n");
+
+        for (size = 1; size <= longest; size++) {
+            bool found = false;
+
+            for (i = 0; i < plugin->policy.domain_count; i++) {
+                domain = plugin->policy.domains[i];
+
+                if (strpbrk(domain, "*?[") || strlen(domain) != size)
+                    continue;
+
+                if (!found)
+                    fprintf(output, "        case %zu:\n", size);
+
+                fprintf(output, "            if (memcmp(h, ");
+                matcher_literal(output, domain, size);
+                fprintf(output, ", %zu) == 0) return true;\n", size);
+
+                found = true;
+            }
+
+            if (found)
+                fprintf(output, "            break;\n");
+        }
+
+        fprintf(output, "    }\n");
+    }
+
+    for (i = 0; i < plugin->policy.domain_count; i++) {
+        domain = plugin->policy.domains[i];
+
+        // Exact hostnames were handled above.
+        if (strpbrk(domain, "*?[") == NULL)
+            continue;
+
+        // A leading * followed by a literal suffix, including * alone.
+        if (domain[0] == '*' && strpbrk(domain + 1, "*?[") == NULL) {
+            length = strlen(domain + 1);
+
+            fprintf(output, "    if (n >= %zu && memcmp(h + n - %zu, ", length, length);
+            matcher_literal(output, domain + 1, length);
+            fprintf(output, ", %zu) == 0) return true;\n", length);
+            continue;
+        }
+
+        // Anything else is left to fnmatch(), as in policy.c.
+        fprintf(output, "    if (fnmatch(");
+        matcher_literal(output, domain, strlen(domain));
+        fprintf(output, ", h, FNM_NOESCAPE) == 0) return true;\n");
+    }
+
+    fprintf(output, "    return false;\n}\n");
+}
+
+// Write the source of a matcher module for the policy in registry, it can be
+// built with cc -shared -fPIC -O2.
+bool matcher_generate(const struct registry *registry, FILE *output)
+{
+    const struct plugin *current;
+    unsigned             count;
+    unsigned             i;
+
+    fprintf(output,
+            "// Generated by nssecurity-compile, do not edit.\n"
+            "#include <stdbool.h>\n"
+            "#include <stddef.h>\n"
+            "#include <stdint.h>\n"
+            "#include <string.h>\n"
+            "#include <fnmatch.h>\n"
+            "\n"
+            "struct matcher_module {\n"
+            "    uint32_t        version;\n"
+            "    uint32_t        count;\n"
+            "    uint64_t        checksum;\n"
+            "    const char     *const *sections;\n"
+            "    bool          (*const *matchers)(const char *hostname, size_t length);\n"
+            "};\n");
+
+    for (current = registry->plugins, count = 0; current; current = current->next) {
+        matcher_function(output, current, count++);
+    }
+
+    fprintf(output, "\nstatic const char *const sections[] = {\n");
+
+    for (current = registry->plugins; current; current = current->next) {
+        fprintf(output, "    ");
+        matcher_literal(output, current->section, strlen(current->section));
+        fprintf(output, ",\n");
+    }
+
+    fprintf(output, "    NULL,\n};\n");
+    fprintf(output, "\nstatic bool (*const matchers[])(const char *, size_t) = {\n");
+
+    for (i = 0; i < count; i++) {
+        fprintf(output, "    match_%u,\n", i);
+    }
+
+    fprintf(output, "    NULL,\n};\n");
+    fprintf(output,
+            "\n__attribute__((visibility(\"default\")))\n"
+            "const struct matcher_module %s = {\n"
+            "    .version   = %u,\n"
+            "    .count     = %u,\n"
+            "    .checksum  = 0x%016llxULL,\n"
+            "    .sections  = sections,\n"
+            "    .matchers  = matchers,\n"
+            "};\n",
+            MATCHER_SYMBOL,
+            MATCHER_VERSION,
+            count,
+            (unsigned long long) matcher_checksum(registry));
+
+    return !ferror(output);
+}
+
+// Load the module at path, and attach a matcher to every plugin with domains.
+bool matcher_load(struct registry *registry, const char *path)
+{
+    const struct matcher_module *module;
+    struct plugin               *current;
+    uint32_t                     i;
+
+    if (!(registry->matcher_handle = platform_dlopen(path))) {
+        l_warning("failed to load policy module %s", path);
+        return false;
+    }
+
+    if (!(module = platform_dlsym(registry->matcher_handle, MATCHER_SYMBOL))
+            || module->version != MATCHER_VERSION) {
+        l_warning("%s is not a policy module for this version", path);
+        goto failure;
+    }
+
+    if (module->checksum != matcher_checksum(registry)) {
+        l_warning("policy module %s was generated from a different policy, ignoring", path);
+        goto failure;
+    }
+
+    // The checksum covers the section names in order, so they line up.
+    for (current = registry->plugins, i = 0; current; current = current->next, i++) {
+        if (i >= module->count || strcmp(module->sections[i], current->section) != 0) {
+            l_warning("policy module %s does not match section %s", path, current->section);
+            goto failure;
+        }
+    }
+
+    for (current = registry->plugins, i = 0; current; current = current->next, i++) {
+        if (current->policy.domain_count)
+            current->policy.matcher = module->matchers[i];
+    }
+
+    l_debug("using compiled matchers from %s for %u sections", path, i);
+
+    return true;
+
+  failure:
+    platform_dlclose(registry->matcher_handle);
+    registry->matcher_handle = NULL;
+    return false;
+}
+
+#if defined(ENABLE_RUNTIME_TESTS)
+
+// Compare the generated matchers with fnmatch(), if there's a compiler.
+static void __constructor test_matcher(void)
+{
+    static const char *kSections[][2] = {
+        { "Wildcard",   "*.google.com,google.com,*.safe.com" },
+        { "Mixed",      "www.foo.com,,www.bar.com,a?c.example.com,[ab]*.test.org" },
+        { "Anything",   "*" },
+        { "Suffix",     "*com,x.y" },
+        { "Nothing",    "" },
+    };
+    static const char *kHosts[] = {
+        "google.com", "www.google.com", "google.com.evil.com", "xgoogle.com",
+        "safe.com", "x.safe.com", "www.foo.com", "www.foo.co", "ww.foo.com",
+        "www.bar.com", "abc.example.com", "a.c.example.com", "ac.example.com",
+        "b1.test.org", "c1.test.org", "a.test.org", "com", "xcom", "x.y",
+        "evil.com", "a",
+    };
+    struct registry test = {0};
+    struct registry other = {0};
+    struct plugin  *plugin;
+    bool            expected[5][sizeof kHosts / sizeof *kHosts];
+    char            path[64] = "/tmp/nssecurity-matcher-test-XXXXXX";
+    char            command[256];
+    char            url[128];
+    FILE           *output;
+    unsigned        i;
+    unsigned        j;
+    int             fd;
+
+    for (i = 0; i < 5; i++) {
+        assert(config_set(&test, kSections[i][0], "AllowedDomains", kSections[i][1]) == true);
+    }
+
+    for (plugin = test.plugins; plugin; plugin = plugin->next) {
+        policy_compile(test.arena, plugin, NULL);
+    }
+
+    // What fnmatch() decides.
+    for (plugin = test.plugins, i = 0; plugin; plugin = plugin->next, i++) {
+        for (j = 0; j < sizeof kHosts / sizeof *kHosts; j++) {
+            snprintf(url, sizeof url, "https://%s/", kHosts[j]);
+            expected[i][j] = policy_plugin_allowed_domain(plugin, url);
+        }
+    }
+
+    assert((fd = mkstemp(path)) >= 0);
+    assert((output = fdopen(fd, "w")));
+    assert(matcher_generate(&test, output) == true);
+    assert(fclose(output) == 0);
+
+    snprintf(command, sizeof command,
+             "cc -x c -shared -fPIC -O2 -o %s.so %s >/dev/null 2>&1",
+             path,
+             path);
+
+    if (system(command) != 0) {
+        l_debug("no compiler available, skipping matcher test");
+        goto cleanup;
+    }
+
+    strcat(path, ".so");
+
+    assert(matcher_load(&test, path) == true);
+
+    for (plugin = test.plugins, i = 0; plugin; plugin = plugin->next, i++) {
+        assert(!!plugin->policy.matcher == !!plugin->policy.domain_count);
+
+        for (j = 0; j < sizeof kHosts / sizeof *kHosts; j++) {
+            snprintf(url, sizeof url, "https://%s/", kHosts[j]);
+            assert(policy_plugin_allowed_domain(plugin, url) == expected[i][j]);
+        }
+    }
+
+    // A module is only used with the policy it was generated from.
+    assert(config_set(&other, "Wildcard", "AllowedDomains", "*.google.com") == true);
+    policy_compile(other.arena, other.plugins, NULL);
+    assert(matcher_load(&other, path) == false);
+    assert(other.plugins->policy.matcher == NULL);
+
+    unlink(path);
+
+    path[strlen(path) - 3] = '\0';
+
+  cleanup:
+    unlink(path);
+    config_destroy(&other);
+    config_destroy(&test);
+}
+
+#endif
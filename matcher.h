@@ -0,0 +1,23 @@
+#ifndef __MATCHER_H
+#define __MATCHER_H
+
+// A module generated by nssecurity-compile -c, containing a compiled domain
+// matcher for each plugin section. It's only used if the checksum matches
+// the policy it was generated from. The generated source repeats this
+// definition, so change MATCHER_VERSION if it changes.
+#define MATCHER_VERSION     1
+#define MATCHER_SYMBOL      "nssecurity_matcher"
+
+struct matcher_module {
+    uint32_t        version;
+    uint32_t        count;
+    uint64_t        checksum;
+    const char     *const *sections;
+    bool          (*const *matchers)(const char *hostname, size_t length);
+};
+
+uint64_t matcher_checksum(const struct registry *registry);
+bool matcher_generate(const struct registry *registry, FILE *output);
+bool matcher_load(struct registry *registry, const char *path);
+
+#endif
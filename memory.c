@@ -0,0 +1,392 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Author: taviso@google.com
+//
+// Per-plugin memory accounting.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#define LOG_MODULE LOG_MODULE_MEMORY
+#define _GNU_SOURCE     // dladdr()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <malloc.h>
+#include <dlfcn.h>
+
+#include "npapi.h"
+#include "npfunctions.h"
+#include "config.h"
+#include "log.h"
+#include "histogram.h"
+#include "shim.h"
+#include "stats.h"
+#include "platform.h"
+#include "memory.h"
+
+// When a plugin is loaded, we rewrite the GOT slots it uses to reach the heap
+// functions, so that every allocation made directly by the plugin module goes
+// through the hooks below. The hooks find the module that called them from
+// the return address, and update the live and peak heap counters in its
+// statistics. The size of the mapped module is recorded too, so
+// nssecurity-stat can show the total footprint of each plugin.
+//
+// The accounting is approximate, memory allocated by libraries the plugin
+// depends on is not attributed to it, and memory released by a different
+// module than allocated it is credited to the module that released it. That
+// means heap_live can even go negative for a plugin that frees memory
+// allocated by the browser or a library, but it reliably shows plugins that
+// leak or balloon.
+//
+// The hooks are a few compares and three relaxed atomic additions, which is
+// cheap enough to leave enabled.
+
+// The real heap functions. A call to malloc() from the hooks would go through
+// our own GOT, which the runtime tests patch, and the hooks would recurse. So
+// these are looked up with dlsym() before anything is patched, which finds
+// the same definition the dynamic linker would, including any preloaded
+// allocator, without going through the GOT.
+static void *(*memory_real_malloc)(size_t);
+static void *(*memory_real_calloc)(size_t, size_t);
+static void *(*memory_real_realloc)(void *, size_t);
+static void  (*memory_real_free)(void *);
+static char *(*memory_real_strdup)(const char *);
+static char *(*memory_real_strndup)(const char *, size_t);
+
+struct memory_module {
+    uintptr_t            start;
+    uintptr_t            end;
+    void                *handle;
+    unsigned             references;    // records sharing it, see reload.c.
+    struct stats_plugin *stats;
+    void                *originals[MEMORY_MAX];
+};
+
+// Modules are only ever appended, and the count published after the entry is
+// complete, so the hooks can search the table without locking.
+static struct memory_module memory_modules[STATS_MAX_PLUGINS];
+static unsigned memory_module_count;
+
+const char *kMemoryImports[MEMORY_MAX] = {
+    [MEMORY_MALLOC]     = "malloc",
+    [MEMORY_CALLOC]     = "calloc",
+    [MEMORY_REALLOC]    = "realloc",
+    [MEMORY_FREE]       = "free",
+    [MEMORY_STRDUP]     = "strdup",
+    [MEMORY_STRNDUP]    = "strndup",
+};
+
+// Find the statistics for the module containing the caller.
+static struct stats_plugin *memory_caller(uintptr_t caller)
+{
+    unsigned count = __atomic_load_n(&memory_module_count, __ATOMIC_ACQUIRE);
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+        if (caller >= memory_modules[i].start && caller < memory_modules[i].end)
+            return memory_modules[i].stats;
+    }
+
+    return NULL;
+}
+
+// Adjust the live heap of the calling module, and the peak if necessary.
+static void memory_account(uintptr_t caller, int64_t delta, bool allocation)
+{
+    struct stats_plugin *stats = memory_caller(caller);
+    int64_t              live;
+    uint64_t             peak;
+
+    if (__builtin_expect(!stats, 0))
+        return;
+
+    if (allocation)
+        stats_inc(stats->heap_allocations);
+
+    live = stats_add(stats->heap_live, delta);
+    peak = __atomic_load_n(&stats->heap_peak, __ATOMIC_RELAXED);
+
+    while (live > 0 && (uint64_t) live > peak) {
+        if (__atomic_compare_exchange_n(&stats->heap_peak,
+                                        &peak,
+                                        live,
+                                        true,
+                                        __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+}
+
+#define memory_caller_address() ((uintptr_t) __builtin_return_address(0))
+
+static void *memory_malloc(size_t size)
+{
+    void *result = memory_real_malloc(size);
+
+    if (result)
+        memory_account(memory_caller_address(), malloc_usable_size(result), true);
+
+    return result;
+}
+
+static void *memory_calloc(size_t nmemb, size_t size)
+{
+    void *result = memory_real_calloc(nmemb, size);
+
+    if (result)
+        memory_account(memory_caller_address(), malloc_usable_size(result), true);
+
+    return result;
+}
+
+static void *memory_realloc(void *ptr, size_t size)
+{
+    int64_t  previous = ptr ? malloc_usable_size(ptr) : 0;
+    void    *result   = memory_real_realloc(ptr, size);
+
+    // The size of ptr must be read first, it's not valid after a move. Any
+    // successful realloc counts as an allocation, as it may have moved.
+    if (result) {
+        memory_account(memory_caller_address(),
+                       (int64_t) malloc_usable_size(result) - previous,
+                       true);
+    } else if (size == 0) {
+        memory_account(memory_caller_address(), -previous, false);
+    }
+
+    return result;
+}
+
+static void memory_free(void *ptr)
+{
+    if (ptr)
+        memory_account(memory_caller_address(), -(int64_t) malloc_usable_size(ptr), false);
+
+    memory_real_free(ptr);
+}
+
+static char *memory_strdup(const char *s)
+{
+    char *result = memory_real_strdup(s);
+
+    if (result)
+        memory_account(memory_caller_address(), malloc_usable_size(result), true);
+
+    return result;
+}
+
+static char *memory_strndup(const char *s, size_t n)
+{
+    char *result = memory_real_strndup(s, n);
+
+    if (result)
+        memory_account(memory_caller_address(), malloc_usable_size(result), true);
+
+    return result;
+}
+
+static void *kMemoryHooks[MEMORY_MAX] = {
+    [MEMORY_MALLOC]     = memory_malloc,
+    [MEMORY_CALLOC]     = memory_calloc,
+    [MEMORY_REALLOC]    = memory_realloc,
+    [MEMORY_FREE]       = memory_free,
+    [MEMORY_STRDUP]     = memory_strdup,
+    [MEMORY_STRNDUP]    = memory_strndup,
+};
+
+// Find the real heap functions, see above. This is only called before the
+// first module is patched, and the browser calls us from a single thread.
+static bool memory_resolve(void)
+{
+    if (memory_real_malloc)
+        return true;
+
+    memory_real_calloc  = dlsym(RTLD_DEFAULT, kMemoryImports[MEMORY_CALLOC]);
+    memory_real_realloc = dlsym(RTLD_DEFAULT, kMemoryImports[MEMORY_REALLOC]);
+    memory_real_free    = dlsym(RTLD_DEFAULT, kMemoryImports[MEMORY_FREE]);
+    memory_real_strdup  = dlsym(RTLD_DEFAULT, kMemoryImports[MEMORY_STRDUP]);
+    memory_real_strndup = dlsym(RTLD_DEFAULT, kMemoryImports[MEMORY_STRNDUP]);
+
+    if (!memory_real_calloc
+            || !memory_real_realloc
+            || !memory_real_free
+            || !memory_real_strdup
+            || !memory_real_strndup) {
+        return false;
+    }
+
+    // Published last, so a partial lookup is retried.
+    memory_real_malloc = dlsym(RTLD_DEFAULT, kMemoryImports[MEMORY_MALLOC]);
+
+    return memory_real_malloc != NULL;
+}
+
+// Start attributing the heap usage of a newly loaded plugin, this must be
+// called before the plugin runs any code that might allocate.
+bool memory_track(struct plugin *plugin)
+{
+    struct memory_module *module;
+    size_t                mapped;
+    unsigned              i;
+
+    if (!plugin->handle || !plugin->stats)
+        return false;
+
+    if (!memory_resolve()) {
+        l_warning("failed to find the heap functions, not tracking memory for %s",
+                  plugin->section);
+        return false;
+    }
+
+    // A reloaded registry has its own record for a plugin that is already
+    // being tracked.
+    for (i = 0; i < memory_module_count; i++) {
+        if (memory_modules[i].handle == plugin->handle && memory_modules[i].references) {
+            memory_modules[i].references++;
+            return true;
+        }
+    }
+
+    if (memory_module_count >= STATS_MAX_PLUGINS) {
+        l_warning("too many modules, not tracking memory for %s", plugin->section);
+        return false;
+    }
+
+    module = &memory_modules[memory_module_count];
+
+    if (!platform_module_info(plugin->handle, &module->start, &module->end, &mapped)) {
+        l_debug("memory accounting is not available for %s", plugin->section);
+        return false;
+    }
+
+    module->handle     = plugin->handle;
+    module->references = 1;
+    module->stats      = plugin->stats;
+
+    stats_add(plugin->stats->module_bytes, mapped);
+
+    // Publish the module before patching, so that the first call is counted.
+    __atomic_store_n(&memory_module_count,
+                     memory_module_count + 1,
+                     __ATOMIC_RELEASE);
+
+    if (platform_patch_imports(plugin->handle,
+                               kMemoryImports,
+                               kMemoryHooks,
+                               module->originals,
+                               MEMORY_MAX) == 0) {
+        l_debug("plugin %s does not import any heap functions", plugin->section);
+    }
+
+    l_debug("tracking memory for %s, module %p-%p, %zu bytes mapped",
+            plugin->section,
+            (void *) module->start,
+            (void *) module->end,
+            mapped);
+
+    return true;
+}
+
+// Restore the imports of a plugin about to be unloaded, and report the usage.
+void memory_untrack(struct plugin *plugin)
+{
+    unsigned i;
+
+    for (i = 0; i < memory_module_count; i++) {
+        struct memory_module *module = &memory_modules[i];
+
+        if (module->handle != plugin->handle || module->references == 0)
+            continue;
+
+        if (--module->references)
+            return;
+
+        platform_patch_imports(plugin->handle,
+                               kMemoryImports,
+                               module->originals,
+                               NULL,
+                               MEMORY_MAX);
+
+        l_debug("plugin %s used %llu KB mapped, %lld KB heap live, %llu KB peak",
+                plugin->section,
+                (unsigned long long) module->stats->module_bytes / 1024,
+                (long long) module->stats->heap_live / 1024,
+                (unsigned long long) module->stats->heap_peak / 1024);
+
+        // The range is about to be unmapped and may be reused, so make sure it
+        // can't match.
+        module->handle = NULL;
+        module->start  = module->end = 0;
+    }
+}
+
+#if defined(ENABLE_RUNTIME_TESTS)
+
+static void __constructor test_memory(void)
+{
+    struct plugin plugin = {0};
+    Dl_info info;
+    void * volatile block;
+    int64_t live;
+
+    // Track ourselves, the allocations below go through our own GOT.
+    assert(dladdr(test_memory, &info) != 0);
+
+    plugin.section = "Memory Test";
+    plugin.stats   = stats_plugin_slot(plugin.section);
+    plugin.handle  = dlopen(info.dli_fname, RTLD_LAZY | RTLD_NOLOAD);
+
+    assert(plugin.stats);
+    assert(plugin.handle);
+    assert(memory_track(&plugin) == true);
+    assert(plugin.stats->module_bytes > 0);
+
+    // The compiler assumes the heap functions don't touch the counters, so
+    // they have to be reloaded after each call.
+    live  = __atomic_load_n(&plugin.stats->heap_live, __ATOMIC_RELAXED);
+    block = malloc(1000);
+
+    assert(block);
+    assert(__atomic_load_n(&plugin.stats->heap_live, __ATOMIC_RELAXED) >= live + 1000);
+    assert(__atomic_load_n(&plugin.stats->heap_peak, __ATOMIC_RELAXED) >= 1000);
+    assert(__atomic_load_n(&plugin.stats->heap_allocations, __ATOMIC_RELAXED) >= 1);
+
+    block = realloc(block, 4000);
+
+    assert(__atomic_load_n(&plugin.stats->heap_live, __ATOMIC_RELAXED) >= live + 4000);
+
+    free(block);
+
+    assert(__atomic_load_n(&plugin.stats->heap_live, __ATOMIC_RELAXED) == live);
+
+    block = strdup("hello");
+    assert(__atomic_load_n(&plugin.stats->heap_live, __ATOMIC_RELAXED) > live);
+    free(block);
+
+    memory_untrack(&plugin);
+
+    // Once untracked, nothing is counted.
+    block = malloc(1000);
+    assert(__atomic_load_n(&plugin.stats->heap_live, __ATOMIC_RELAXED) == live);
+    free(block);
+
+    dlclose(plugin.handle);
+}
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef __MEMORY_H
+#define __MEMORY_H
+
+// Heap functions we interpose in each plugin, in the order used by the
+// replacement table.
+enum {
+    MEMORY_MALLOC,
+    MEMORY_CALLOC,
+    MEMORY_REALLOC,
+    MEMORY_FREE,
+    MEMORY_STRDUP,
+    MEMORY_STRNDUP,
+    MEMORY_MAX,
+};
+
+extern const char *kMemoryImports[MEMORY_MAX];
+
+bool memory_track(struct plugin *plugin);
+void memory_untrack(struct plugin *plugin);
+
+#endif
@@ -17,6 +17,9 @@
 // limitations under the License.
 //
 
+#define LOG_MODULE LOG_MODULE_NETSCAPE
+#define _GNU_SOURCE     // dladdr()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,7 +38,16 @@
 #include "netscape.h"
 #include "instance.h"
 #include "policy.h"
+#include "audit.h"
+#include "histogram.h"
+#include "shim.h"
+#include "record.h"
+#include "stats.h"
+#include "memory.h"
+#include "arena.h"
 #include "util.h"
+#include "automaton.h"
+#include "daemon.h"
 
 // The set of characters allowed in a MIME type.
 static const char kMimeCharacterSet[] =
@@ -47,10 +59,37 @@ static const size_t kMaxMimeLength = 128;
 // Maximum number of sites per plugin for NPP_GetSitesWithData.
 static const unsigned kMaxSitesWithData = 1024;
 
+// Record a policy decision made in netscape_plugin_new(), plugin may be NULL
+// if no plugin was involved.
+static void netscape_plugin_decision(struct plugin *plugin,
+                                     const char *mimetype,
+                                     const char *url,
+                                     unsigned verdict,
+                                     unsigned reason)
+{
+    audit_decision(plugin ? plugin->section : NULL,
+                   mimetype,
+                   url,
+                   verdict,
+                   reason);
+
+    if (plugin && plugin->stats) {
+        if (verdict == AUDIT_VERDICT_ALLOW) {
+            stats_inc(plugin->stats->allowed);
+        } else {
+            stats_inc(plugin->stats->denied);
+        }
+    }
+}
+
 // Deletes a specific instance of a plug-in.
 NPError netscape_plugin_destroy(NPP instance, NPSavedData **save)
 {
-    struct plugin *plugin;
+    struct shim_call call;
+    struct plugin   *plugin;
+    NPError          result;
+
+    shim_enter(&call, SHIM_DESTROY, instance);
 
     // We need to lookup who owns this instance.
     if (!netscape_instance_resolve(instance, &plugin)) {
@@ -59,7 +98,8 @@ NPError netscape_plugin_destroy(NPP instance, NPSavedData **save)
         // NPERR_NO_ERROR from newp, then this should not be called, but
         // apparently not all browsers agree.
         l_debug("failed to resolve instance %p, probably harmless", instance);
-        return NPERR_GENERIC_ERROR;
+        result = NPERR_GENERIC_ERROR;
+        goto finished;
     }
 
     // We can remove this instance now, as the browser promises not to use it
@@ -68,16 +108,26 @@ NPError netscape_plugin_destroy(NPP instance, NPSavedData **save)
         l_warning("resolved instance to %s, but failed to destroy instance %p",
                   plugin->section,
                   instance);
-        return NPERR_GENERIC_ERROR;
+        result = NPERR_GENERIC_ERROR;
+        goto finished;
     }
 
     // Verify it's implemented (it should always be, but who knows).
     if (!plugin->plugin_funcs->destroy) {
-        return NPERR_GENERIC_ERROR;
+        result = NPERR_GENERIC_ERROR;
+        goto finished;
     }
 
     // And finally pass through the call to the plugin.
-    return plugin->plugin_funcs->destroy(instance, save);
+    record(destroy, instance);
+
+    shim_forward(&call, plugin);
+        result = plugin->plugin_funcs->destroy(instance, save);
+    shim_return(&call);
+
+  finished:
+    shim_leave(&call);
+    return result;
 }
 
 // Allows the browser to query the plug-in for information.
@@ -85,8 +135,45 @@ NPError netscape_plugin_getvalue(NPP instance,
                                  NPPVariable variable,
                                  void *value)
 {
-    // These interfaces are similar enough that they can be reused.
-    return NP_GetValue(instance, variable, value);
+    struct shim_call call;
+    struct plugin   *plugin;
+    NPError          result;
+
+    shim_enter(&call, SHIM_GETVALUE, instance);
+
+    switch (variable) {
+        case NPPVpluginNameString:
+        case NPPVpluginDescriptionString:
+            // These interfaces are similar enough that they can be reused.
+            result = NP_GetValue(instance, variable, value);
+            goto finished;
+        default:
+            break;
+    }
+
+    // Anything else is passed through to the plugin that owns the instance.
+    if (!netscape_instance_resolve(instance, &plugin)) {
+        l_warning_ratelimited("failed to resolve instance %p for variable %u",
+                              instance,
+                              variable);
+        result = NPERR_INVALID_INSTANCE_ERROR;
+        goto finished;
+    }
+
+    if (!plugin->plugin_funcs->getvalue) {
+        result = NPERR_GENERIC_ERROR;
+        goto finished;
+    }
+
+    record(getvalue, instance, variable);
+
+    shim_forward(&call, plugin);
+        result = plugin->plugin_funcs->getvalue(instance, variable, value);
+    shim_return(&call);
+
+  finished:
+    shim_leave(&call);
+    return result;
 }
 
 // Creates a new instance of a plug-in.
@@ -106,33 +193,56 @@ NPError netscape_plugin_new(NPMIMEType pluginType,
                             char *argv[],
                             NPSavedData *saved)
 {
-    char          *pageurl;
-    struct plugin *current;
+    struct shim_call call;
+    struct registry *registry;
+    char            *pageurl;
+    struct plugin   *current;
+    uint64_t         allowed = 0;
+    bool             resolved = false;
+    bool             permitted;
+    unsigned         index;
+    NPError          result;
+
+    shim_enter(&call, SHIM_NEW, instance);
+
+    // Only load the registry once shim_enter() has counted us as a reader,
+    // or a reload could free it under us.
+    registry = registry_current();
 
     // First sanity check the untrusted parameter pluginType.
     if (strspn(pluginType, kMimeCharacterSet) != strlen(pluginType)) {
-        l_warning("rejected unusual mime type supplied by browser");
-        return NPERR_INVALID_PARAM;
+        l_warning_ratelimited("rejected unusual mime type supplied by browser");
+        netscape_plugin_decision(NULL, NULL, NULL, AUDIT_VERDICT_DENY,
+                                                   AUDIT_REASON_INVALID_MIME);
+        result = NPERR_INVALID_PARAM;
+        goto finished;
     }
 
     // Verify it's a sane length.
     if (strlen(pluginType) > kMaxMimeLength) {
-        l_warning("rejected unusual mime type supplied by browser");
-        return NPERR_INVALID_PARAM;
+        l_warning_ratelimited("rejected unusual mime type supplied by browser");
+        netscape_plugin_decision(NULL, NULL, NULL, AUDIT_VERDICT_DENY,
+                                                   AUDIT_REASON_INVALID_MIME);
+        result = NPERR_INVALID_PARAM;
+        goto finished;
     }
 
+    shim_annotate(&call, pluginType, NULL, 0, 0);
+
     l_debug("new plugin requested for mimetype %s @%p", pluginType, instance);
 
     // First we find a plugin that wants to handle this type.
-    for (current = registry.plugins; current; current = current->next) {
+    for (current = registry->plugins, index = 0; current; current = current->next, index++) {
         char *saveptr;
         char *mimetypes;
         char *field;
 
         saveptr   = NULL;
 
-        // Verify there is a mime description for this plugin.
-        if (!current->mime_description)
+        // Verify there is a mime description for this plugin, and that the
+        // browser has initialised it. A plugin added by reload.c won't be
+        // until the browser restarts.
+        if (!current->mime_description || !current->plugin_funcs)
             continue;
 
         // Create a copy we can modify.
@@ -163,20 +273,41 @@ NPError netscape_plugin_new(NPMIMEType pluginType,
 
             // Fetch the current domain from netscape.
             if (!netscape_plugin_geturl(instance, &pageurl)) {
-                l_warning("unknown url for plugin %s", current->section);
+                l_warning_ratelimited("unknown url for plugin %s",
+                                      current->section);
+                netscape_plugin_decision(current, pluginType, NULL,
+                                         AUDIT_VERDICT_DENY,
+                                         AUDIT_REASON_UNKNOWN_URL);
                 continue;
             }
 
-            // Match that URL against the security policy.
-            if (!policy_plugin_allowed_url(current, pageurl)) {
-                l_warning("plugin %s not allowed from %s, policy match failed",
-                          current->section,
-                          pageurl);
+            // Match that URL against the security policy. The first time,
+            // every plugin is checked at once, see automaton.c.
+            if (registry->automaton && index < AUTOMATON_MAX_PLUGINS) {
+                if (!resolved) {
+                    allowed  = policy_allowed_set(registry, pageurl);
+                    resolved = true;
+                }
+
+                permitted = allowed & (1ULL << index);
+
+                // The automaton only knows the configured domains.
+                if (!permitted && (daemon_enabled || current->networks))
+                    permitted = policy_plugin_allowed_url(current, pageurl);
+            } else {
+                permitted = policy_plugin_allowed_url(current, pageurl);
+            }
+
+            if (!permitted) {
+                l_warning_ratelimited("plugin %s not allowed from %s, policy match failed",
+                                      current->section,
+                                      pageurl);
+                netscape_plugin_decision(current, pluginType, pageurl,
+                                         AUDIT_VERDICT_DENY,
+                                         AUDIT_REASON_POLICY);
 
                 // Possibly display a message to the user.
-                netscape_display_message(instance, current->warning
-                                                    ? current->warning
-                                                    : registry.global->warning);
+                netscape_display_message(instance, current->policy.warning);
 
                 // Done.
                 free(pageurl);
@@ -185,6 +316,9 @@ NPError netscape_plugin_new(NPMIMEType pluginType,
 
             // We determined this plugin is allowed to be loaded here, and it
             // does want this MIME type, so we have finished.
+            netscape_plugin_decision(current, pluginType, pageurl,
+                                     AUDIT_VERDICT_ALLOW,
+                                     AUDIT_REASON_PERMITTED);
             free(pageurl);
 
             // No need to keep searching.
@@ -196,8 +330,13 @@ NPError netscape_plugin_new(NPMIMEType pluginType,
 
     // At this point, if current is NULL, we don't want this type.
     if (!current) {
-        l_warning("netscape requested %s, but we cant handle it", pluginType);
-        return NPERR_INVALID_PARAM;
+        l_warning_ratelimited("netscape requested %s, but we cant handle it",
+                              pluginType);
+        netscape_plugin_decision(NULL, pluginType, NULL,
+                                 AUDIT_VERDICT_DENY,
+                                 AUDIT_REASON_NO_HANDLER);
+        result = NPERR_INVALID_PARAM;
+        goto finished;
     }
 
     // The plugin has been permitted, so we need to register this instance to
@@ -206,37 +345,63 @@ NPError netscape_plugin_new(NPMIMEType pluginType,
         l_debug("failed to map new instance %p to plugin %s",
                 instance,
                 current->section);
-        return NPERR_GENERIC_ERROR;
+        netscape_plugin_decision(current, pluginType, NULL,
+                                 AUDIT_VERDICT_DENY,
+                                 AUDIT_REASON_MAP_FAILED);
+        result = NPERR_GENERIC_ERROR;
+        goto finished;
     }
 
     l_debug("plugin %s permitted, and instance %p registered",
             current->section,
             instance);
 
+    record(new, instance, pluginType, mode, argc, argn, argv);
+
     // And finally we can pass through the results.
-    return current->plugin_funcs->newp(pluginType,
-                                       instance,
-                                       mode,
-                                       argc,
-                                       argn,
-                                       argv,
-                                       saved);
+    shim_forward(&call, current);
+        result = current->plugin_funcs->newp(pluginType,
+                                             instance,
+                                             mode,
+                                             argc,
+                                             argn,
+                                             argv,
+                                             saved);
+    shim_return(&call);
+
+  finished:
+    shim_leave(&call);
+    return result;
 }
 
 // Tells the plug-in when a window is created, moved, sized, or destroyed.
 NPError netscape_plugin_setwindow(NPP instance, NPWindow *window)
 {
-    struct plugin *plugin;
+    struct shim_call call;
+    struct plugin   *plugin;
+    NPError          result;
+
+    shim_enter(&call, SHIM_SETWINDOW, instance);
 
     if (!netscape_instance_resolve(instance, &plugin)) {
-        return NPERR_INVALID_INSTANCE_ERROR;
+        result = NPERR_INVALID_INSTANCE_ERROR;
+        goto finished;
     }
 
     if (!plugin->plugin_funcs->setwindow) {
-        return NPERR_GENERIC_ERROR;
+        result = NPERR_GENERIC_ERROR;
+        goto finished;
     }
 
-    return plugin->plugin_funcs->setwindow(instance, window);
+    record(setwindow, instance, window);
+
+    shim_forward(&call, plugin);
+        result = plugin->plugin_funcs->setwindow(instance, window);
+    shim_return(&call);
+
+  finished:
+    shim_leave(&call);
+    return result;
 }
 
 // Notifies a plug-in instance of a new data stream.
@@ -246,21 +411,36 @@ NPError netscape_plugin_newstream(NPP instance,
                                   NPBool seekable,
                                   uint16_t *stype)
 {
-    struct plugin *plugin;
+    struct shim_call call;
+    struct plugin   *plugin;
+    NPError          result;
+
+    shim_enter(&call, SHIM_NEWSTREAM, instance);
+    shim_annotate(&call, type, stream, 0, 0);
 
     if (!netscape_instance_resolve(instance, &plugin)) {
-        return NPERR_INVALID_INSTANCE_ERROR;
+        result = NPERR_INVALID_INSTANCE_ERROR;
+        goto finished;
     }
 
     if (!plugin->plugin_funcs->newstream) {
-        return NPERR_GENERIC_ERROR;
+        result = NPERR_GENERIC_ERROR;
+        goto finished;
     }
 
-    return plugin->plugin_funcs->newstream(instance,
-                                           type,
-                                           stream,
-                                           seekable,
-                                           stype);
+    record(newstream, instance, type, stream, seekable);
+
+    shim_forward(&call, plugin);
+        result = plugin->plugin_funcs->newstream(instance,
+                                                 type,
+                                                 stream,
+                                                 seekable,
+                                                 stype);
+    shim_return(&call);
+
+  finished:
+    shim_leave(&call);
+    return result;
 }
 
 
@@ -269,17 +449,32 @@ NPError netscape_plugin_destroystream(NPP instance,
                                       NPStream* stream,
                                       NPReason reason)
 {
-    struct plugin *plugin;
+    struct shim_call call;
+    struct plugin   *plugin;
+    NPError          result;
+
+    shim_enter(&call, SHIM_DESTROYSTREAM, instance);
+    shim_annotate(&call, NULL, stream, 0, 0);
 
     if (!netscape_instance_resolve(instance, &plugin)) {
-        return NPERR_INVALID_INSTANCE_ERROR;
+        result = NPERR_INVALID_INSTANCE_ERROR;
+        goto finished;
     }
 
     if (!plugin->plugin_funcs->destroystream) {
-        return NPERR_GENERIC_ERROR;
+        result = NPERR_GENERIC_ERROR;
+        goto finished;
     }
 
-    return plugin->plugin_funcs->destroystream(instance, stream, reason);
+    record(destroystream, instance, stream, reason);
+
+    shim_forward(&call, plugin);
+        result = plugin->plugin_funcs->destroystream(instance, stream, reason);
+    shim_return(&call);
+
+  finished:
+    shim_leave(&call);
+    return result;
 }
 
 
@@ -288,33 +483,59 @@ void netscape_plugin_streamasfile(NPP instance,
                                   NPStream *stream,
                                   const char *fname)
 {
-    struct plugin *plugin;
+    struct shim_call call;
+    struct plugin   *plugin;
+
+    shim_enter(&call, SHIM_ASFILE, instance);
+    shim_annotate(&call, NULL, stream, 0, 0);
 
     if (!netscape_instance_resolve(instance, &plugin)) {
-        return;
+        goto finished;
     }
 
     if (!plugin->plugin_funcs->asfile) {
-        return;
+        goto finished;
     }
 
-    return plugin->plugin_funcs->asfile(instance, stream, fname);
+    record(asfile, instance, stream, fname);
+
+    shim_forward(&call, plugin);
+        plugin->plugin_funcs->asfile(instance, stream, fname);
+    shim_return(&call);
+
+  finished:
+    shim_leave(&call);
+    return;
 }
 
 // Determines maximum number of bytes that the plug-in can consume.
 int32_t netscape_plugin_writeready(NPP instance, NPStream* stream)
 {
-    struct plugin *plugin;
+    struct shim_call call;
+    struct plugin   *plugin;
+    int32_t          result;
+
+    shim_enter(&call, SHIM_WRITEREADY, instance);
 
     if (!netscape_instance_resolve(instance, &plugin)) {
-        return NPERR_INVALID_INSTANCE_ERROR;
+        result = NPERR_INVALID_INSTANCE_ERROR;
+        goto finished;
     }
 
     if (!plugin->plugin_funcs->writeready) {
-        return NPERR_GENERIC_ERROR;
+        result = NPERR_GENERIC_ERROR;
+        goto finished;
     }
 
-    return plugin->plugin_funcs->writeready(instance, stream);
+    record(writeready, instance, stream);
+
+    shim_forward(&call, plugin);
+        result = plugin->plugin_funcs->writeready(instance, stream);
+    shim_return(&call);
+
+  finished:
+    shim_leave(&call);
+    return result;
 }
 
 // Delivers data to a plug-in instance.
@@ -324,50 +545,97 @@ int32_t netscape_plugin_write(NPP instance,
                               int32_t len,
                               void *buf)
 {
-    struct plugin *plugin;
+    struct shim_call call;
+    struct plugin   *plugin;
+    int32_t          result;
+
+    shim_enter(&call, SHIM_WRITE, instance);
+    shim_annotate(&call, NULL, stream, offset, len);
 
     if (!netscape_instance_resolve(instance, &plugin)) {
-        return NPERR_INVALID_INSTANCE_ERROR;
+        result = NPERR_INVALID_INSTANCE_ERROR;
+        goto finished;
     }
 
     if (!plugin->plugin_funcs->write) {
-        return NPERR_GENERIC_ERROR;
+        result = NPERR_GENERIC_ERROR;
+        goto finished;
+    }
+
+    record(write, instance, stream, offset, len, buf);
+
+    shim_forward(&call, plugin);
+        result = plugin->plugin_funcs->write(instance, stream, offset, len, buf);
+    shim_return(&call);
+
+    // Record how much data the plugin consumed.
+    if (result > 0) {
+        stats_add(global_stats->stream_bytes, result);
+
+        if (plugin->stats) {
+            stats_add(plugin->stats->stream_bytes, result);
+        }
     }
 
-    return plugin->plugin_funcs->write(instance, stream, offset, len, buf);
+  finished:
+    shim_leave(&call);
+    return result;
 }
 
 // Requests a platform-specific print operation for an embedded or full-screen
 // plug-in.
 void netscape_plugin_print(NPP instance, NPPrint *PrintInfo)
 {
-    struct plugin *plugin;
+    struct shim_call call;
+    struct plugin   *plugin;
+
+    shim_enter(&call, SHIM_PRINT, instance);
 
     if (!netscape_instance_resolve(instance, &plugin)) {
-        return;
+        goto finished;
     }
 
     if (!plugin->plugin_funcs->print) {
-        return;
+        goto finished;
     }
 
-    return plugin->plugin_funcs->print(instance, PrintInfo);
+    shim_forward(&call, plugin);
+        plugin->plugin_funcs->print(instance, PrintInfo);
+    shim_return(&call);
+
+  finished:
+    shim_leave(&call);
+    return;
 }
 
 // Delivers a platform-specific window event to the instance.
 int16_t netscape_plugin_handleevent(NPP instance, void *event)
 {
-    struct plugin *plugin;
+    struct shim_call call;
+    struct plugin   *plugin;
+    int16_t          result;
+
+    shim_enter(&call, SHIM_EVENT, instance);
 
     if (!netscape_instance_resolve(instance, &plugin)) {
-        return NPERR_INVALID_INSTANCE_ERROR;
+        result = NPERR_INVALID_INSTANCE_ERROR;
+        goto finished;
     }
 
     if (!plugin->plugin_funcs->event) {
-        return NPERR_GENERIC_ERROR;
+        result = NPERR_GENERIC_ERROR;
+        goto finished;
     }
 
-    return plugin->plugin_funcs->event(instance, event);
+    record(event, instance, event);
+
+    shim_forward(&call, plugin);
+        result = plugin->plugin_funcs->event(instance, event);
+    shim_return(&call);
+
+  finished:
+    shim_leave(&call);
+    return result;
 }
 
 // Notifies the instance of the completion of a URL request.
@@ -376,65 +644,113 @@ void netscape_plugin_urlnotify(NPP instance,
                                NPReason reason,
                                void *notifyData)
 {
-    struct plugin *plugin;
+    struct shim_call call;
+    struct plugin   *plugin;
+
+    shim_enter(&call, SHIM_URLNOTIFY, instance);
 
     if (!netscape_instance_resolve(instance, &plugin)) {
-        return;
+        goto finished;
     }
 
     if (!plugin->plugin_funcs->urlnotify) {
-        return;
+        goto finished;
     }
 
-    return plugin->plugin_funcs->urlnotify(instance, url, reason, notifyData);
+    record(urlnotify, instance, url, reason);
+
+    shim_forward(&call, plugin);
+        plugin->plugin_funcs->urlnotify(instance, url, reason, notifyData);
+    shim_return(&call);
+
+  finished:
+    shim_leave(&call);
+    return;
 }
 
 // Sets information about the plug-in.
 NPError netscape_plugin_setvalue(NPP instance, NPNVariable variable, void *value)
 {
-    struct plugin *plugin;
+    struct shim_call call;
+    struct plugin   *plugin;
+    NPError          result;
+
+    shim_enter(&call, SHIM_SETVALUE, instance);
 
     if (!netscape_instance_resolve(instance, &plugin)) {
-        return NPERR_INVALID_INSTANCE_ERROR;
+        result = NPERR_INVALID_INSTANCE_ERROR;
+        goto finished;
     }
 
     if (!plugin->plugin_funcs->setvalue) {
-        return NPERR_GENERIC_ERROR;
+        result = NPERR_GENERIC_ERROR;
+        goto finished;
     }
 
-    return plugin->plugin_funcs->setvalue(instance, variable, value);
+    shim_forward(&call, plugin);
+        result = plugin->plugin_funcs->setvalue(instance, variable, value);
+    shim_return(&call);
+
+  finished:
+    shim_leave(&call);
+    return result;
 }
 
 // Called by the browser when the browser intends to focus an instance.
 NPBool netscape_plugin_gotfocus(NPP instance, NPFocusDirection direction)
 {
-    struct plugin *plugin;
+    struct shim_call call;
+    struct plugin   *plugin;
+    NPBool           result;
+
+    shim_enter(&call, SHIM_GOTFOCUS, instance);
 
     if (!netscape_instance_resolve(instance, &plugin)) {
-        return false;
+        result = false;
+        goto finished;
     }
 
     if (!plugin->plugin_funcs->gotfocus) {
-        return false;
+        result = false;
+        goto finished;
     }
 
-    return plugin->plugin_funcs->gotfocus(instance, direction);
+    record(gotfocus, instance, direction);
+
+    shim_forward(&call, plugin);
+        result = plugin->plugin_funcs->gotfocus(instance, direction);
+    shim_return(&call);
+
+  finished:
+    shim_leave(&call);
+    return result;
 }
 
 // Called by the browser when the browser intends to take focus.
 void netscape_plugin_lostfocus(NPP instance)
 {
-    struct plugin *plugin;
+    struct shim_call call;
+    struct plugin   *plugin;
+
+    shim_enter(&call, SHIM_LOSTFOCUS, instance);
 
     if (!netscape_instance_resolve(instance, &plugin)) {
-        return;
+        goto finished;
     }
 
     if (!plugin->plugin_funcs->lostfocus) {
-        return;
+        goto finished;
     }
 
-    return plugin->plugin_funcs->lostfocus(instance);
+    record(lostfocus, instance);
+
+    shim_forward(&call, plugin);
+        plugin->plugin_funcs->lostfocus(instance);
+    shim_return(&call);
+
+  finished:
+    shim_leave(&call);
+    return;
 }
 
 // The following function can be implemented by plugins to allow for URL
@@ -444,20 +760,29 @@ void netscape_plugin_urlredirectnotify(NPP instance,
                                        int32_t status,
                                        void* notifyData)
 {
-    struct plugin *plugin;
+    struct shim_call call;
+    struct plugin   *plugin;
+
+    shim_enter(&call, SHIM_URLREDIRECTNOTIFY, instance);
 
     if (!netscape_instance_resolve(instance, &plugin)) {
-        return;
+        goto finished;
     }
 
     if (!plugin->plugin_funcs->urlredirectnotify) {
-        return;
+        goto finished;
     }
 
-    return plugin->plugin_funcs->urlredirectnotify(instance,
-                                                   url,
-                                                   status,
-                                                   notifyData);
+    shim_forward(&call, plugin);
+        plugin->plugin_funcs->urlredirectnotify(instance,
+                                                url,
+                                                status,
+                                                notifyData);
+    shim_return(&call);
+
+  finished:
+    shim_leave(&call);
+    return;
 }
 
 // Allows browsers to discover and clear plugin private data. This API was
@@ -471,11 +796,15 @@ void netscape_plugin_urlredirectnotify(NPP instance,
 // Seriously, why isn't this an NP (as opposed to NPP) api?!
 NPError netscape_plugin_clearsitedata(const char* site, uint64_t flags, uint64_t maxAge)
 {
-    struct plugin *current;
+    struct shim_call call;
+    struct plugin   *current;
+    NPError          result;
+
+    shim_enter(&call, SHIM_CLEARSITEDATA, NULL);
 
     l_debug("browser requests all plugins clear site data for %s", site);
 
-    for (current = registry.plugins; current; current = current->next) {
+    for (current = registry_current()->plugins; current; current = current->next) {
 
         if (!current->plugin_funcs)
             continue;
@@ -483,32 +812,39 @@ NPError netscape_plugin_clearsitedata(const char* site, uint64_t flags, uint64_t
         if (!current->plugin_funcs->clearsitedata)
             continue;
 
+        shim_forward(&call, current);
+            result = current->plugin_funcs->clearsitedata(site, flags, maxAge);
+        shim_return(&call);
+
         // What should I do on error here?
-        if (current->plugin_funcs->clearsitedata(site,
-                                                 flags,
-                                                 maxAge) != NPERR_NO_ERROR) {
+        if (result != NPERR_NO_ERROR) {
             l_warning("plugin %s returned error from ClearSiteData",
                       current->section);
         }
     }
 
+    // The wrapper time is attributed to the last plugin called.
+    shim_leave(&call);
     return NPERR_NO_ERROR;
 }
 
 // We don't need to duplicate the strings, but we do need to make a new array.
 char **netscape_plugin_getsiteswithdata(void)
 {
-    struct plugin *current;
-    void         **result;
-    void          *final;
-    unsigned       total;
+    struct shim_call call;
+    struct plugin   *current;
+    void           **result;
+    void            *final;
+    unsigned         total;
+
+    shim_enter(&call, SHIM_GETSITESWITHDATA, NULL);
 
     // Keep track of total strings we have.
     result = NULL;
     total = 0;
 
     // Pass the query through to each plugin.
-    for (current = registry.plugins; current; current = current->next) {
+    for (current = registry_current()->plugins; current; current = current->next) {
         char        **sites_data;
         unsigned      count;
 
@@ -518,7 +854,9 @@ char **netscape_plugin_getsiteswithdata(void)
         if (!current->plugin_funcs->getsiteswithdata)
             continue;
 
-        sites_data = current->plugin_funcs->getsiteswithdata();
+        shim_forward(&call, current);
+            sites_data = current->plugin_funcs->getsiteswithdata();
+        shim_return(&call);
 
         // Verify that returned something useful.
         if (!sites_data) {
@@ -537,6 +875,7 @@ char **netscape_plugin_getsiteswithdata(void)
                 l_warning("memory allocation failure querying sites for %s, %u",
                           current->plugin,
                           count);
+                shim_leave(&call);
                 return NULL;
             }
 
@@ -559,12 +898,12 @@ char **netscape_plugin_getsiteswithdata(void)
                 count);
 
         // Free the array, but not the strings.
-        registry.netscape_funcs->memfree(sites_data);
+        registry_current()->netscape_funcs->memfree(sites_data);
     }
 
     // Translate this insto an NPN buffer.
-    final = registry.netscape_funcs->memalloc(total * sizeof(char *)
-                                                    + sizeof(char *));
+    final = registry_current()->netscape_funcs->memalloc(total * sizeof(char *)
+                                                         + sizeof(char *));
 
     // Check that worked.
     if (!final) {
@@ -583,5 +922,334 @@ finished:
     // Release the working version.
     free(result);
 
+    shim_leave(&call);
     return final;
 }
+
+#if defined(ENABLE_RUNTIME_TESTS)
+
+// An allocation audit of the wrapper. The heap imports of this module are
+// redirected with memory_track(), then a scripted session is driven through
+// the entry points against a fake browser and plugin that never allocate.
+// Every entry point has a budget, and the test fails if any call made more
+// allocations than that. Steady state calls must not allocate at all.
+
+enum {
+    TEST_NEW_ALLOWED,
+    TEST_NEW_DENIED,
+    TEST_NEW_INVALID,
+    TEST_SETWINDOW,
+    TEST_NEWSTREAM,
+    TEST_WRITEREADY,
+    TEST_WRITE,
+    TEST_HANDLEEVENT,
+    TEST_GETVALUE,
+    TEST_RESOLVE,
+    TEST_DESTROYSTREAM,
+    TEST_DESTROY,
+    TEST_MAX,
+};
+
+static struct {
+    const char *name;
+    uint64_t    budget;
+    uint64_t    worst;
+} test_budgets[TEST_MAX] = {
+    // netscape_plugin_geturl() and netscape_instance_map().
+    [TEST_NEW_ALLOWED]      = { "new",              2 },
+    // netscape_plugin_geturl() and netscape_display_message().
+    [TEST_NEW_DENIED]       = { "new (denied)",     2 },
+    [TEST_NEW_INVALID]      = { "new (invalid)",    0 },
+    [TEST_SETWINDOW]        = { "setwindow",        0 },
+    [TEST_NEWSTREAM]        = { "newstream",        0 },
+    [TEST_WRITEREADY]       = { "writeready",       0 },
+    [TEST_WRITE]            = { "write",            0 },
+    [TEST_HANDLEEVENT]      = { "handleevent",      0 },
+    [TEST_GETVALUE]         = { "getvalue",         0 },
+    [TEST_RESOLVE]          = { "resolve",          0 },
+    [TEST_DESTROYSTREAM]    = { "destroystream",    0 },
+    [TEST_DESTROY]          = { "destroy",          0 },
+};
+
+// Run call, and remember the most allocations any call to entry made. The
+// counter is loaded atomically, as the compiler may otherwise assume the heap
+// functions called inside don't change it.
+#define test_allocations(counters)                                          \
+        __atomic_load_n(&(counters)->heap_allocations, __ATOMIC_RELAXED)
+
+#define test_audit(counters, entry, call) do {                              \
+        uint64_t before_ = test_allocations(counters);                      \
+        call;                                                               \
+        if (test_allocations(counters) - before_ > test_budgets[entry].worst)\
+            test_budgets[entry].worst = test_allocations(counters) - before_;\
+    } while (false)
+
+static NPObject test_object;
+
+// The page URL is stored in ndata, so instances can be allowed or denied.
+static NPError test_browser_getvalue(NPP instance __unused,
+                                     NPNVariable variable __unused,
+                                     void *value)
+{
+    *(NPObject **) value = &test_object;
+    return NPERR_NO_ERROR;
+}
+
+static NPIdentifier test_browser_getstringidentifier(const NPUTF8 *name)
+{
+    return (NPIdentifier) name;
+}
+
+static bool test_browser_getproperty(NPP instance,
+                                     NPObject *object __unused,
+                                     NPIdentifier property,
+                                     NPVariant *result)
+{
+    if (strcmp(property, "location") == 0) {
+        OBJECT_TO_NPVARIANT(&test_object, *result);
+    } else {
+        STRINGZ_TO_NPVARIANT(instance->ndata, *result);
+    }
+    return true;
+}
+
+static bool test_browser_evaluate(NPP instance __unused,
+                                  NPObject *object __unused,
+                                  NPString *script __unused,
+                                  NPVariant *result)
+{
+    VOID_TO_NPVARIANT(*result);
+    return true;
+}
+
+static void test_browser_releasevariantvalue(NPVariant *variant __unused)
+{
+    return;
+}
+
+static const char *test_browser_uagent(NPP instance __unused)
+{
+    return "Mozilla/5.0 (X11; Linux x86_64) Test";
+}
+
+static NPError test_plugin_new(NPMIMEType type __unused,
+                               NPP instance __unused,
+                               uint16_t mode __unused,
+                               int16_t argc __unused,
+                               char *argn[] __unused,
+                               char *argv[] __unused,
+                               NPSavedData *saved __unused)
+{
+    return NPERR_NO_ERROR;
+}
+
+static NPError test_plugin_destroy(NPP instance __unused,
+                                   NPSavedData **save __unused)
+{
+    return NPERR_NO_ERROR;
+}
+
+static NPError test_plugin_setwindow(NPP instance __unused,
+                                     NPWindow *window __unused)
+{
+    return NPERR_NO_ERROR;
+}
+
+static NPError test_plugin_newstream(NPP instance __unused,
+                                     NPMIMEType type __unused,
+                                     NPStream *stream __unused,
+                                     NPBool seekable __unused,
+                                     uint16_t *stype)
+{
+    *stype = NP_NORMAL;
+    return NPERR_NO_ERROR;
+}
+
+static NPError test_plugin_destroystream(NPP instance __unused,
+                                         NPStream *stream __unused,
+                                         NPReason reason __unused)
+{
+    return NPERR_NO_ERROR;
+}
+
+static int32_t test_plugin_writeready(NPP instance __unused,
+                                      NPStream *stream __unused)
+{
+    return 0x10000;
+}
+
+static int32_t test_plugin_write(NPP instance __unused,
+                                 NPStream *stream __unused,
+                                 int32_t offset __unused,
+                                 int32_t len,
+                                 void *buffer __unused)
+{
+    return len;
+}
+
+static int16_t test_plugin_event(NPP instance __unused, void *event __unused)
+{
+    return true;
+}
+
+static NPError test_plugin_getvalue(NPP instance __unused,
+                                    NPPVariable variable __unused,
+                                    void *value __unused)
+{
+    return NPERR_GENERIC_ERROR;
+}
+
+static void __constructor test_allocation_audit(void)
+{
+    NPNetscapeFuncs browser = {
+        .getvalue               = test_browser_getvalue,
+        .getstringidentifier    = test_browser_getstringidentifier,
+        .getproperty            = test_browser_getproperty,
+        .evaluate               = test_browser_evaluate,
+        .releasevariantvalue    = test_browser_releasevariantvalue,
+        .uagent                 = test_browser_uagent,
+    };
+    NPPluginFuncs funcs = {
+        .newp                   = test_plugin_new,
+        .destroy                = test_plugin_destroy,
+        .setwindow              = test_plugin_setwindow,
+        .newstream              = test_plugin_newstream,
+        .destroystream          = test_plugin_destroystream,
+        .writeready             = test_plugin_writeready,
+        .write                  = test_plugin_write,
+        .event                  = test_plugin_event,
+        .getvalue               = test_plugin_getvalue,
+    };
+    struct plugin global = {
+        .section                = "Global",
+        .warning                = "Blocked",
+    };
+    struct plugin plugin = {
+        .section                = "Allocation Audit",
+        .allow_domains          = "*.allowed.com",
+        .mime_description       = "application/x-audit:audit:Audit",
+        .plugin_funcs           = &funcs,
+    };
+    struct plugin wrapper = {
+        .section                = "Allocation Audit Wrapper",
+    };
+    NPP_t allowed = { .ndata = "https://www.allowed.com/index.html" };
+    NPP_t denied = { .ndata = "https://www.denied.com/index.html" };
+    NPStream stream = { .url = "https://www.allowed.com/movie.swf", .end = 4096 };
+    NPWindow window = { .width = 100, .height = 100 };
+    unsigned char saved[LOG_MODULE_MAX];
+    struct registry *previous = global_registry;
+    struct registry test = {0};
+    struct stats_plugin *counters;
+    struct arena *arena = arena_create(1024);
+    struct plugin *resolved;
+    char buffer[1024] = {0};
+    uint16_t stype;
+    NPObject *object;
+    Dl_info info;
+    unsigned round;
+    unsigned i;
+
+    // The denied path logs warnings, which would just be noise here.
+    memcpy(saved, log_verbosity, sizeof saved);
+    log_set_verbosity("none");
+
+    // Attribute the heap usage of this module to wrapper.
+    assert(dladdr(test_allocation_audit, &info) != 0);
+
+    wrapper.stats  = stats_plugin_slot(wrapper.section);
+    wrapper.handle = dlopen(info.dli_fname, RTLD_LAZY | RTLD_NOLOAD);
+    counters       = wrapper.stats;
+
+    assert(counters);
+    assert(wrapper.handle);
+
+    test.netscape_funcs = &browser;
+    test.global         = &global;
+    test.plugins        = &plugin;
+    global_registry     = &test;
+
+    policy_compile(arena, &plugin, &global);
+
+    assert(memory_track(&wrapper) == true);
+
+    // The first round may perform one time initialisation, so every round
+    // after that is held to the same budget.
+    for (round = 0; round < 3; round++) {
+        test_audit(counters, TEST_NEW_INVALID,
+            assert(netscape_plugin_new("application/x-audit\n", &allowed,
+                                       NP_EMBED, 0, NULL, NULL, NULL)
+                        == NPERR_INVALID_PARAM));
+        test_audit(counters, TEST_NEW_DENIED,
+            assert(netscape_plugin_new("application/x-audit", &denied,
+                                       NP_EMBED, 0, NULL, NULL, NULL)
+                        == NPERR_INVALID_PARAM));
+        test_audit(counters, TEST_NEW_ALLOWED,
+            assert(netscape_plugin_new("application/x-audit", &allowed,
+                                       NP_EMBED, 0, NULL, NULL, NULL)
+                        == NPERR_NO_ERROR));
+        test_audit(counters, TEST_SETWINDOW,
+            netscape_plugin_setwindow(&allowed, &window));
+        test_audit(counters, TEST_NEWSTREAM,
+            netscape_plugin_newstream(&allowed, "application/x-audit",
+                                      &stream, false, &stype));
+
+        for (i = 0; i < 4; i++) {
+            test_audit(counters, TEST_WRITEREADY,
+                netscape_plugin_writeready(&allowed, &stream));
+            test_audit(counters, TEST_WRITE,
+                assert(netscape_plugin_write(&allowed, &stream, i * sizeof buffer,
+                                             sizeof buffer, buffer)
+                            == sizeof buffer));
+            test_audit(counters, TEST_HANDLEEVENT,
+                netscape_plugin_handleevent(&allowed, buffer));
+            test_audit(counters, TEST_GETVALUE,
+                netscape_plugin_getvalue(&allowed,
+                                         NPPVpluginScriptableNPObject,
+                                         &object));
+            test_audit(counters, TEST_RESOLVE,
+                assert(netscape_instance_resolve(&allowed, &resolved)));
+        }
+
+        test_audit(counters, TEST_DESTROYSTREAM,
+            netscape_plugin_destroystream(&allowed, &stream, NPRES_DONE));
+        test_audit(counters, TEST_DESTROY,
+            assert(netscape_plugin_destroy(&allowed, NULL) == NPERR_NO_ERROR));
+
+        // Only count the steady state.
+        if (round == 0) {
+            for (i = 0; i < TEST_MAX; i++) {
+                test_budgets[i].worst = 0;
+            }
+        }
+    }
+
+    memory_untrack(&wrapper);
+    dlclose(wrapper.handle);
+
+    global_registry = previous;
+
+    arena_destroy(arena);
+
+    memcpy(log_verbosity, saved, sizeof saved);
+
+    for (i = 0; i < TEST_MAX; i++) {
+        l_debug("%s made at most %llu allocations, budget %llu",
+                test_budgets[i].name,
+                (unsigned long long) test_budgets[i].worst,
+                (unsigned long long) test_budgets[i].budget);
+
+        if (test_budgets[i].worst > test_budgets[i].budget) {
+            l_error("%s made %llu allocations, budget is %llu",
+                    test_budgets[i].name,
+                    (unsigned long long) test_budgets[i].worst,
+                    (unsigned long long) test_budgets[i].budget);
+        }
+    }
+
+    for (i = 0; i < TEST_MAX; i++) {
+        assert(test_budgets[i].worst <= test_budgets[i].budget);
+    }
+}
+
+#endif
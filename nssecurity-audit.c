@@ -0,0 +1,165 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Author: taviso@google.com
+//
+// Convert the binary audit log into JSON lines.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "audit.h"
+
+static const char *kAuditReasonNames[AUDIT_REASON_MAX] = {
+    [AUDIT_REASON_PERMITTED]    = "permitted",
+    [AUDIT_REASON_INVALID_MIME] = "invalid-mime",
+    [AUDIT_REASON_UNKNOWN_URL]  = "unknown-url",
+    [AUDIT_REASON_POLICY]       = "policy",
+    [AUDIT_REASON_NO_HANDLER]   = "no-handler",
+    [AUDIT_REASON_MAP_FAILED]   = "map-failed",
+};
+
+// Print a fixed size, possibly unterminated field as a JSON string.
+static void print_json_string(const char *field, size_t size)
+{
+    size_t i;
+
+    putchar('"');
+
+    for (i = 0; i < size && field[i]; i++) {
+        unsigned char c = field[i];
+
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        } else if (c < 0x20 || c >= 0x7f) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+
+    putchar('"');
+}
+
+static bool dump_audit_log(const char *path)
+{
+    const struct audit_header *header;
+    const struct audit_record *ring;
+    struct stat                filestat;
+    uint64_t                   sequence;
+    uint64_t                   current;
+    int                        fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &filestat) != 0) {
+        fprintf(stderr, "nssecurity-audit: cannot open %s\n", path);
+        return false;
+    }
+
+    if ((size_t) filestat.st_size < sizeof *header) {
+        fprintf(stderr, "nssecurity-audit: %s is not an audit log\n", path);
+        close(fd);
+        return false;
+    }
+
+    header = mmap(NULL, filestat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if (header == MAP_FAILED) {
+        fprintf(stderr, "nssecurity-audit: cannot map %s\n", path);
+        return false;
+    }
+
+    // Verify this is a layout we understand.
+    if (header->magic != AUDIT_MAGIC
+            || header->version != AUDIT_VERSION
+            || header->record_size != sizeof *ring
+            || header->capacity == 0
+            || sizeof *header + (size_t) header->capacity * sizeof *ring
+                    > (size_t) filestat.st_size) {
+        fprintf(stderr, "nssecurity-audit: %s has an unsupported layout\n", path);
+        munmap((void *) header, filestat.st_size);
+        return false;
+    }
+
+    ring     = (const struct audit_record *)(header + 1);
+    sequence = __atomic_load_n(&header->sequence, __ATOMIC_ACQUIRE);
+
+    // Print the records still in the ring, oldest first.
+    for (current = sequence > header->capacity ? sequence - header->capacity : 0;
+         current < sequence;
+         current++) {
+        const struct audit_record *slot = &ring[current % header->capacity];
+        struct audit_record        record;
+
+        // Skip records that were overwritten or are still being written,
+        // including any that changed while they were copied.
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != current + 1) {
+            continue;
+        }
+
+        memcpy(&record, slot, sizeof record);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != current + 1) {
+            continue;
+        }
+
+        printf("{\"sequence\":%llu,\"timestamp\":%llu.%09llu,\"pid\":%u,"
+               "\"verdict\":\"%s\",\"reason\":\"%s\",\"section\":",
+               (unsigned long long) record.sequence,
+               (unsigned long long) record.timestamp / 1000000000,
+               (unsigned long long) record.timestamp % 1000000000,
+               record.pid,
+               record.verdict == AUDIT_VERDICT_ALLOW ? "allow" : "deny",
+               record.reason < AUDIT_REASON_MAX
+                    ? kAuditReasonNames[record.reason]
+                    : "unknown");
+        print_json_string(record.section, sizeof record.section);
+        printf(",\"mimetype\":");
+        print_json_string(record.mimetype, sizeof record.mimetype);
+        printf(",\"origin\":");
+        print_json_string(record.origin, sizeof record.origin);
+        printf("}\n");
+    }
+
+    munmap((void *) header, filestat.st_size);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    bool result = true;
+    int i;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s AUDITLOG...\n", *argv);
+        return EXIT_FAILURE;
+    }
+
+    for (i = 1; i < argc; i++) {
+        result &= dump_audit_log(argv[i]);
+    }
+
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,88 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Author: taviso@google.com
+//
+// Compile the system configuration into a policy image.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "npapi.h"
+#include "npfunctions.h"
+#include "config.h"
+#include "log.h"
+#include "image.h"
+#include "matcher.h"
+
+// Tells the configuration constructor not to parse anything, we do that
+// ourselves with the journal enabled.
+const bool config_compiler = true;
+
+int main(int argc, char **argv)
+{
+    struct registry compiled = { .journal = true };
+    const char *output = NSSECURITY_IMAGE_PATH;
+    const char *source = NULL;
+    FILE *file;
+    bool result;
+    int c;
+
+    while ((c = getopt(argc, argv, "o:c:")) != -1) {
+        switch (c) {
+            case 'o':
+                output = optarg;
+                break;
+            case 'c':
+                source = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-o IMAGE] [-c MATCHER.c]\n", *argv);
+                return EXIT_FAILURE;
+        }
+    }
+
+    log_set_verbosity(getenv(NSSECURITY_LOG_ENV));
+
+    if (!config_load(&compiled, false)) {
+        fprintf(stderr, "%s: failed to parse %s\n", *argv, NSSECURITY_PATH);
+        return EXIT_FAILURE;
+    }
+
+    // Generate the source of a PolicyModule instead, see matcher.c.
+    if (source) {
+        if (!(file = strcmp(source, "-") ? fopen(source, "w") : stdout)) {
+            fprintf(stderr, "%s: failed to create %s\n", *argv, source);
+            return EXIT_FAILURE;
+        }
+
+        result = matcher_generate(&compiled, file);
+        result = (file == stdout ? fflush(file) : fclose(file)) == 0 && result;
+
+        config_destroy(&compiled);
+
+        return result ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    result = image_write(&compiled, output, NSSECURITY_PATH);
+
+    config_destroy(&compiled);
+
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,782 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Author: taviso@google.com
+//
+// Replay a session recorded with RecordFile against a plugin, without a
+// browser, and report the latency of each call.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <X11/Xlib.h>
+
+#include "npapi.h"
+#include "npfunctions.h"
+#include "histogram.h"
+#include "shim.h"
+
+#define RECORD_FORMAT_ONLY
+#include "record.h"
+
+#ifndef __unused
+# define __unused        __attribute__((unused))
+#endif
+
+// We pretend to be a browser that can't do much. Plugins that need to script
+// the page, fetch urls or draw into a real window will see errors, but most
+// of the expensive work (parsing streams, handling events) is still done.
+//
+// Window handles and notification data can't be recorded, so windows are
+// given a NULL handle, and the display pointer in replayed XEvents is
+// cleared. Events are only replayed with -e, because some plugins will
+// crash without a real display.
+
+static const char *kReplayNames[SHIM_MAX] = {
+    [SHIM_NEW]                  = "NPP_New",
+    [SHIM_DESTROY]              = "NPP_Destroy",
+    [SHIM_SETWINDOW]            = "NPP_SetWindow",
+    [SHIM_NEWSTREAM]            = "NPP_NewStream",
+    [SHIM_DESTROYSTREAM]        = "NPP_DestroyStream",
+    [SHIM_ASFILE]               = "NPP_StreamAsFile",
+    [SHIM_WRITEREADY]           = "NPP_WriteReady",
+    [SHIM_WRITE]                = "NPP_Write",
+    [SHIM_PRINT]                = "NPP_Print",
+    [SHIM_EVENT]                = "NPP_HandleEvent",
+    [SHIM_URLNOTIFY]            = "NPP_URLNotify",
+    [SHIM_GETVALUE]             = "NPP_GetValue",
+    [SHIM_SETVALUE]             = "NPP_SetValue",
+    [SHIM_GOTFOCUS]             = "NPP_GotFocus",
+    [SHIM_LOSTFOCUS]            = "NPP_LostFocus",
+    [SHIM_URLREDIRECTNOTIFY]    = "NPP_URLRedirectNotify",
+    [SHIM_CLEARSITEDATA]        = "NPP_ClearSiteData",
+    [SHIM_GETSITESWITHDATA]     = "NPP_GetSitesWithData",
+};
+
+// The recording identifies instances and streams by the browser's pointers,
+// these map them to the objects we created.
+struct replay_object {
+    uint64_t            id;
+    void               *object;
+};
+
+struct replay_map {
+    struct replay_object *objects;
+    size_t              count;
+};
+
+// Calls the plugin asked us to make with NPN_PluginThreadAsyncCall.
+struct replay_async {
+    void              (*function)(void *);
+    void               *param;
+};
+
+#define kReplayAsyncMax 256
+
+static struct replay_async replay_async[kReplayAsyncMax];
+static unsigned         replay_async_count;
+static NPPluginFuncs    replay_funcs;
+static struct histogram replay_latency[SHIM_MAX];
+static unsigned         replay_skipped;
+static unsigned         replay_incomplete;
+static bool             replay_events;
+
+static uint64_t replay_clock(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void *replay_map_find(struct replay_map *map, uint64_t id)
+{
+    size_t i;
+
+    for (i = 0; i < map->count; i++) {
+        if (map->objects[i].id == id) {
+            return map->objects[i].object;
+        }
+    }
+
+    return NULL;
+}
+
+static bool replay_map_insert(struct replay_map *map, uint64_t id, void *object)
+{
+    struct replay_object *objects;
+
+    if (!(objects = realloc(map->objects, (map->count + 1) * sizeof *objects))) {
+        return false;
+    }
+
+    map->objects = objects;
+    map->objects[map->count].id     = id;
+    map->objects[map->count].object = object;
+    map->count++;
+
+    return true;
+}
+
+static void replay_map_remove(struct replay_map *map, uint64_t id)
+{
+    size_t i;
+
+    for (i = 0; i < map->count; i++) {
+        if (map->objects[i].id == id) {
+            map->objects[i] = map->objects[--map->count];
+            return;
+        }
+    }
+}
+
+// The browser side of the API.
+static NPError replay_geturl(NPP instance __unused,
+                             const char *url __unused,
+                             const char *target __unused)
+{
+    return NPERR_GENERIC_ERROR;
+}
+
+static NPError replay_geturlnotify(NPP instance __unused,
+                                   const char *url __unused,
+                                   const char *target __unused,
+                                   void *notifyData __unused)
+{
+    return NPERR_GENERIC_ERROR;
+}
+
+static NPError replay_posturl(NPP instance __unused,
+                              const char *url __unused,
+                              const char *target __unused,
+                              uint32_t len __unused,
+                              const char *buf __unused,
+                              NPBool file __unused)
+{
+    return NPERR_GENERIC_ERROR;
+}
+
+static NPError replay_posturlnotify(NPP instance __unused,
+                                    const char *url __unused,
+                                    const char *target __unused,
+                                    uint32_t len __unused,
+                                    const char *buf __unused,
+                                    NPBool file __unused,
+                                    void *notifyData __unused)
+{
+    return NPERR_GENERIC_ERROR;
+}
+
+static void replay_status(NPP instance __unused, const char *message __unused)
+{
+    return;
+}
+
+static const char *replay_uagent(NPP instance __unused)
+{
+    return "Mozilla/5.0 (X11; Linux) nssecurity-replay/" NSSECURITY_VERSION;
+}
+
+static void *replay_memalloc(uint32_t size)
+{
+    return malloc(size);
+}
+
+static void replay_memfree(void *ptr)
+{
+    free(ptr);
+}
+
+static uint32_t replay_memflush(uint32_t size __unused)
+{
+    return 0;
+}
+
+static NPError replay_getvalue(NPP instance __unused,
+                               NPNVariable variable,
+                               void *value)
+{
+    switch (variable) {
+        case NPNVToolkit:
+            *(NPNToolkitType *) value = NPNVGtk2;
+            return NPERR_NO_ERROR;
+        case NPNVSupportsXEmbedBool:
+        case NPNVSupportsWindowless:
+            *(NPBool *) value = true;
+            return NPERR_NO_ERROR;
+        case NPNVprivateModeBool:
+            *(NPBool *) value = false;
+            return NPERR_NO_ERROR;
+        default:
+            return NPERR_GENERIC_ERROR;
+    }
+}
+
+static NPError replay_setvalue(NPP instance __unused,
+                               NPPVariable variable __unused,
+                               void *value __unused)
+{
+    return NPERR_NO_ERROR;
+}
+
+static void replay_invalidaterect(NPP instance __unused, NPRect *rect __unused)
+{
+    return;
+}
+
+static void replay_forceredraw(NPP instance __unused)
+{
+    return;
+}
+
+static void replay_releasevariantvalue(NPVariant *variant __unused)
+{
+    return;
+}
+
+static void replay_pluginthreadasynccall(NPP instance __unused,
+                                         void (*function)(void *),
+                                         void *param)
+{
+    if (replay_async_count < kReplayAsyncMax) {
+        replay_async[replay_async_count].function = function;
+        replay_async[replay_async_count].param    = param;
+        replay_async_count++;
+    }
+}
+
+static uint32_t replay_scheduletimer(NPP instance __unused,
+                                     uint32_t interval __unused,
+                                     NPBool repeat __unused,
+                                     void (*function)(NPP, uint32_t) __unused)
+{
+    return 0;
+}
+
+static void replay_unscheduletimer(NPP instance __unused, uint32_t timer __unused)
+{
+    return;
+}
+
+static NPNetscapeFuncs replay_browser = {
+    .size                   = sizeof(NPNetscapeFuncs),
+    .version                = (NP_VERSION_MAJOR << 8) | NP_VERSION_MINOR,
+    .geturl                 = replay_geturl,
+    .posturl                = replay_posturl,
+    .status                 = replay_status,
+    .uagent                 = replay_uagent,
+    .memalloc               = replay_memalloc,
+    .memfree                = replay_memfree,
+    .memflush               = replay_memflush,
+    .geturlnotify           = replay_geturlnotify,
+    .posturlnotify          = replay_posturlnotify,
+    .getvalue               = replay_getvalue,
+    .setvalue               = replay_setvalue,
+    .invalidaterect         = replay_invalidaterect,
+    .forceredraw            = replay_forceredraw,
+    .releasevariantvalue    = replay_releasevariantvalue,
+    .pluginthreadasynccall  = replay_pluginthreadasynccall,
+    .scheduletimer          = replay_scheduletimer,
+    .unscheduletimer        = replay_unscheduletimer,
+};
+
+// Read a length prefixed string from a payload, returns a new nul
+// terminated copy.
+static char *replay_string(const uint8_t **payload, const uint8_t *end)
+{
+    uint32_t length;
+    char *string;
+
+    if (end - *payload < (ptrdiff_t) sizeof length) {
+        return NULL;
+    }
+
+    memcpy(&length, *payload, sizeof length);
+
+    *payload += sizeof length;
+
+    if (end - *payload < (ptrdiff_t) length) {
+        return NULL;
+    }
+
+    if ((string = malloc(length + 1))) {
+        memcpy(string, *payload, length);
+        string[length] = '\0';
+    }
+
+    *payload += length;
+
+    return string;
+}
+
+// Make one recorded call, returns false if it couldn't be replayed.
+static bool replay_call(const struct record_header *header,
+                        const uint8_t *payload,
+                        struct replay_map *instances,
+                        struct replay_map *streams)
+{
+    const uint8_t *end = payload + header->length;
+    NPP            instance;
+    NPStream      *stream;
+
+    instance = replay_map_find(instances, header->instance);
+    stream   = replay_map_find(streams, header->stream);
+
+    if (header->entry != SHIM_NEW && !instance) {
+        return false;
+    }
+
+    switch (header->entry) {
+        case SHIM_NEW: {
+            struct record_new new;
+            char *argn[RECORD_ARGS_MAX] = {0};
+            char *argv[RECORD_ARGS_MAX] = {0};
+            char *type;
+            int16_t i;
+
+            if (header->length < sizeof new || !replay_funcs.newp) {
+                return false;
+            }
+
+            memcpy(&new, payload, sizeof new);
+
+            payload += sizeof new;
+            type     = replay_string(&payload, end);
+
+            for (i = 0; i < new.argc && i < RECORD_ARGS_MAX; i++) {
+                argn[i] = replay_string(&payload, end);
+                argv[i] = replay_string(&payload, end);
+            }
+
+            if (!(instance = calloc(1, sizeof *instance))) {
+                return false;
+            }
+
+            replay_map_insert(instances, header->instance, instance);
+
+            replay_funcs.newp(type, instance, new.mode, i, argn, argv, NULL);
+
+            // Plugins are allowed to keep pointers to these, so leak them.
+            return true;
+        }
+        case SHIM_DESTROY: {
+            NPSavedData *saved = NULL;
+
+            if (replay_funcs.destroy) {
+                replay_funcs.destroy(instance, &saved);
+            }
+
+            if (saved) {
+                free(saved->buf);
+                free(saved);
+            }
+
+            replay_map_remove(instances, header->instance);
+            free(instance);
+            return true;
+        }
+        case SHIM_SETWINDOW: {
+            struct record_setwindow geometry;
+            NPWindow window = {0};
+
+            if (header->length < sizeof geometry || !replay_funcs.setwindow) {
+                return false;
+            }
+
+            memcpy(&geometry, payload, sizeof geometry);
+
+            window.x                = geometry.x;
+            window.y                = geometry.y;
+            window.width            = geometry.width;
+            window.height           = geometry.height;
+            window.clipRect.top     = geometry.clip_top;
+            window.clipRect.left    = geometry.clip_left;
+            window.clipRect.bottom  = geometry.clip_bottom;
+            window.clipRect.right   = geometry.clip_right;
+            window.type             = geometry.type;
+
+            replay_funcs.setwindow(instance, &window);
+            return true;
+        }
+        case SHIM_NEWSTREAM: {
+            struct record_newstream opened;
+            uint16_t stype = NP_NORMAL;
+            char *type;
+
+            if (header->length < sizeof opened || !replay_funcs.newstream) {
+                return false;
+            }
+
+            memcpy(&opened, payload, sizeof opened);
+
+            payload += sizeof opened;
+            type     = replay_string(&payload, end);
+
+            if (!(stream = calloc(1, sizeof *stream))) {
+                return false;
+            }
+
+            stream->url          = replay_string(&payload, end);
+            stream->end          = opened.end;
+            stream->lastmodified = opened.lastmodified;
+
+            replay_map_insert(streams, header->stream, stream);
+
+            replay_funcs.newstream(instance, type, stream, opened.seekable, &stype);
+
+            free(type);
+            return true;
+        }
+        case SHIM_DESTROYSTREAM: {
+            struct record_destroystream destroyed;
+
+            if (header->length < sizeof destroyed || !stream) {
+                return false;
+            }
+
+            memcpy(&destroyed, payload, sizeof destroyed);
+
+            if (replay_funcs.destroystream) {
+                replay_funcs.destroystream(instance, stream, destroyed.reason);
+            }
+
+            replay_map_remove(streams, header->stream);
+            free((void *) stream->url);
+            free(stream);
+            return true;
+        }
+        case SHIM_ASFILE: {
+            char *fname;
+
+            if (!stream || !replay_funcs.asfile) {
+                return false;
+            }
+
+            fname = replay_string(&payload, end);
+
+            replay_funcs.asfile(instance, stream, fname);
+
+            free(fname);
+            return true;
+        }
+        case SHIM_WRITEREADY: {
+            if (!stream || !replay_funcs.writeready) {
+                return false;
+            }
+
+            replay_funcs.writeready(instance, stream);
+            return true;
+        }
+        case SHIM_WRITE: {
+            struct record_write written;
+            uint8_t *buffer;
+
+            if (header->length < sizeof written || !stream || !replay_funcs.write) {
+                return false;
+            }
+
+            memcpy(&written, payload, sizeof written);
+
+            payload += sizeof written;
+
+            if (written.length < 0
+                    || written.saved > (uint32_t) written.length
+                    || end - payload < (ptrdiff_t) written.saved) {
+                return false;
+            }
+
+            // If we didn't save everything, the rest is zero.
+            if (!(buffer = calloc(1, written.length + 1))) {
+                return false;
+            }
+
+            memcpy(buffer, payload, written.saved);
+
+            if (written.saved < (uint32_t) written.length) {
+                replay_incomplete++;
+            }
+
+            replay_funcs.write(instance, stream, written.offset, written.length, buffer);
+
+            free(buffer);
+            return true;
+        }
+        case SHIM_EVENT: {
+            XEvent event;
+
+            if (!replay_events
+                    || header->length != sizeof event
+                    || !replay_funcs.event) {
+                return false;
+            }
+
+            memcpy(&event, payload, sizeof event);
+
+            event.xany.display = NULL;
+
+            replay_funcs.event(instance, &event);
+            return true;
+        }
+        case SHIM_URLNOTIFY: {
+            struct record_urlnotify notify;
+            char *url;
+
+            if (header->length < sizeof notify || !replay_funcs.urlnotify) {
+                return false;
+            }
+
+            memcpy(&notify, payload, sizeof notify);
+
+            payload += sizeof notify;
+            url      = replay_string(&payload, end);
+
+            replay_funcs.urlnotify(instance, url, notify.reason, NULL);
+
+            free(url);
+            return true;
+        }
+        case SHIM_GETVALUE: {
+            struct record_getvalue value;
+            uint8_t scratch[64] = {0};
+
+            if (header->length < sizeof value || !replay_funcs.getvalue) {
+                return false;
+            }
+
+            memcpy(&value, payload, sizeof value);
+
+            replay_funcs.getvalue(instance, value.variable, scratch);
+            return true;
+        }
+        case SHIM_GOTFOCUS: {
+            struct record_gotfocus focus;
+
+            if (header->length < sizeof focus || !replay_funcs.gotfocus) {
+                return false;
+            }
+
+            memcpy(&focus, payload, sizeof focus);
+
+            replay_funcs.gotfocus(instance, focus.direction);
+            return true;
+        }
+        case SHIM_LOSTFOCUS: {
+            if (!replay_funcs.lostfocus) {
+                return false;
+            }
+
+            replay_funcs.lostfocus(instance);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void print_report(uint64_t elapsed, unsigned calls)
+{
+    struct histogram *latency;
+    unsigned entry;
+
+    printf("%-24s %8s %10s %10s %10s %12s\n",
+           "entry",
+           "calls",
+           "p50",
+           "p99",
+           "max",
+           "total");
+
+    for (entry = 0; entry < SHIM_MAX; entry++) {
+        latency = &replay_latency[entry];
+
+        if (!latency->count) {
+            continue;
+        }
+
+        printf("%-24s %8llu %8lluns %8lluns %8lluns %10llums\n",
+               kReplayNames[entry],
+               (unsigned long long) latency->count,
+               (unsigned long long) histogram_percentile(latency, 50),
+               (unsigned long long) histogram_percentile(latency, 99),
+               (unsigned long long) latency->max,
+               (unsigned long long) latency->total / 1000000);
+    }
+
+    printf("\n%u calls replayed in %llums, %u skipped, %u writes with incomplete data\n",
+           calls,
+           (unsigned long long) elapsed / 1000000,
+           replay_skipped,
+           replay_incomplete);
+}
+
+static void print_usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-e] [-s SPEED] PLUGIN RECORDING\n", name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Replay a session recorded with RecordFile against PLUGIN, and report the\n");
+    fprintf(stderr, "latency of each entry point.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -e        Also replay events, some plugins will crash without a display.\n");
+    fprintf(stderr, "  -s SPEED  Replay with the original timing, at SPEED times the original\n");
+    fprintf(stderr, "            rate. The default is 0, as fast as possible.\n");
+}
+
+int main(int argc, char **argv)
+{
+    NPError (*np_initialize)(NPNetscapeFuncs *, NPPluginFuncs *);
+    NPError (*np_shutdown)(void);
+    struct replay_map instances = {0};
+    struct replay_map streams = {0};
+    struct record_header header;
+    struct record_file file;
+    uint8_t *payload = NULL;
+    uint64_t start;
+    uint64_t now;
+    uint64_t elapsed;
+    unsigned calls = 0;
+    double speed = 0;
+    void *handle;
+    FILE *input;
+    int c;
+
+    while ((c = getopt(argc, argv, "es:h")) != -1) {
+        switch (c) {
+            case 'e':
+                replay_events = true;
+                break;
+            case 's':
+                speed = strtod(optarg, NULL);
+                break;
+            default:
+                print_usage(*argv);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 2) {
+        print_usage(*argv);
+        return EXIT_FAILURE;
+    }
+
+    if (!(input = fopen(argv[optind + 1], "r"))) {
+        fprintf(stderr, "nssecurity-replay: cannot open %s\n", argv[optind + 1]);
+        return EXIT_FAILURE;
+    }
+
+    if (fread(&file, sizeof file, 1, input) != 1
+            || file.magic != RECORD_MAGIC
+            || file.version != RECORD_VERSION) {
+        fprintf(stderr, "nssecurity-replay: %s is not a compatible recording\n",
+                argv[optind + 1]);
+        return EXIT_FAILURE;
+    }
+
+    // Events recorded by a browser with a different word size can't be used.
+    if (replay_events && file.event_size != sizeof(XEvent)) {
+        fprintf(stderr, "nssecurity-replay: events in %s are from another "
+                        "architecture, ignoring them\n", argv[optind + 1]);
+        replay_events = false;
+    }
+
+    if (!(handle = dlopen(argv[optind], RTLD_NOW | RTLD_LOCAL))) {
+        fprintf(stderr, "nssecurity-replay: %s\n", dlerror());
+        return EXIT_FAILURE;
+    }
+
+    np_initialize = dlsym(handle, "NP_Initialize");
+    np_shutdown   = dlsym(handle, "NP_Shutdown");
+
+    if (!np_initialize) {
+        fprintf(stderr, "nssecurity-replay: %s is not a plugin\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    replay_funcs.size = sizeof replay_funcs;
+
+    if (np_initialize(&replay_browser, &replay_funcs) != NPERR_NO_ERROR) {
+        fprintf(stderr, "nssecurity-replay: NP_Initialize failed\n");
+        return EXIT_FAILURE;
+    }
+
+    start = replay_clock();
+
+    while (fread(&header, sizeof header, 1, input) == 1) {
+        if (header.length > RECORD_PAYLOAD_MAX * 2) {
+            fprintf(stderr, "nssecurity-replay: corrupt record, stopping\n");
+            break;
+        }
+
+        if (!(payload = realloc(payload, header.length + 1))) {
+            break;
+        }
+
+        if (header.length && fread(payload, header.length, 1, input) != 1) {
+            fprintf(stderr, "nssecurity-replay: truncated record, stopping\n");
+            break;
+        }
+
+        // Wait until this call is due.
+        if (speed > 0) {
+            now = replay_clock() - start;
+
+            if (header.timestamp / speed > now) {
+                elapsed = header.timestamp / speed - now;
+                usleep(elapsed / 1000);
+            }
+        }
+
+        if (header.entry >= SHIM_MAX) {
+            replay_skipped++;
+            continue;
+        }
+
+        now = replay_clock();
+
+        if (!replay_call(&header, payload, &instances, &streams)) {
+            replay_skipped++;
+            continue;
+        }
+
+        histogram_record(&replay_latency[header.entry], replay_clock() - now);
+
+        calls++;
+
+        // Run anything the plugin asked to be called on the main thread.
+        while (replay_async_count) {
+            struct replay_async async = replay_async[--replay_async_count];
+            async.function(async.param);
+        }
+    }
+
+    elapsed = replay_clock() - start;
+
+    if (np_shutdown) {
+        np_shutdown();
+    }
+
+    print_report(elapsed, calls);
+
+    free(payload);
+    fclose(input);
+
+    return EXIT_SUCCESS;
+}
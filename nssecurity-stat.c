@@ -0,0 +1,414 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Author: taviso@google.com
+//
+// Aggregate and display the statistics published by every browser process
+// using the wrapper.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "npapi.h"
+#include "histogram.h"
+#include "shim.h"
+#include "stats.h"
+
+// Where the segments can be discovered.
+static const char kShmDirectory[] = "/dev/shm";
+
+// The totals across all processes for one plugin section.
+struct plugin_total {
+    char                section[STATS_SECTION_MAX];
+    unsigned            processes;
+    uint64_t            allowed;
+    uint64_t            denied;
+    uint64_t            instances;
+    uint64_t            stream_bytes;
+    uint64_t            cpu_time;
+    uint64_t            wall_time;
+    uint64_t            stalls;
+    uint64_t            module_bytes;
+    int64_t             heap_live;
+    uint64_t            heap_peak;
+    struct histogram    wrapper;
+    struct histogram    plugin;
+};
+
+// The counters of one process that are shown as changes in each interval.
+// They're kept per process, so that one exiting doesn't make a total go
+// backwards.
+struct process_total {
+    uint32_t            pid;
+    uint64_t            start_time;
+    uint64_t            resolve_hits;
+    uint64_t            resolve_misses;
+    uint64_t            stream_bytes;
+    uint64_t            log_suppressed;
+    uint64_t            log_dropped;
+    uint64_t            allowed;
+    uint64_t            denied;
+};
+
+// Maximum number of processes that interval changes are tracked for.
+#define kMaxProcesses   4096
+
+// The totals across all processes.
+struct total {
+    unsigned            processes;
+    uint64_t            instances_live;
+    uint64_t            instances_peak;
+    unsigned            plugin_count;
+    struct plugin_total plugins[STATS_MAX_PLUGINS * 4];
+    unsigned            process_count;
+    struct process_total process[kMaxProcesses];
+};
+
+static struct plugin_total *find_plugin_total(struct total *total,
+                                              const char *section)
+{
+    unsigned i;
+
+    for (i = 0; i < total->plugin_count; i++) {
+        if (strncmp(total->plugins[i].section, section, STATS_SECTION_MAX) == 0) {
+            return &total->plugins[i];
+        }
+    }
+
+    if (total->plugin_count >= sizeof total->plugins / sizeof *total->plugins) {
+        return NULL;
+    }
+
+    strncpy(total->plugins[i].section, section, STATS_SECTION_MAX - 1);
+
+    return &total->plugins[total->plugin_count++];
+}
+
+static void merge_segment(struct total *total, const struct stats_segment *segment)
+{
+    struct process_total *process = NULL;
+    unsigned i;
+    unsigned entry;
+
+    if (total->process_count < kMaxProcesses) {
+        process = &total->process[total->process_count++];
+
+        process->pid            = segment->pid;
+        process->start_time     = segment->start_time;
+        process->resolve_hits   = segment->resolve_hits;
+        process->resolve_misses = segment->resolve_misses;
+        process->stream_bytes   = segment->stream_bytes;
+        process->log_suppressed = segment->log_suppressed;
+        process->log_dropped    = segment->log_dropped;
+    }
+
+    total->processes++;
+    total->instances_live   += segment->instances_live;
+    total->instances_peak   += segment->instances_peak;
+
+    for (i = 0; i < segment->plugin_count && i < STATS_MAX_PLUGINS; i++) {
+        const struct stats_plugin *source = &segment->plugins[i];
+        struct plugin_total       *plugin;
+
+        if (!(plugin = find_plugin_total(total, source->section))) {
+            continue;
+        }
+
+        plugin->processes++;
+        plugin->allowed      += source->allowed;
+        plugin->denied       += source->denied;
+        plugin->instances    += source->instances;
+        plugin->stream_bytes += source->stream_bytes;
+        plugin->cpu_time     += source->cpu_time;
+        plugin->wall_time    += source->wall_time;
+        plugin->stalls       += source->stalls;
+        plugin->module_bytes += source->module_bytes;
+        plugin->heap_live    += source->heap_live;
+        plugin->heap_peak    += source->heap_peak;
+
+        if (process) {
+            process->allowed += source->allowed;
+            process->denied  += source->denied;
+        }
+
+        for (entry = 0; entry < SHIM_MAX; entry++) {
+            histogram_merge(&plugin->wrapper, &source->latency.wrapper[entry]);
+            histogram_merge(&plugin->plugin, &source->latency.plugin[entry]);
+        }
+    }
+}
+
+// Discover every live segment on this machine, and aggregate them.
+static bool collect_segments(struct total *total)
+{
+    struct dirent *entry;
+    DIR           *directory;
+
+    memset(total, 0, sizeof *total);
+
+    if (!(directory = opendir(kShmDirectory))) {
+        fprintf(stderr, "nssecurity-stat: cannot open %s\n", kShmDirectory);
+        return false;
+    }
+
+    while ((entry = readdir(directory))) {
+        struct stats_segment *segment;
+        char                  name[sizeof entry->d_name + 1];
+        struct stat           info;
+        char                 *end;
+        long                  pid;
+        int                   fd;
+
+        if (strncmp(entry->d_name, STATS_PREFIX, strlen(STATS_PREFIX)) != 0) {
+            continue;
+        }
+
+        pid = strtol(entry->d_name + strlen(STATS_PREFIX), &end, 10);
+
+        // Skip segments left behind by processes that no longer exist.
+        if (*end != '\0' || (kill(pid, 0) != 0 && errno != EPERM)) {
+            continue;
+        }
+
+        snprintf(name, sizeof name, "/%s", entry->d_name);
+
+        if ((fd = shm_open(name, O_RDONLY, 0)) < 0) {
+            continue;
+        }
+
+        // A segment that is still being created, or is from an older
+        // version, may be too small, and reading past the end would fault.
+        if (fstat(fd, &info) != 0 || info.st_size < (off_t) sizeof *segment) {
+            close(fd);
+            continue;
+        }
+
+        segment = mmap(NULL, sizeof *segment, PROT_READ, MAP_SHARED, fd, 0);
+
+        close(fd);
+
+        if (segment == MAP_FAILED) {
+            continue;
+        }
+
+        // Verify this is a layout we understand.
+        if (segment->magic == STATS_MAGIC
+                && segment->version == STATS_VERSION
+                && segment->size == sizeof *segment) {
+            merge_segment(total, segment);
+        } else {
+            fprintf(stderr, "nssecurity-stat: skipping incompatible segment %s\n",
+                    name);
+        }
+
+        munmap(segment, sizeof *segment);
+    }
+
+    closedir(directory);
+    return true;
+}
+
+static void print_plugins(const struct total *total)
+{
+    unsigned i;
+
+    printf("%-32s %5s %8s %8s %6s %10s %10s %10s %10s %6s %9s %8s %8s %10s %10s\n",
+           "section",
+           "procs",
+           "allowed",
+           "denied",
+           "inst",
+           "streamKB",
+           "calls",
+           "cpu.ms",
+           "wall.ms",
+           "stalls",
+           "moduleKB",
+           "heapKB",
+           "peakKB",
+           "wrap.p99",
+           "plug.p99");
+
+    for (i = 0; i < total->plugin_count; i++) {
+        const struct plugin_total *plugin = &total->plugins[i];
+
+        printf("%-32.32s %5u %8llu %8llu %6llu %10llu %10llu %10llu %10llu %6llu %9llu %8lld %8llu %9lluns %9lluns\n",
+               plugin->section,
+               plugin->processes,
+               (unsigned long long) plugin->allowed,
+               (unsigned long long) plugin->denied,
+               (unsigned long long) plugin->instances,
+               (unsigned long long) plugin->stream_bytes / 1024,
+               (unsigned long long) plugin->wrapper.count,
+               (unsigned long long) plugin->cpu_time / 1000000,
+               (unsigned long long) plugin->wall_time / 1000000,
+               (unsigned long long) plugin->stalls,
+               (unsigned long long) plugin->module_bytes / 1024,
+               (long long) plugin->heap_live / 1024,
+               (unsigned long long) plugin->heap_peak / 1024,
+               (unsigned long long) histogram_percentile(&plugin->wrapper, 99),
+               (unsigned long long) histogram_percentile(&plugin->plugin, 99));
+    }
+}
+
+static void print_header(void)
+{
+    printf("%5s %6s %6s %8s %8s %6s %10s %8s %8s\n",
+           "procs",
+           "live",
+           "peak",
+           "allow",
+           "deny",
+           "hit%",
+           "streamKB",
+           "suppress",
+           "dropped");
+}
+
+// The increase in a counter, which is never negative.
+static uint64_t counter_change(uint64_t current, uint64_t previous)
+{
+    return current > previous ? current - previous : 0;
+}
+
+// Sum the changes of every process since previous. A process that has exited
+// since then is left out, and a new one counts everything it has done.
+static void process_changes(const struct total *current,
+                            const struct total *previous,
+                            struct process_total *changes)
+{
+    static const struct process_total zero;
+    const struct process_total *process;
+    const struct process_total *before;
+    unsigned i;
+    unsigned j;
+
+    memset(changes, 0, sizeof *changes);
+
+    for (i = 0; i < current->process_count; i++) {
+        process = &current->process[i];
+        before  = &zero;
+
+        for (j = 0; previous && j < previous->process_count; j++) {
+            if (previous->process[j].pid == process->pid
+                    && previous->process[j].start_time == process->start_time) {
+                before = &previous->process[j];
+                break;
+            }
+        }
+
+        changes->resolve_hits   += counter_change(process->resolve_hits, before->resolve_hits);
+        changes->resolve_misses += counter_change(process->resolve_misses, before->resolve_misses);
+        changes->stream_bytes   += counter_change(process->stream_bytes, before->stream_bytes);
+        changes->log_suppressed += counter_change(process->log_suppressed, before->log_suppressed);
+        changes->log_dropped    += counter_change(process->log_dropped, before->log_dropped);
+        changes->allowed        += counter_change(process->allowed, before->allowed);
+        changes->denied         += counter_change(process->denied, before->denied);
+    }
+}
+
+// Print a line of totals, or the change since previous if specified.
+static void print_totals(const struct total *current, const struct total *previous)
+{
+    struct process_total changes;
+    uint64_t hits;
+    uint64_t misses;
+
+    process_changes(current, previous, &changes);
+
+    hits   = changes.resolve_hits;
+    misses = changes.resolve_misses;
+
+    printf("%5u %6llu %6llu %8llu %8llu %6.1f %10llu %8llu %8llu\n",
+           current->processes,
+           (unsigned long long) current->instances_live,
+           (unsigned long long) current->instances_peak,
+           (unsigned long long) changes.allowed,
+           (unsigned long long) changes.denied,
+           hits + misses ? 100.0 * hits / (hits + misses) : 100.0,
+           (unsigned long long) changes.stream_bytes / 1024,
+           (unsigned long long) changes.log_suppressed,
+           (unsigned long long) changes.log_dropped);
+}
+
+int main(int argc, char **argv)
+{
+    static struct total current;
+    static struct total previous;
+    unsigned interval;
+    unsigned count;
+    unsigned i;
+
+    if (argc > 3 || (argc > 1 && strcmp(argv[1], "-h") == 0)) {
+        fprintf(stderr, "usage: %s [INTERVAL [COUNT]]\n", *argv);
+        fprintf(stderr, "\n");
+        fprintf(stderr, "Without arguments, print totals and a summary of each plugin.\n");
+        fprintf(stderr, "With an INTERVAL, print totals every INTERVAL seconds, like vmstat.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!collect_segments(&current)) {
+        return EXIT_FAILURE;
+    }
+
+    if (argc == 1) {
+        print_header();
+        print_totals(&current, NULL);
+        printf("\n");
+        print_plugins(&current);
+        return EXIT_SUCCESS;
+    }
+
+    interval = strtoul(argv[1], NULL, 0);
+    count    = argc > 2 ? strtoul(argv[2], NULL, 0) : 0;
+
+    if (interval == 0) {
+        fprintf(stderr, "nssecurity-stat: invalid interval %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    // The first line is totals since each process started, subsequent lines
+    // are the changes in each interval.
+    print_header();
+    print_totals(&current, NULL);
+
+    for (i = 1; count == 0 || i < count; i++) {
+        sleep(interval);
+
+        previous = current;
+
+        if (!collect_segments(&current)) {
+            return EXIT_FAILURE;
+        }
+
+        if (i % 20 == 0) {
+            print_header();
+        }
+
+        print_totals(&current, &previous);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -10,5 +10,14 @@ char * platform_getname(void);
 char * platform_getdescription(void);
 char * platform_getversion(void);
 void platform_dlclose(void *handle);
+bool platform_module_info(void *handle,
+                          uintptr_t *start,
+                          uintptr_t *end,
+                          size_t *mapped);
+unsigned platform_patch_imports(void *handle,
+                                const char *names[],
+                                void *replacements[],
+                                void *originals[],
+                                unsigned count);
 
 #endif
@@ -4,5 +4,11 @@
 bool policy_plugin_allowed_domain(struct plugin *plugin, char *url);
 bool policy_plugin_allowed_protocol(struct plugin *plugin, char *url);
 bool policy_plugin_allowed_url(struct plugin *plugin, char *url);
+bool policy_compile(struct arena *arena,
+                    struct plugin *plugin,
+                    const struct plugin *global);
+bool policy_compile_networks(struct arena *arena, struct plugin *plugin);
+uint64_t policy_allowed_set(const struct registry *registry, const char *url);
+bool policy_boolean(const char *section, const char *name, const char *value);
 
 #endif
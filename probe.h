@@ -0,0 +1,30 @@
+#ifndef __PROBE_H
+#define __PROBE_H
+
+// Static tracepoints for perf, bpftrace and SystemTap. On Linux, when
+// sys/sdt.h is available, each probe is a single nop instruction plus an ELF
+// note describing where to find the arguments. Tracers patch the nop when
+// they attach, so an unused probe costs nothing. Elsewhere they compile away.
+//
+// All probes belong to the provider "nssecurity", list them with:
+//
+//  $ bpftrace -l 'usdt:/path/to/netscapesecuritywrapper.so:*'
+//
+// See the bpftrace directory for examples.
+
+#if defined(HAVE_SYS_SDT_H)
+# include <sys/sdt.h>
+# define PROBE(name)                    DTRACE_PROBE(nssecurity, name)
+# define PROBE1(name, a)                DTRACE_PROBE1(nssecurity, name, a)
+# define PROBE2(name, a, b)             DTRACE_PROBE2(nssecurity, name, a, b)
+# define PROBE3(name, a, b, c)          DTRACE_PROBE3(nssecurity, name, a, b, c)
+# define PROBE4(name, a, b, c, d)       DTRACE_PROBE4(nssecurity, name, a, b, c, d)
+#else
+# define PROBE(name)                    do { } while (false)
+# define PROBE1(name, a)                do { (void)(a); } while (false)
+# define PROBE2(name, a, b)             do { (void)(a); (void)(b); } while (false)
+# define PROBE3(name, a, b, c)          do { (void)(a); (void)(b); (void)(c); } while (false)
+# define PROBE4(name, a, b, c, d)       do { (void)(a); (void)(b); (void)(c); (void)(d); } while (false)
+#endif
+
+#endif
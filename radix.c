@@ -0,0 +1,299 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Author: taviso@google.com
+//
+// Match IP literals against a tree of allowed networks.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#define LOG_MODULE LOG_MODULE_POLICY
+#define _GNU_SOURCE     // strndupa()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <arpa/inet.h>
+
+#include "log.h"
+#include "npapi.h"
+#include "npfunctions.h"
+#include "config.h"
+#include "arena.h"
+#include "radix.h"
+
+// Intranet sites are often reached by address rather than name, and globs
+// like 10.4.* are both slow and imprecise, matching 10.4.example.com too.
+// Instead, AllowedNetworks lists networks in CIDR notation:
+//
+//      AllowedNetworks=10.4.0.0/16,192.168.1.5,2001:db8::/32
+//
+// which are inserted into a binary trie, one level per bit of the address.
+// Chains of nodes with only one child are collapsed into a single node that
+// records the whole prefix, so the tree has at most two nodes per network, and
+// a lookup compares each bit of the address at most once.
+
+static const uint8_t kMappedPrefix[12] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff,
+};
+
+static uint32_t radix_bit(const uint8_t *address, uint32_t bit)
+{
+    return address[bit / 8] >> (7 - bit % 8) & 1;
+}
+
+// Return the first bit in [from, to) where a and b differ, or to if they're
+// the same.
+static uint32_t radix_common(const uint8_t *a,
+                             const uint8_t *b,
+                             uint32_t from,
+                             uint32_t to)
+{
+    uint32_t bit;
+    uint32_t difference;
+
+    for (bit = from; bit < to; bit = (bit & ~7) + 8) {
+        difference = (a[bit / 8] ^ b[bit / 8]) & (0xff >> bit % 8);
+
+        if (difference) {
+            bit = (bit & ~7) + __builtin_clz(difference) - 24;
+            return bit < to ? bit : to;
+        }
+    }
+
+    return to;
+}
+
+// Parse an IPv4 or IPv6 address, without brackets.
+bool radix_address(const char *string, uint8_t *address)
+{
+    if (strchr(string, ':')) {
+        return inet_pton(AF_INET6, string, address) == 1;
+    }
+
+    memcpy(address, kMappedPrefix, sizeof kMappedPrefix);
+
+    return inet_pton(AF_INET, string, address + sizeof kMappedPrefix) == 1;
+}
+
+// Parse a network in CIDR notation. If there is no length, it's a single
+// address. Any bits of the address beyond the length are cleared.
+bool radix_network(const char *string, uint8_t *prefix, uint32_t *length)
+{
+    const char *separator = strchr(string, '/');
+    char       *address = strndupa(string, strcspn(string, "/"));
+    uint32_t    maximum;
+    uint32_t    bit;
+
+    if (!radix_address(address, prefix)) {
+        return false;
+    }
+
+    maximum = strchr(address, ':') ? RADIX_ADDRESS_BITS : 32;
+    *length = maximum;
+
+    if (separator) {
+        if (strlen(++separator) < 1
+                || strlen(separator) > 3
+                || strspn(separator, "0123456789") != strlen(separator)
+                || (*length = strtoul(separator, NULL, 10)) > maximum) {
+            return false;
+        }
+    }
+
+    // IPv4 networks are within ::ffff:0:0/96.
+    *length += RADIX_ADDRESS_BITS - maximum;
+
+    for (bit = *length; bit < RADIX_ADDRESS_BITS; bit++) {
+        prefix[bit / 8] &= ~(0x80 >> bit % 8);
+    }
+
+    return true;
+}
+
+static struct radix_node *radix_node_new(struct arena *arena,
+                                         const uint8_t *prefix,
+                                         uint32_t length,
+                                         bool terminal)
+{
+    struct radix_node *node;
+    uint32_t           bit;
+
+    if (!(node = arena_alloc(arena, sizeof *node))) {
+        return NULL;
+    }
+
+    memcpy(node->prefix, prefix, sizeof node->prefix);
+
+    for (bit = length; bit < RADIX_ADDRESS_BITS; bit++) {
+        node->prefix[bit / 8] &= ~(0x80 >> bit % 8);
+    }
+
+    node->length   = length;
+    node->terminal = terminal;
+
+    return node;
+}
+
+// Add the network prefix/length to the tree at root.
+bool radix_insert(struct arena *arena,
+                  struct radix_node **root,
+                  const uint8_t *prefix,
+                  uint32_t length)
+{
+    struct radix_node **link = root;
+    struct radix_node  *node;
+    struct radix_node  *split;
+    uint32_t            common;
+    uint32_t            from = 0;
+
+    while ((node = *link)) {
+        common = radix_common(node->prefix,
+                              prefix,
+                              from,
+                              node->length < length ? node->length : length);
+
+        // The new network diverges from this node, or ends inside it, so the
+        // node has to be split where that happens.
+        if (common < node->length) {
+            if (!(split = radix_node_new(arena, prefix, common, common == length)))
+                return false;
+
+            split->child[radix_bit(node->prefix, common)] = node;
+
+            if (common < length
+                    && !(split->child[radix_bit(prefix, common)]
+                            = radix_node_new(arena, prefix, length, true)))
+                return false;
+
+            *link = split;
+            return true;
+        }
+
+        // If this network is already covered, there is nothing to add.
+        if (node->terminal) {
+            return true;
+        }
+
+        if (node->length == length) {
+            node->terminal = true;
+            return true;
+        }
+
+        from = node->length;
+        link = &node->child[radix_bit(prefix, node->length)];
+    }
+
+    return (*link = radix_node_new(arena, prefix, length, true)) != NULL;
+}
+
+// Check if address is within any network in the tree at root.
+bool radix_match(const struct radix_node *node, const uint8_t *address)
+{
+    uint32_t from = 0;
+
+    while (node) {
+        if (radix_common(node->prefix, address, from, node->length) != node->length)
+            return false;
+
+        if (node->terminal)
+            return true;
+
+        if (node->length == RADIX_ADDRESS_BITS)
+            return false;
+
+        from = node->length;
+        node = node->child[radix_bit(address, node->length)];
+    }
+
+    return false;
+}
+
+#if defined(ENABLE_RUNTIME_TESTS)
+
+// Compare the tree with checking every network in turn.
+static void __constructor test_radix(void)
+{
+    static const char *kNetworks[] = {
+        "10.4.0.0/16", "10.4.2.0/24", "10.5.1.1", "10.0.0.0/7", "192.168.1.5",
+        "192.168.1.4/31", "172.16.0.0/12", "2001:db8::/32", "2001:db8:1::/48",
+        "fe80::1", "4000::/2", "0.0.0.0/32", "10.4.2.7/8",
+    };
+    static const char *kInvalid[] = {
+        "10.4", "10.4.0.0/33", "2001:db8::/129", "10.4.0.0/", "10.4.0.0/1a",
+        "010.4.0.1", "www.google.com", "10.4.0.0/-1", "fe80::1%eth0", "",
+    };
+    struct arena      *arena = arena_create(4096);
+    struct radix_node *root;
+    uint8_t            prefixes[sizeof kNetworks / sizeof *kNetworks][RADIX_ADDRESS_SIZE];
+    uint32_t           lengths[sizeof kNetworks / sizeof *kNetworks];
+    uint8_t            address[RADIX_ADDRESS_SIZE];
+    uint8_t            prefix[RADIX_ADDRESS_SIZE];
+    uint32_t           length;
+    bool               expected;
+    unsigned           count;
+    unsigned           i;
+    unsigned           j;
+
+    for (i = 0; i < sizeof kInvalid / sizeof *kInvalid; i++) {
+        assert(radix_network(kInvalid[i], prefix, &length) == false);
+    }
+
+    assert(radix_network("10.4.2.7/8", prefix, &length) == true);
+    assert(length == 104);
+    assert(radix_address("10.0.0.0", address) == true);
+    assert(memcmp(prefix, address, sizeof prefix) == 0);
+    assert(radix_address("::ffff:10.0.0.0", address) == true);
+    assert(memcmp(prefix, address, sizeof prefix) == 0);
+
+    // Insert the networks in every rotation, so that nodes are split in
+    // different orders.
+    for (count = 0; count < sizeof kNetworks / sizeof *kNetworks; count++) {
+        root = NULL;
+
+        for (i = 0; i <= count; i++) {
+            j = (i + count) % (count + 1);
+            assert(radix_network(kNetworks[j], prefixes[i], &lengths[i]) == true);
+            assert(radix_insert(arena, &root, prefixes[i], lengths[i]) == true);
+        }
+
+        // Random addresses are almost all in ::/1, so test addresses near
+        // each network, and some that aren't.
+        for (i = 0; i < 4096; i++) {
+            memcpy(address, prefixes[i % (count + 1)], sizeof address);
+
+            address[rand() % sizeof address] ^= 1 << rand() % 8;
+            address[0] |= i & 0x80;
+
+            for (expected = false, j = 0; j <= count && !expected; j++) {
+                expected = radix_common(prefixes[j], address, 0, lengths[j]) == lengths[j];
+            }
+
+            assert(radix_match(root, address) == expected);
+        }
+    }
+
+    assert(radix_address("10.4.2.7", address) && radix_match(root, address));
+    assert(radix_address("11.4.2.7", address) && radix_match(root, address));
+    assert(radix_address("12.0.0.1", address) && !radix_match(root, address));
+    assert(radix_address("2001:db8:ffff::1", address) && radix_match(root, address));
+    assert(radix_address("fe80::2", address) && !radix_match(root, address));
+    assert(radix_match(NULL, address) == false);
+
+    arena_destroy(arena);
+}
+
+#endif
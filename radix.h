@@ -0,0 +1,24 @@
+#ifndef __RADIX_H
+#define __RADIX_H
+
+// A path compressed binary trie of the networks in AllowedNetworks. Every
+// address is stored as IPv6, IPv4 addresses are mapped into ::ffff:0:0/96.
+#define RADIX_ADDRESS_SIZE      16
+#define RADIX_ADDRESS_BITS      (RADIX_ADDRESS_SIZE * 8)
+
+struct radix_node {
+    uint8_t             prefix[RADIX_ADDRESS_SIZE];
+    uint8_t             length;         // significant bits of the prefix.
+    bool                terminal;       // a network ends here.
+    struct radix_node  *child[2];       // indexed by the next bit.
+};
+
+bool radix_address(const char *string, uint8_t *address);
+bool radix_network(const char *string, uint8_t *prefix, uint32_t *length);
+bool radix_insert(struct arena *arena,
+                  struct radix_node **root,
+                  const uint8_t *prefix,
+                  uint32_t length);
+bool radix_match(const struct radix_node *root, const uint8_t *address);
+
+#endif
@@ -0,0 +1,486 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Author: taviso@google.com
+//
+// Recording sessions of calls from the browser, for nssecurity-replay.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#define LOG_MODULE LOG_MODULE_CORE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#if !defined(XP_MACOSX)
+# include <X11/Xlib.h>
+#endif
+
+#include "npapi.h"
+#include "npfunctions.h"
+#include "config.h"
+#include "log.h"
+#include "histogram.h"
+#include "shim.h"
+#include "record.h"
+#include "util.h"
+
+// Performance problems with plugins usually depend on the page, and are hard
+// to reproduce without the customer's browser. If a RecordFile is configured,
+// the shims record every call forwarded to a plugin, with enough of the
+// arguments to make the same calls again later. nssecurity-replay then loads
+// the plugin without a browser and replays the session, so a real page
+// becomes a repeatable performance test.
+//
+// Stream data is usually the largest part of a session, so only the first
+// RecordPayload bytes of each NPP_Write are saved, along with a hash of the
+// whole buffer. The default is to save none.
+//
+// Things that only make sense inside the browser, like window handles and
+// notification data, are not recorded.
+
+static FILE            *record_file;
+static uint64_t         record_start;
+static uint32_t         record_payload_max;
+static pthread_mutex_t  record_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The record being built.
+static uint8_t         *record_data;
+static size_t           record_size;
+static size_t           record_capacity;
+static bool             record_failed;
+
+bool record_enabled;
+
+static void record_append(const void *data, size_t length)
+{
+    uint8_t *resized;
+
+    if (record_size + length > record_capacity) {
+        size_t capacity = record_capacity ? record_capacity : 4096;
+
+        while (capacity < record_size + length)
+            capacity *= 2;
+
+        if (!(resized = realloc(record_data, capacity))) {
+            record_failed = true;
+            return;
+        }
+
+        record_data     = resized;
+        record_capacity = capacity;
+    }
+
+    memcpy(record_data + record_size, data, length);
+
+    record_size += length;
+}
+
+static void record_string(const char *string)
+{
+    uint32_t length = string ? strnlen(string, RECORD_STRING_MAX) : 0;
+
+    record_append(&length, sizeof length);
+    record_append(string, length);
+}
+
+// Start a new record, the mutex is held until record_finish().
+static void record_begin(unsigned entry, NPP instance, NPStream *stream)
+{
+    struct record_header header = {
+        .entry      = entry,
+        .instance   = (uintptr_t) instance,
+        .stream     = (uintptr_t) stream,
+    };
+
+    pthread_mutex_lock(&record_mutex);
+
+    header.timestamp = shim_clock() - record_start;
+
+    record_size   = 0;
+    record_failed = false;
+
+    record_append(&header, sizeof header);
+}
+
+static void record_finish(void)
+{
+    struct record_header *header = (struct record_header *) record_data;
+
+    if (record_file && !record_failed) {
+        header->length = record_size - sizeof *header;
+
+        if (fwrite(record_data, record_size, 1, record_file) != 1) {
+            l_warning("failed to write to recording, recording stopped");
+            record_enabled = false;
+        }
+    }
+
+    pthread_mutex_unlock(&record_mutex);
+}
+
+// FNV-1a, so the replay can tell whether the saved payload was complete.
+static uint64_t record_hash(const uint8_t *data, size_t length)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    while (length--) {
+        hash ^= *data++;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+void record_new(NPP instance, NPMIMEType type, uint16_t mode,
+                int16_t argc, char *argn[], char *argv[])
+{
+    struct record_new payload = {
+        .mode   = mode,
+        .argc   = argc < 0 ? 0 : argc > RECORD_ARGS_MAX ? RECORD_ARGS_MAX : argc,
+    };
+    int16_t i;
+
+    record_begin(SHIM_NEW, instance, NULL);
+    record_append(&payload, sizeof payload);
+    record_string(type);
+
+    for (i = 0; i < payload.argc; i++) {
+        record_string(argn[i]);
+        record_string(argv[i]);
+    }
+
+    record_finish();
+}
+
+void record_destroy(NPP instance)
+{
+    record_begin(SHIM_DESTROY, instance, NULL);
+    record_finish();
+}
+
+void record_setwindow(NPP instance, NPWindow *window)
+{
+    struct record_setwindow payload = {0};
+
+    if (window) {
+        payload.x           = window->x;
+        payload.y           = window->y;
+        payload.width       = window->width;
+        payload.height      = window->height;
+        payload.clip_top    = window->clipRect.top;
+        payload.clip_left   = window->clipRect.left;
+        payload.clip_bottom = window->clipRect.bottom;
+        payload.clip_right  = window->clipRect.right;
+        payload.type        = window->type;
+    }
+
+    record_begin(SHIM_SETWINDOW, instance, NULL);
+    record_append(&payload, sizeof payload);
+    record_finish();
+}
+
+void record_newstream(NPP instance, NPMIMEType type, NPStream *stream,
+                      NPBool seekable)
+{
+    struct record_newstream payload = {
+        .end            = stream ? stream->end : 0,
+        .lastmodified   = stream ? stream->lastmodified : 0,
+        .seekable       = seekable,
+    };
+
+    record_begin(SHIM_NEWSTREAM, instance, stream);
+    record_append(&payload, sizeof payload);
+    record_string(type);
+    record_string(stream ? stream->url : NULL);
+    record_finish();
+}
+
+void record_destroystream(NPP instance, NPStream *stream, NPReason reason)
+{
+    struct record_destroystream payload = {
+        .reason = reason,
+    };
+
+    record_begin(SHIM_DESTROYSTREAM, instance, stream);
+    record_append(&payload, sizeof payload);
+    record_finish();
+}
+
+void record_asfile(NPP instance, NPStream *stream, const char *fname)
+{
+    record_begin(SHIM_ASFILE, instance, stream);
+    record_string(fname);
+    record_finish();
+}
+
+void record_writeready(NPP instance, NPStream *stream)
+{
+    record_begin(SHIM_WRITEREADY, instance, stream);
+    record_finish();
+}
+
+void record_write(NPP instance, NPStream *stream, int32_t offset,
+                  int32_t length, void *buffer)
+{
+    struct record_write payload = {
+        .offset = offset,
+        .length = length,
+    };
+
+    if (buffer && length > 0) {
+        payload.hash  = record_hash(buffer, length);
+        payload.saved = (uint32_t) length < record_payload_max
+                            ? (uint32_t) length
+                            : record_payload_max;
+    }
+
+    record_begin(SHIM_WRITE, instance, stream);
+    record_append(&payload, sizeof payload);
+    record_append(buffer, payload.saved);
+    record_finish();
+}
+
+void record_event(NPP instance, void *event)
+{
+    record_begin(SHIM_EVENT, instance, NULL);
+
+    // On Apple the event structures are different sizes, so we can't
+    // safely copy them.
+#if !defined(XP_MACOSX)
+    if (event) {
+        record_append(event, sizeof(XEvent));
+    }
+#endif
+
+    record_finish();
+}
+
+void record_urlnotify(NPP instance, const char *url, NPReason reason)
+{
+    struct record_urlnotify payload = {
+        .reason = reason,
+    };
+
+    record_begin(SHIM_URLNOTIFY, instance, NULL);
+    record_append(&payload, sizeof payload);
+    record_string(url);
+    record_finish();
+}
+
+void record_getvalue(NPP instance, NPPVariable variable)
+{
+    struct record_getvalue payload = {
+        .variable = variable,
+    };
+
+    record_begin(SHIM_GETVALUE, instance, NULL);
+    record_append(&payload, sizeof payload);
+    record_finish();
+}
+
+void record_gotfocus(NPP instance, NPFocusDirection direction)
+{
+    struct record_gotfocus payload = {
+        .direction = direction,
+    };
+
+    record_begin(SHIM_GOTFOCUS, instance, NULL);
+    record_append(&payload, sizeof payload);
+    record_finish();
+}
+
+void record_lostfocus(NPP instance)
+{
+    record_begin(SHIM_LOSTFOCUS, instance, NULL);
+    record_finish();
+}
+
+// A child would interleave records with ours.
+static void record_atfork_child(void)
+{
+    record_enabled = false;
+    record_file    = NULL;
+}
+
+// Start recording to prefix.<pid>.nsrec, saving at most payload_max bytes of
+// each write.
+bool record_open(const char *prefix, uint32_t payload_max)
+{
+    static bool registered;
+    struct record_file header = {
+        .magic          = RECORD_MAGIC,
+        .version        = RECORD_VERSION,
+#if !defined(XP_MACOSX)
+        .event_size     = sizeof(XEvent),
+#endif
+        .payload_max    = payload_max < RECORD_PAYLOAD_MAX
+                                ? payload_max
+                                : RECORD_PAYLOAD_MAX,
+        .pid            = getpid(),
+        .start_time     = time(NULL),
+    };
+    char path[PATH_MAX];
+
+    record_close();
+
+    if (!registered) {
+        pthread_atfork(NULL, NULL, record_atfork_child);
+        registered = true;
+    }
+
+    snprintf(path, sizeof path, "%s.%u.%s", prefix, getpid(), RECORD_SUFFIX);
+
+    pthread_mutex_lock(&record_mutex);
+
+    if (!(record_file = file_create_private(path))) {
+        pthread_mutex_unlock(&record_mutex);
+        l_warning("failed to open recording %s, %m", path);
+        return false;
+    }
+
+    fwrite(&header, sizeof header, 1, record_file);
+
+    record_payload_max = header.payload_max;
+    record_start       = shim_clock();
+    record_enabled     = true;
+
+    pthread_mutex_unlock(&record_mutex);
+
+    l_debug("recording calls to %s", path);
+
+    return true;
+}
+
+void record_close(void)
+{
+    record_enabled = false;
+
+    pthread_mutex_lock(&record_mutex);
+
+    if (record_file) {
+        fclose(record_file);
+    }
+
+    record_file = NULL;
+
+    free(record_data);
+
+    record_data     = NULL;
+    record_size     = 0;
+    record_capacity = 0;
+
+    pthread_mutex_unlock(&record_mutex);
+}
+
+static void __destructor fini_record(void)
+{
+    record_close();
+}
+
+#if defined(ENABLE_RUNTIME_TESTS)
+
+static void __constructor test_record(void)
+{
+    char prefix[] = "/tmp/nssecurity-record-test-XXXXXX";
+    char path[sizeof prefix + 32];
+    char *argn[] = { "src", "width" };
+    char *argv[] = { "movie.swf", "100" };
+    NPStream stream = {
+        .url    = "https://www.foo.com/movie.swf",
+        .end    = 8,
+    };
+    uint8_t data[8] = "abcdefg";
+    struct record_file file;
+    struct record_header header;
+    struct record_new created;
+    struct record_newstream opened;
+    struct record_write written;
+    uint32_t length;
+    char string[64];
+    struct stat info;
+    FILE *input;
+    int fd;
+
+    assert((fd = mkstemp(prefix)) >= 0);
+    close(fd);
+    unlink(prefix);
+
+    sprintf(path, "%s.%u.%s", prefix, getpid(), RECORD_SUFFIX);
+
+    assert(record_open(prefix, 4) == true);
+
+    record(new, (NPP) 0x10, "application/x-test", NP_EMBED, 2, argn, argv);
+    record(newstream, (NPP) 0x10, "application/x-test", &stream, false);
+    record(write, (NPP) 0x10, &stream, 0, sizeof data, data);
+    record(destroy, (NPP) 0x10);
+
+    record_close();
+
+    // This should be ignored.
+    record(destroy, (NPP) 0x10);
+
+    assert(stat(path, &info) == 0 && (info.st_mode & 0777) == 0600);
+    assert((input = fopen(path, "r")));
+
+    assert(fread(&file, sizeof file, 1, input) == 1);
+    assert(file.magic == RECORD_MAGIC);
+    assert(file.payload_max == 4);
+
+    assert(fread(&header, sizeof header, 1, input) == 1);
+    assert(header.entry == SHIM_NEW);
+    assert(header.instance == 0x10);
+    assert(fread(&created, sizeof created, 1, input) == 1);
+    assert(created.argc == 2);
+    assert(fread(&length, sizeof length, 1, input) == 1);
+    assert(length == strlen("application/x-test"));
+    assert(fread(string, length, 1, input) == 1);
+    assert(fseek(input, header.length - sizeof created - sizeof length - length, SEEK_CUR) == 0);
+
+    assert(fread(&header, sizeof header, 1, input) == 1);
+    assert(header.entry == SHIM_NEWSTREAM);
+    assert(header.stream == (uintptr_t) &stream);
+    assert(fread(&opened, sizeof opened, 1, input) == 1);
+    assert(opened.end == 8);
+    assert(fseek(input, header.length - sizeof opened, SEEK_CUR) == 0);
+
+    assert(fread(&header, sizeof header, 1, input) == 1);
+    assert(header.entry == SHIM_WRITE);
+    assert(fread(&written, sizeof written, 1, input) == 1);
+    assert(written.length == 8);
+    assert(written.saved == 4);
+    assert(written.hash == record_hash(data, sizeof data));
+    assert(header.length == sizeof written + 4);
+    assert(fread(string, 4, 1, input) == 1);
+    assert(memcmp(string, "abcd", 4) == 0);
+
+    assert(fread(&header, sizeof header, 1, input) == 1);
+    assert(header.entry == SHIM_DESTROY);
+    assert(header.length == 0);
+
+    assert(fread(&header, sizeof header, 1, input) == 0);
+
+    fclose(input);
+    unlink(path);
+}
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef __RECORD_H
+#define __RECORD_H
+
+// The format of a recorded session, shared with nssecurity-replay. A file
+// contains a record_file header, followed by a sequence of records, each a
+// record_header followed by length bytes of payload. Any change must bump
+// the version.
+//
+// All integers are in host byte order, strings are a uint32_t length
+// followed by that many bytes, without a terminator.
+
+#define RECORD_MAGIC            0x5253534e      // "NSSR"
+#define RECORD_VERSION          1
+#define RECORD_SUFFIX           "nsrec"
+
+// Limits on anything we copy from the browser.
+#define RECORD_STRING_MAX       4096
+#define RECORD_ARGS_MAX         64
+#define RECORD_PAYLOAD_MAX      65536
+
+struct record_file {
+    uint32_t            magic;
+    uint16_t            version;
+    uint16_t            event_size;     // sizeof(XEvent) when recorded.
+    uint32_t            payload_max;
+    uint32_t            pid;
+    uint64_t            start_time;
+};
+
+// The entry is one of the SHIM_ constants in shim.h, timestamp is
+// nanoseconds since the start of the recording. Instances and streams are
+// identified by the pointers the browser used, which are only meaningful
+// within the recording.
+struct record_header {
+    uint16_t            entry;
+    uint16_t            reserved;
+    uint32_t            length;
+    uint64_t            timestamp;
+    uint64_t            instance;
+    uint64_t            stream;
+};
+
+// Payloads, followed by any strings or data described.
+struct record_new {
+    uint16_t            mode;
+    int16_t             argc;
+    // mimetype, then argc pairs of argn, argv.
+};
+
+struct record_setwindow {
+    int32_t             x;
+    int32_t             y;
+    uint32_t            width;
+    uint32_t            height;
+    uint16_t            clip_top;
+    uint16_t            clip_left;
+    uint16_t            clip_bottom;
+    uint16_t            clip_right;
+    uint32_t            type;
+};
+
+struct record_newstream {
+    uint32_t            end;
+    uint32_t            lastmodified;
+    uint8_t             seekable;
+    // type, url.
+};
+
+struct record_write {
+    int32_t             offset;
+    int32_t             length;
+    uint64_t            hash;
+    uint32_t            saved;
+    // saved bytes of data.
+};
+
+struct record_destroystream {
+    int16_t             reason;
+};
+
+struct record_urlnotify {
+    int16_t             reason;
+    // url.
+};
+
+struct record_getvalue {
+    uint32_t            variable;
+};
+
+struct record_gotfocus {
+    int32_t             direction;
+};
+
+#if !defined(RECORD_FORMAT_ONLY)
+
+extern bool record_enabled;
+
+// Record a call that is about to be forwarded to a plugin, recording is off
+// unless a RecordFile is configured, and then this is a predictable branch.
+#define record(name, args...) do {                                      \
+        if (__builtin_expect(record_enabled, 0))                        \
+            record_##name(args);                                        \
+    } while (false)
+
+bool record_open(const char *prefix, uint32_t payload_max);
+void record_close(void);
+void record_new(NPP instance, NPMIMEType type, uint16_t mode,
+                int16_t argc, char *argn[], char *argv[]);
+void record_destroy(NPP instance);
+void record_setwindow(NPP instance, NPWindow *window);
+void record_newstream(NPP instance, NPMIMEType type, NPStream *stream,
+                      NPBool seekable);
+void record_destroystream(NPP instance, NPStream *stream, NPReason reason);
+void record_asfile(NPP instance, NPStream *stream, const char *fname);
+void record_writeready(NPP instance, NPStream *stream);
+void record_write(NPP instance, NPStream *stream, int32_t offset,
+                  int32_t length, void *buffer);
+void record_event(NPP instance, void *event);
+void record_urlnotify(NPP instance, const char *url, NPReason reason);
+void record_getvalue(NPP instance, NPPVariable variable);
+void record_gotfocus(NPP instance, NPFocusDirection direction);
+void record_lostfocus(NPP instance);
+
+#endif
+
+#endif
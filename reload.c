@@ -0,0 +1,392 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Author: taviso@google.com
+//
+// Apply configuration changes without restarting the browser.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#define LOG_MODULE LOG_MODULE_CONFIG
+#define _GNU_SOURCE     // pipe2()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <assert.h>
+#include <pthread.h>
+
+#if defined(__linux__)
+# include <sys/inotify.h>
+#endif
+
+#include "npapi.h"
+#include "npfunctions.h"
+#include "config.h"
+#include "policy.h"
+#include "platform.h"
+#include "log.h"
+#include "reload.h"
+
+// When HotReload is enabled, a thread watches the configuration files, and
+// builds a new registry whenever they change. The new registry is published
+// with a single pointer store, calls already in progress keep using the old
+// one, which is retired rather than freed.
+//
+// A retired registry is freed once two things are true. Every call that might
+// have loaded the old pointer has returned, which we know once the count of
+// calls in progress has been seen at zero after the swap. And no instance
+// still refers to one of its plugin records, which instance.c counts.
+//
+// Plugins present in both registries keep the state the browser gave them in
+// NP_Initialize(). Plugins added by a reload are loaded, but not used until
+// the browser is restarted, and plugins removed stay loaded until exit, as
+// the browser is the only thing that can safely shut them down.
+
+uint32_t reload_readers;
+
+// Wait this long after a change before reloading, editors often write a file
+// in several steps.
+static const int kReloadSettleMs    = 250;
+
+// How often to check whether a retired registry can be freed.
+static const int kReloadReclaimMs   = 1000;
+
+static struct registry *reload_retired;
+static pthread_t        reload_thread;
+static bool             reload_running;
+static int              reload_inotify = -1;
+static int              reload_wakeup[2] = { -1, -1 };
+
+// Make fresh the current registry, and retire the one it replaces.
+static void reload_publish(struct registry *fresh)
+{
+    struct registry *current = registry_current();
+
+    __atomic_store_n(&global_registry, fresh, __ATOMIC_RELEASE);
+
+    current->retired = reload_retired;
+    reload_retired   = current;
+}
+
+// Build a new registry from the configuration files, and replace the current
+// one if it parsed successfully. This should only be called from one thread.
+bool reload_registry(void)
+{
+    struct registry *current = registry_current();
+    struct registry *fresh;
+
+    if (!(fresh = calloc(1, sizeof *fresh))) {
+        l_error("memory allocation failure");
+        return false;
+    }
+
+    fresh->allocated      = true;
+    fresh->netscape_funcs = current->netscape_funcs;
+    fresh->previous       = current;
+
+    if (!config_load(fresh, true)) {
+        l_warning("failed to reload configuration, the current policy is unchanged");
+        config_destroy(fresh);
+        free(fresh);
+        return false;
+    }
+
+    fresh->previous = NULL;
+
+    reload_publish(fresh);
+
+    // The environment still overrides any LogLevel in the new configuration.
+    log_set_verbosity(getenv(NSSECURITY_LOG_ENV));
+
+    l_message("configuration reloaded, %u plugin sections", fresh->section_count);
+
+    return true;
+}
+
+// Check if a plugin library is used by the current registry.
+static bool reload_handle_live(void *handle)
+{
+    struct plugin *current;
+
+    for (current = registry_current()->plugins; current; current = current->next) {
+        if (current->handle == handle)
+            return true;
+    }
+
+    return false;
+}
+
+// Free any retired registries that nothing can still be using.
+void reload_reclaim(void)
+{
+    struct registry **link;
+    struct registry  *retired;
+    struct plugin    *current;
+    bool              allocated;
+
+    // Make sure the swap is visible before checking for calls in progress,
+    // any call that starts after this sees the new registry.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&reload_readers, __ATOMIC_ACQUIRE) == 0) {
+        for (retired = reload_retired; retired; retired = retired->retired) {
+            retired->quiescent = true;
+        }
+    }
+
+    for (link = &reload_retired; (retired = *link);) {
+        if (!retired->quiescent
+                || __atomic_load_n(&retired->instances, __ATOMIC_ACQUIRE)) {
+            link = &retired->retired;
+            continue;
+        }
+
+        *link = retired->retired;
+
+        // A plugin that was removed from the configuration has been
+        // initialised by the browser, so it can't be unloaded.
+        for (current = retired->plugins; current; current = current->next) {
+            if (current->handle
+                    && current->plugin_funcs
+                    && !reload_handle_live(current->handle)) {
+                l_message("plugin %s was removed, it stays loaded until the browser exits",
+                          current->section);
+                current->handle = NULL;
+            }
+        }
+
+        allocated = retired->allocated;
+
+        config_destroy(retired);
+
+        if (allocated)
+            free(retired);
+    }
+}
+
+#if defined(__linux__)
+
+// Check if an event is for one of our configuration files.
+static bool reload_event_relevant(const struct inotify_event *event)
+{
+    return event->len
+        && (strcmp(event->name, strrchr(NSSECURITY_PATH, '/') + 1) == 0
+         || strcmp(event->name, strrchr(NSSECURITY_IMAGE_PATH, '/') + 1) == 0
+         || strcmp(event->name, NSSECURITY_USER_PATH) == 0);
+}
+
+static void *reload_worker(void *param __unused)
+{
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2] = {
+        { .fd = reload_inotify,     .events = POLLIN },
+        { .fd = reload_wakeup[0],   .events = POLLIN },
+    };
+    const struct inotify_event *event;
+    bool    pending = false;
+    ssize_t length;
+    char   *position;
+    int     ready;
+
+    while (true) {
+        ready = poll(fds, 2, pending ? kReloadSettleMs : kReloadReclaimMs);
+
+        // Asked to stop.
+        if (ready > 0 && fds[1].revents) {
+            break;
+        }
+
+        if (ready > 0 && (fds[0].revents & POLLIN)) {
+            if ((length = read(reload_inotify, buffer, sizeof buffer)) <= 0) {
+                continue;
+            }
+
+            for (position = buffer; position < buffer + length;
+                 position += sizeof *event + event->len) {
+                event = (const void *) position;
+
+                if (reload_event_relevant(event)) {
+                    l_debug("configuration file %s changed", event->name);
+                    pending = true;
+                }
+            }
+
+            // Wait for the changes to settle.
+            continue;
+        }
+
+        if (ready == 0 && pending) {
+            pending = false;
+            reload_registry();
+        }
+
+        reload_reclaim();
+    }
+
+    return NULL;
+}
+
+// Start watching the configuration files, if HotReload is set.
+bool reload_start(void)
+{
+    struct registry *current = registry_current();
+    char            *directory;
+
+    if (reload_running) {
+        return true;
+    }
+
+    if (!current->global
+            || !current->global->hot_reload
+            || !policy_boolean("Global", "HotReload", current->global->hot_reload)) {
+        return false;
+    }
+
+    if ((reload_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        l_warning("failed to watch configuration files, %m");
+        return false;
+    }
+
+    // Watch directories rather than files, because editors often replace a
+    // file by renaming a new one over it.
+    directory = strndupa(NSSECURITY_PATH, strrchr(NSSECURITY_PATH, '/') - NSSECURITY_PATH);
+
+    if (inotify_add_watch(reload_inotify,
+                          directory,
+                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE) < 0) {
+        l_warning("failed to watch %s, %m", directory);
+        goto failure;
+    }
+
+    if (pipe2(reload_wakeup, O_CLOEXEC) != 0) {
+        l_warning("failed to create pipe, %m");
+        goto failure;
+    }
+
+    if (pthread_create(&reload_thread, NULL, reload_worker, NULL) != 0) {
+        l_warning("failed to create reload thread");
+        goto failure;
+    }
+
+    reload_running = true;
+
+    l_debug("watching %s for changes", directory);
+
+    return true;
+
+  failure:
+    close(reload_inotify);
+    close(reload_wakeup[0]);
+    close(reload_wakeup[1]);
+    reload_inotify   = -1;
+    reload_wakeup[0] = reload_wakeup[1] = -1;
+    return false;
+}
+
+#else
+
+bool reload_start(void)
+{
+    return false;
+}
+
+#endif
+
+// Stop watching, and free every retired registry. This is only called when
+// the browser has finished with us.
+void reload_stop(void)
+{
+    struct registry *retired;
+
+    if (reload_running) {
+        if (write(reload_wakeup[1], "", 1) != 1) {
+            l_warning("failed to wake reload thread, %m");
+        }
+
+        pthread_join(reload_thread, NULL);
+
+        close(reload_inotify);
+        close(reload_wakeup[0]);
+        close(reload_wakeup[1]);
+
+        reload_inotify   = -1;
+        reload_wakeup[0] = reload_wakeup[1] = -1;
+        reload_running   = false;
+    }
+
+    for (retired = reload_retired; retired; retired = retired->retired) {
+        retired->quiescent = true;
+        retired->instances = 0;
+    }
+
+    reload_reclaim();
+}
+
+#if defined(ENABLE_RUNTIME_TESTS)
+
+#include "instance.h"
+
+static void __constructor test_reload(void)
+{
+    struct registry *saved = global_registry;
+    struct registry *retired = calloc(1, sizeof *retired);
+    struct registry *fresh = calloc(1, sizeof *fresh);
+    struct plugin   *plugin;
+    NPP_t            instance;
+
+    assert(retired && fresh);
+
+    retired->allocated = true;
+    fresh->allocated   = true;
+
+    assert(find_plugin_section(retired, "Retired", &plugin) == true);
+    assert(plugin->registry == retired);
+
+    global_registry = retired;
+
+    // A call is in progress, so the retired registry can't be freed.
+    reload_enter();
+    reload_publish(fresh);
+
+    assert(registry_current() == fresh);
+
+    reload_reclaim();
+    assert(reload_retired == retired && !retired->quiescent);
+
+    // Nor while an instance refers to one of its plugins.
+    assert(netscape_instance_map(&instance, plugin) == true);
+    assert(retired->instances == 1);
+
+    reload_leave();
+    reload_reclaim();
+    assert(reload_retired == retired && retired->quiescent);
+
+    assert(netscape_instance_destroy(&instance) == true);
+    assert(retired->instances == 0);
+
+    reload_reclaim();
+    assert(reload_retired == NULL);
+
+    global_registry = saved;
+
+    config_destroy(fresh);
+    free(fresh);
+}
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef __RELOAD_H
+#define __RELOAD_H
+
+// The number of calls from the browser in progress. A registry replaced by
+// reload_registry() isn't freed until this has been seen at zero, so calls
+// never have to lock anything to use the registry.
+extern uint32_t reload_readers;
+
+#define reload_enter() __atomic_add_fetch(&reload_readers, 1, __ATOMIC_SEQ_CST)
+#define reload_leave() __atomic_sub_fetch(&reload_readers, 1, __ATOMIC_RELEASE)
+
+bool reload_start(void);
+void reload_stop(void);
+bool reload_registry(void);
+void reload_reclaim(void);
+
+#endif
@@ -0,0 +1,435 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Author: taviso@google.com
+//
+// Instrumentation of calls through the NPP shims.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#define LOG_MODULE LOG_MODULE_SHIM
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "npapi.h"
+#include "npfunctions.h"
+#include "config.h"
+#include "histogram.h"
+#include "shim.h"
+#include "stats.h"
+#include "probe.h"
+#include "trace.h"
+#include "instance.h"
+#include "watchdog.h"
+#include "flight.h"
+#include "reload.h"
+
+// Every call from the browser passes through one of the shims in netscape.c,
+// which bracket the call like this:
+//
+//      shim_enter()        the browser called us.
+//      shim_forward()      we're passing control to the wrapped plugin.
+//      shim_return()       the wrapped plugin returned.
+//      shim_leave()        we're returning to the browser.
+//
+// This lets us measure the time spent in the wrapper separately from the time
+// spent in the plugin. A shim that doesn't pass the call through (because the
+// instance was unknown, or policy denied it) only calls enter and leave.
+//
+// Each of these is also a static probe, see probe.h:
+//
+//      shim__entry(entry, instance)
+//      plugin__entry(entry, instance, section)
+//      plugin__return(entry, instance, section, elapsed)
+//      shim__return(entry, instance, section, elapsed)
+//
+// The section is NULL if the call was never forwarded to a plugin, elapsed
+// is in nanoseconds.
+//
+// If a TraceFile is configured, the shim and the plugin call are also
+// recorded as nested slices in the timeline, see trace.c.
+//
+// Wall time spent in each plugin is always accumulated. If CpuReportInterval
+// is set, we also measure the cpu time used by the calling thread during each
+// forwarded call, and attribute it to the plugin section and instance. The
+// browser makes every NPP call from the plugin main thread, so this tells us
+// what share of that thread each plugin is using. This is opt-in because
+// reading the thread cpu clock is a system call.
+//
+// If WatchdogThreshold is set, the call currently forwarded to a plugin is
+// published as a heartbeat for the watchdog thread, see watchdog.c. Plugins
+// can call back into the browser, which can call another shim, so forwarded
+// calls can nest. We keep a chain of them so the outer call can be restored
+// when the inner one returns.
+//
+// Every call is also recorded in the crash flight recorder, see flight.c.
+
+const char *kShimNames[SHIM_MAX] = {
+    [SHIM_NEW]                  = "NPP_New",
+    [SHIM_DESTROY]              = "NPP_Destroy",
+    [SHIM_SETWINDOW]            = "NPP_SetWindow",
+    [SHIM_NEWSTREAM]            = "NPP_NewStream",
+    [SHIM_DESTROYSTREAM]        = "NPP_DestroyStream",
+    [SHIM_ASFILE]               = "NPP_StreamAsFile",
+    [SHIM_WRITEREADY]           = "NPP_WriteReady",
+    [SHIM_WRITE]                = "NPP_Write",
+    [SHIM_PRINT]                = "NPP_Print",
+    [SHIM_EVENT]                = "NPP_HandleEvent",
+    [SHIM_URLNOTIFY]            = "NPP_URLNotify",
+    [SHIM_GETVALUE]             = "NPP_GetValue",
+    [SHIM_SETVALUE]             = "NPP_SetValue",
+    [SHIM_GOTFOCUS]             = "NPP_GotFocus",
+    [SHIM_LOSTFOCUS]            = "NPP_LostFocus",
+    [SHIM_URLREDIRECTNOTIFY]    = "NPP_URLRedirectNotify",
+    [SHIM_CLEARSITEDATA]        = "NPP_ClearSiteData",
+    [SHIM_GETSITESWITHDATA]     = "NPP_GetSitesWithData",
+};
+
+// Monotonic time in nanoseconds, this is a vDSO call on Linux.
+uint64_t shim_clock(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// CPU time used by the calling thread in nanoseconds.
+uint64_t shim_thread_clock(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Nanoseconds between cpu reports, zero if cpu accounting is disabled.
+static uint64_t shim_cpu_interval;
+
+// When the next report is due, or zero if the interval hasn't started.
+static uint64_t shim_cpu_deadline;
+
+// The thread cpu clock, and the totals of each plugin, at the start of the
+// current interval.
+static uint64_t shim_cpu_thread;
+static struct {
+    uint64_t    cpu_time;
+    uint64_t    wall_time;
+} shim_cpu_previous[STATS_MAX_PLUGINS];
+
+// Enable cpu accounting, reporting every interval seconds.
+void shim_cpu_accounting(unsigned interval)
+{
+    shim_cpu_interval = interval * 1000000000ULL;
+    shim_cpu_deadline = 0;
+}
+
+// Print each plugin's share of the cpu time used by the calling thread since
+// the last report. This is called from the shims, so the calling thread is
+// the thread the browser uses to call plugins.
+static void shim_cpu_report(uint64_t now)
+{
+    uint64_t thread = shim_thread_clock();
+    uint64_t total = thread - shim_cpu_thread;
+    struct stats_plugin *stats;
+    uint64_t cpu_time;
+    uint64_t wall_time;
+    unsigned i;
+
+    // The first call just starts the interval.
+    if (shim_cpu_deadline) {
+        l_message("main thread used %llums cpu in the last %llus",
+                  (unsigned long long) total / 1000000,
+                  (unsigned long long) shim_cpu_interval / 1000000000);
+    }
+
+    for (i = 0; i < global_stats->plugin_count && i < STATS_MAX_PLUGINS; i++) {
+        stats     = &global_stats->plugins[i];
+        cpu_time  = stats->cpu_time - shim_cpu_previous[i].cpu_time;
+        wall_time = stats->wall_time - shim_cpu_previous[i].wall_time;
+
+        shim_cpu_previous[i].cpu_time  = stats->cpu_time;
+        shim_cpu_previous[i].wall_time = stats->wall_time;
+
+        if (!shim_cpu_deadline || !wall_time) {
+            continue;
+        }
+
+        l_message("%s used %.1f%% of main thread cpu, %llums cpu, %llums wall",
+                  stats->section,
+                  total ? 100.0 * cpu_time / total : 0.0,
+                  (unsigned long long) cpu_time / 1000000,
+                  (unsigned long long) wall_time / 1000000);
+    }
+
+    if (shim_cpu_deadline) {
+        netscape_instance_report();
+    }
+
+    shim_cpu_thread   = thread;
+    shim_cpu_deadline = now + shim_cpu_interval;
+}
+
+// The innermost call currently forwarded to a plugin.
+static struct shim_call *shim_active;
+
+// Find where to record statistics for this plugin, calls that were never
+// attributed to a plugin are recorded separately.
+static struct shim_stats *shim_plugin_stats(struct plugin *plugin)
+{
+    return plugin && plugin->stats ? &plugin->stats->latency
+                                   : &global_stats->unresolved;
+}
+
+void shim_enter(struct shim_call *call, unsigned entry, NPP instance)
+{
+    call->entry    = entry;
+    call->instance = instance;
+    call->plugin   = NULL;
+    call->elapsed  = 0;
+    call->forward  = 0;
+    call->cpu      = 0;
+    call->start    = shim_clock();
+    call->flight   = flight_begin(entry, instance, call->start);
+
+    // Keep any registry this call might use alive, see reload.c.
+    reload_enter();
+
+    PROBE2(shim__entry, entry, instance);
+
+    trace_begin(kShimNames[entry], "shim", NULL);
+}
+
+void shim_forward(struct shim_call *call, struct plugin *plugin)
+{
+    call->plugin  = plugin;
+    call->forward = shim_clock();
+
+    if (shim_cpu_interval) {
+        call->cpu = shim_thread_clock();
+    }
+
+    call->outer = shim_active;
+    shim_active = call;
+
+    call->flight->section = plugin->section;
+
+    if (watchdog_enabled) {
+        watchdog_heartbeat(call->entry, plugin, call->forward);
+    }
+
+    PROBE3(plugin__entry, call->entry, call->instance, plugin->section);
+
+    trace_begin(kShimNames[call->entry], "plugin", plugin->section);
+}
+
+void shim_return(struct shim_call *call)
+{
+    uint64_t cpu = shim_cpu_interval ? shim_thread_clock() - call->cpu : 0;
+    uint64_t elapsed = shim_clock() - call->forward;
+
+    shim_active = call->outer;
+
+    if (watchdog_enabled) {
+        if (shim_active) {
+            watchdog_heartbeat(shim_active->entry,
+                               shim_active->plugin,
+                               shim_active->forward);
+        } else {
+            watchdog_heartbeat(0, NULL, 0);
+        }
+    }
+
+    // Some shims call multiple plugins, so this is cumulative.
+    call->elapsed += elapsed;
+
+    histogram_record(&shim_plugin_stats(call->plugin)->plugin[call->entry],
+                     elapsed);
+
+    if (call->plugin->stats) {
+        stats_add(call->plugin->stats->wall_time, elapsed);
+    }
+
+    if (shim_cpu_interval) {
+        if (call->plugin->stats) {
+            stats_add(call->plugin->stats->cpu_time, cpu);
+        }
+
+        netscape_instance_account(call->instance, cpu, elapsed);
+    }
+
+    PROBE4(plugin__return,
+           call->entry,
+           call->instance,
+           call->plugin->section,
+           elapsed);
+
+    trace_end(kShimNames[call->entry], "plugin", call->plugin->section);
+}
+
+// Add details of the call to the flight recorder, the shims call this for
+// the interesting entry points.
+void shim_annotate(struct shim_call *call,
+                   const char *mimetype,
+                   NPStream *stream,
+                   int32_t offset,
+                   int32_t length)
+{
+    if (mimetype) {
+        strncpy(call->flight->mimetype, mimetype, FLIGHT_MIME_MAX - 1);
+        call->flight->mimetype[FLIGHT_MIME_MAX - 1] = '\0';
+    }
+
+    if (stream) {
+        call->flight->stream_end = stream->end;
+    }
+
+    call->flight->offset = offset;
+    call->flight->length = length;
+}
+
+void shim_leave(struct shim_call *call)
+{
+    uint64_t elapsed = shim_clock() - call->start;
+
+    // The record may have been reused if a lot of calls were nested.
+    if (call->flight->sequence && call->flight->start == call->start) {
+        call->flight->elapsed = elapsed ? elapsed : 1;
+    }
+
+    histogram_record(&shim_plugin_stats(call->plugin)->wrapper[call->entry],
+                     elapsed - call->elapsed);
+
+    PROBE4(shim__return,
+           call->entry,
+           call->instance,
+           call->plugin ? call->plugin->section : NULL,
+           elapsed);
+
+    trace_end(kShimNames[call->entry],
+              "shim",
+              call->plugin ? call->plugin->section : NULL);
+
+    if (shim_cpu_interval && call->start >= shim_cpu_deadline) {
+        shim_cpu_report(call->start);
+    }
+
+    reload_leave();
+}
+
+static void shim_report_stats(const char *section, struct shim_stats *stats)
+{
+    unsigned entry;
+
+    for (entry = 0; entry < SHIM_MAX; entry++) {
+        struct histogram *wrapper = &stats->wrapper[entry];
+        struct histogram *plugin  = &stats->plugin[entry];
+
+        if (!wrapper->count) {
+            continue;
+        }
+
+        l_debug("%s %s calls %llu, wrapper p50 %lluns p99 %lluns max %lluns, "
+                "plugin p50 %lluns p99 %lluns max %lluns",
+                section,
+                kShimNames[entry],
+                wrapper->count,
+                histogram_percentile(wrapper, 50),
+                histogram_percentile(wrapper, 99),
+                wrapper->max,
+                histogram_percentile(plugin, 50),
+                histogram_percentile(plugin, 99),
+                plugin->max);
+    }
+}
+
+// Print a summary of the latency histograms, this is only useful with
+// LogLevel=shim:debug.
+void shim_report(void)
+{
+    struct plugin *current;
+
+    if (!l_enabled(LOG_LEVEL_DEBUG)) {
+        return;
+    }
+
+    for (current = registry_current()->plugins; current; current = current->next) {
+        if (current->stats) {
+            shim_report_stats(current->section, &current->stats->latency);
+        }
+    }
+
+    shim_report_stats("<unresolved>", &global_stats->unresolved);
+}
+
+#if defined(ENABLE_RUNTIME_TESTS)
+
+static void __constructor test_shim_cpu(void)
+{
+    struct plugin plugin = {0};
+    struct shim_call call;
+    unsigned char saved[LOG_MODULE_MAX];
+    volatile unsigned i;
+    uint64_t start;
+
+    memcpy(saved, log_verbosity, sizeof saved);
+    log_set_verbosity("error");
+
+    plugin.section = "CPU Test";
+    plugin.stats   = stats_plugin_slot(plugin.section);
+
+    assert(plugin.stats);
+
+    shim_cpu_accounting(60);
+
+    // Spin in a fake plugin call.
+    shim_enter(&call, SHIM_EVENT, NULL);
+    shim_forward(&call, &plugin);
+        for (start = shim_thread_clock(); shim_thread_clock() - start < 2000000;)
+            for (i = 0; i < 1000; i++)
+                ;
+    shim_return(&call);
+    shim_leave(&call);
+
+    assert(plugin.stats->cpu_time >= 2000000);
+    assert(plugin.stats->wall_time >= plugin.stats->cpu_time);
+    assert(plugin.stats->latency.plugin[SHIM_EVENT].count == 1);
+    assert(shim_cpu_deadline > call.start);
+
+    // Without accounting, only wall time is recorded.
+    shim_cpu_accounting(0);
+
+    start = plugin.stats->cpu_time;
+
+    shim_enter(&call, SHIM_EVENT, NULL);
+    shim_forward(&call, &plugin);
+    shim_return(&call);
+    shim_leave(&call);
+
+    assert(plugin.stats->cpu_time == start);
+    assert(plugin.stats->latency.plugin[SHIM_EVENT].count == 2);
+
+    memcpy(log_verbosity, saved, sizeof saved);
+}
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef __SHIM_H
+#define __SHIM_H
+
+// Every NPP entry point we install in NP_GetEntryPoints().
+enum {
+    SHIM_NEW,
+    SHIM_DESTROY,
+    SHIM_SETWINDOW,
+    SHIM_NEWSTREAM,
+    SHIM_DESTROYSTREAM,
+    SHIM_ASFILE,
+    SHIM_WRITEREADY,
+    SHIM_WRITE,
+    SHIM_PRINT,
+    SHIM_EVENT,
+    SHIM_URLNOTIFY,
+    SHIM_GETVALUE,
+    SHIM_SETVALUE,
+    SHIM_GOTFOCUS,
+    SHIM_LOSTFOCUS,
+    SHIM_URLREDIRECTNOTIFY,
+    SHIM_CLEARSITEDATA,
+    SHIM_GETSITESWITHDATA,
+    SHIM_MAX,
+};
+
+// Latency of each entry point, split into the time spent in the wrapper
+// (resolving instances, evaluating policy, fetching urls) and the time spent
+// inside the wrapped plugin.
+struct shim_stats {
+    struct histogram    wrapper[SHIM_MAX];
+    struct histogram    plugin[SHIM_MAX];
+};
+
+// State for a single call through a shim, this lives on the stack of the
+// shim.
+struct shim_call {
+    unsigned            entry;
+    NPP                 instance;
+    struct plugin      *plugin;
+    uint64_t            start;
+    uint64_t            forward;
+    uint64_t            cpu;
+    uint64_t            elapsed;
+    struct shim_call   *outer;
+    struct flight_record *flight;
+};
+
+extern const char *kShimNames[SHIM_MAX];
+
+void shim_enter(struct shim_call *call, unsigned entry, NPP instance);
+void shim_forward(struct shim_call *call, struct plugin *plugin);
+void shim_return(struct shim_call *call);
+void shim_leave(struct shim_call *call);
+void shim_annotate(struct shim_call *call,
+                   const char *mimetype,
+                   NPStream *stream,
+                   int32_t offset,
+                   int32_t length);
+void shim_report(void);
+void shim_cpu_accounting(unsigned interval);
+uint64_t shim_clock(void);
+uint64_t shim_thread_clock(void);
+
+#endif
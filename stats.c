@@ -0,0 +1,277 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Author: taviso@google.com
+//
+// Publish statistics to a shared memory segment.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#define LOG_MODULE LOG_MODULE_STATS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stddef.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "npapi.h"
+#include "npfunctions.h"
+#include "config.h"
+#include "histogram.h"
+#include "shim.h"
+#include "stats.h"
+
+// Every browser process that loads the wrapper keeps its counters in a POSIX
+// shared memory segment named after its pid, so that nssecurity-stat can find
+// and aggregate them from outside. Until the segment is created, or if that
+// fails, the counters are kept in private memory instead.
+//
+// The segment is large because of the latency histograms, but pages are only
+// allocated when they're touched.
+
+static struct stats_segment stats_private;
+
+struct stats_segment *global_stats = &stats_private;
+
+// Produce the segment name for pid.
+static void stats_segment_name(char *name, size_t size, pid_t pid)
+{
+    snprintf(name, size, "/%s%u", STATS_PREFIX, (unsigned) pid);
+}
+
+// Create and map a new segment for this process. If fixed is specified, the
+// segment replaces the mapping at that address.
+static struct stats_segment *stats_segment_create(void *fixed)
+{
+    struct stats_segment *segment;
+    char                  name[64];
+    int                   fd;
+
+    stats_segment_name(name, sizeof name, getpid());
+
+    // Remove any stale segment left behind by a previous process that had
+    // the same pid.
+    shm_unlink(name);
+
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0) {
+        l_debug("failed to create statistics segment %s", name);
+        return NULL;
+    }
+
+    if (ftruncate(fd, sizeof *segment) != 0) {
+        l_debug("failed to resize statistics segment %s", name);
+        goto error;
+    }
+
+    // If we're replacing an existing mapping, copy it in first.
+    if (fixed && write(fd, fixed, sizeof *segment) != sizeof *segment) {
+        l_debug("failed to populate statistics segment %s", name);
+        goto error;
+    }
+
+    segment = mmap(fixed,
+                   sizeof *segment,
+                   PROT_READ | PROT_WRITE,
+                   fixed ? MAP_SHARED | MAP_FIXED : MAP_SHARED,
+                   fd,
+                   0);
+
+    if (segment == MAP_FAILED) {
+        l_debug("failed to map statistics segment %s", name);
+        goto error;
+    }
+
+    close(fd);
+    return segment;
+
+  error:
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+}
+
+// After a fork, the child would continue to update the parents segment. Give
+// it one of its own, mapped at the same address so that existing pointers to
+// counters remain valid.
+static void stats_atfork_child(void)
+{
+    if (global_stats == &stats_private) {
+        return;
+    }
+
+    if (stats_segment_create(global_stats) == NULL) {
+        // Can't do much here, but the parent's numbers are now wrong.
+        return;
+    }
+
+    global_stats->pid = getpid();
+}
+
+static void __constructor init_stats_segment(void)
+{
+    struct stats_segment *segment;
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    stats_private.magic      = STATS_MAGIC;
+    stats_private.version    = STATS_VERSION;
+    stats_private.size       = sizeof stats_private;
+    stats_private.pid        = getpid();
+    stats_private.start_time = now.tv_sec;
+
+    if ((segment = stats_segment_create(NULL)) == NULL) {
+        return;
+    }
+
+    // Nothing interesting should have happened yet, but copy the header and
+    // counters just in case. The histograms are not copied, so that we don't
+    // have to touch every page.
+    memcpy(segment, &stats_private, offsetof(struct stats_segment, unresolved));
+
+    __atomic_store_n(&global_stats, segment, __ATOMIC_RELEASE);
+
+    pthread_atfork(NULL, NULL, stats_atfork_child);
+}
+
+static void __destructor fini_stats_segment(void)
+{
+    char name[64];
+
+    if (global_stats == &stats_private) {
+        return;
+    }
+
+    // Only remove it if it's ours, the segment may have been inherited.
+    if (global_stats->pid == (uint32_t) getpid()) {
+        stats_segment_name(name, sizeof name, getpid());
+        shm_unlink(name);
+    }
+}
+
+// Allocate the statistics for a new plugin section, returns NULL if there
+// are too many.
+struct stats_plugin *stats_plugin_slot(const char *section)
+{
+    struct stats_plugin *slot;
+    uint32_t             index;
+
+    index = __atomic_fetch_add(&global_stats->plugin_count, 1, __ATOMIC_RELAXED);
+
+    if (index >= STATS_MAX_PLUGINS) {
+        l_warning("too many plugins, no statistics available for %s", section);
+        global_stats->plugin_count = STATS_MAX_PLUGINS;
+        return NULL;
+    }
+
+    slot = &global_stats->plugins[index];
+
+    strncpy(slot->section, section, sizeof slot->section - 1);
+
+    return slot;
+}
+
+void stats_instance_mapped(struct plugin *plugin)
+{
+    uint64_t live;
+    uint64_t peak;
+
+    if (plugin && plugin->stats) {
+        stats_inc(plugin->stats->instances);
+    }
+
+    live = stats_inc(global_stats->instances_live);
+    peak = __atomic_load_n(&global_stats->instances_peak, __ATOMIC_RELAXED);
+
+    while (live > peak) {
+        if (__atomic_compare_exchange_n(&global_stats->instances_peak,
+                                        &peak,
+                                        live,
+                                        true,
+                                        __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+}
+
+void stats_instance_destroyed(struct plugin *plugin)
+{
+    if (plugin && plugin->stats) {
+        stats_add(plugin->stats->instances, -1);
+    }
+
+    stats_add(global_stats->instances_live, -1);
+}
+
+#if defined(ENABLE_RUNTIME_TESTS)
+
+static void __constructor test_stats_segment(void)
+{
+    struct stats_segment *segment;
+    struct plugin         plugin = {0};
+    uint64_t              live;
+    char                  name[64];
+    int                   fd;
+
+    // Make sure the segment constructor has run.
+    if (global_stats == &stats_private) {
+        init_stats_segment();
+    }
+
+    stats_segment_name(name, sizeof name, getpid());
+
+    assert((fd = shm_open(name, O_RDONLY, 0)) >= 0);
+
+    segment = mmap(NULL, sizeof *segment, PROT_READ, MAP_SHARED, fd, 0);
+
+    assert(segment != MAP_FAILED);
+    assert(segment->magic == STATS_MAGIC);
+    assert(segment->pid == (uint32_t) getpid());
+
+    live = global_stats->instances_live;
+
+    plugin.stats = stats_plugin_slot("Test Plugin");
+
+    stats_instance_mapped(&plugin);
+    stats_instance_mapped(&plugin);
+
+    // The update should be visible through another mapping.
+    assert(segment->plugins[segment->plugin_count - 1].instances == 2);
+    assert(segment->instances_live == live + 2);
+    assert(segment->instances_peak >= live + 2);
+
+    stats_instance_destroyed(&plugin);
+    stats_instance_destroyed(&plugin);
+
+    assert(plugin.stats->instances == 0);
+
+    // Release the slot again.
+    memset(plugin.stats, 0, sizeof *plugin.stats);
+    global_stats->plugin_count--;
+
+    munmap(segment, sizeof *segment);
+    close(fd);
+}
+
+#endif
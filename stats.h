@@ -0,0 +1,65 @@
+#ifndef __STATS_H
+#define __STATS_H
+
+// The layout of the shared memory statistics segment, published by every
+// process that loads the wrapper. This is shared with nssecurity-stat, so any
+// change must bump the version.
+
+#define STATS_MAGIC             0x5453534e      // "NSST"
+#define STATS_VERSION           4
+#define STATS_PREFIX            "nssecurity-stats."
+#define STATS_MAX_PLUGINS       32
+#define STATS_SECTION_MAX       64
+
+struct stats_plugin {
+    char                section[STATS_SECTION_MAX];
+    uint64_t            allowed;
+    uint64_t            denied;
+    uint64_t            instances;
+    uint64_t            stream_bytes;
+    uint64_t            cpu_time;       // nanoseconds, see CpuReportInterval.
+    uint64_t            wall_time;
+    uint64_t            stalls;         // see WatchdogThreshold.
+    uint64_t            stall_time;
+    uint64_t            module_bytes;   // see memory.c.
+    int64_t             heap_live;
+    uint64_t            heap_peak;
+    uint64_t            heap_allocations;
+    struct shim_stats   latency;
+};
+
+struct stats_segment {
+    uint32_t            magic;
+    uint16_t            version;
+    uint16_t            reserved;
+    uint32_t            size;
+    uint32_t            pid;
+    uint32_t            plugin_count;
+    uint32_t            padding;
+    uint64_t            start_time;
+    uint64_t            instances_live;
+    uint64_t            instances_peak;
+    uint64_t            resolve_hits;
+    uint64_t            resolve_misses;
+    uint64_t            stream_bytes;
+    uint64_t            log_suppressed;
+    uint64_t            log_dropped;
+    uint64_t            stalls;
+    struct shim_stats   unresolved;
+    struct stats_plugin plugins[STATS_MAX_PLUGINS];
+};
+
+// Counters are only ever updated with relaxed atomic additions, there are no
+// locks and no system calls.
+#define stats_add(counter, value)                                   \
+    __atomic_add_fetch(&(counter), (value), __ATOMIC_RELAXED)
+
+#define stats_inc(counter) stats_add(counter, 1)
+
+extern struct stats_segment *global_stats;
+
+struct stats_plugin *stats_plugin_slot(const char *section);
+void stats_instance_mapped(struct plugin *plugin);
+void stats_instance_destroyed(struct plugin *plugin);
+
+#endif
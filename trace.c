@@ -0,0 +1,344 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Author: taviso@google.com
+//
+// A timeline of wrapper activity in the Chrome trace event format.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#define LOG_MODULE LOG_MODULE_CORE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "npapi.h"
+#include "npfunctions.h"
+#include "config.h"
+#include "log.h"
+#include "trace.h"
+#include "util.h"
+
+// When a page janks, the histograms tell you that something was slow, but not
+// what was happening at the time. If a TraceFile is configured, we record a
+// begin and end event for every call through a shim, every call into a
+// wrapped plugin, and the expensive things the wrapper does itself. These are
+// written as a JSON array of trace events that can be loaded into
+// about:tracing or https://ui.perfetto.dev.
+//
+// Events are recorded into a buffer owned by the calling thread, so recording
+// doesn't need a lock. The buffer is written out when it fills, when the
+// thread exits, and when the wrapper is unloaded. Names, categories and
+// sections must outlive the trace, in practice they're string constants or
+// section names, which are interned by find_plugin_section() and survive a
+// reload.
+
+// Number of events each thread can buffer before writing them out.
+#define kTraceBufferEvents  1024
+
+struct trace_event {
+    uint64_t            timestamp;
+    const char         *name;
+    const char         *category;
+    const char         *section;
+    char                phase;
+};
+
+struct trace_buffer {
+    struct trace_buffer *next;
+    unsigned            tid;
+    unsigned            count;
+    struct trace_event  events[kTraceBufferEvents];
+};
+
+bool trace_enabled;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static __thread struct trace_buffer *trace_local;
+static struct trace_buffer *trace_buffers;
+static unsigned trace_threads;
+static unsigned trace_written;
+static FILE *trace_file;
+
+static uint64_t trace_clock(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Strings in the trace are section names from the configuration, so need to
+// be escaped.
+static void trace_write_string(const char *string)
+{
+    fputc('"', trace_file);
+
+    for (; *string; string++) {
+        if (*string == '"' || *string == '\\') {
+            fprintf(trace_file, "\\%c", *string);
+        } else if ((unsigned char)(*string) < 0x20) {
+            fprintf(trace_file, "\\u%04x", (unsigned char)(*string));
+        } else {
+            fputc(*string, trace_file);
+        }
+    }
+
+    fputc('"', trace_file);
+}
+
+// Write out the events in buffer, trace_lock must be held.
+static void trace_flush_buffer(struct trace_buffer *buffer)
+{
+    struct trace_event *event;
+    unsigned i;
+
+    for (i = 0; trace_file && i < buffer->count; i++) {
+        event = &buffer->events[i];
+
+        fprintf(trace_file, "%s{\"name\":", trace_written++ ? ",\n" : "");
+        trace_write_string(event->name);
+        fprintf(trace_file, ",\"cat\":");
+        trace_write_string(event->category);
+        fprintf(trace_file,
+                ",\"ph\":\"%c\",\"ts\":%llu.%03llu,\"pid\":%u,\"tid\":%u",
+                event->phase,
+                (unsigned long long)(event->timestamp / 1000),
+                (unsigned long long)(event->timestamp % 1000),
+                getpid(),
+                buffer->tid);
+
+        if (event->section) {
+            fprintf(trace_file, ",\"args\":{\"section\":");
+            trace_write_string(event->section);
+            fputc('}', trace_file);
+        }
+
+        fputc('}', trace_file);
+    }
+
+    buffer->count = 0;
+}
+
+// Called when a thread that recorded events exits.
+static void trace_thread_exit(void *param)
+{
+    struct trace_buffer *buffer = param;
+    struct trace_buffer **link;
+
+    pthread_mutex_lock(&trace_lock);
+
+    trace_flush_buffer(buffer);
+
+    for (link = &trace_buffers; *link; link = &(*link)->next) {
+        if (*link == buffer) {
+            *link = buffer->next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&trace_lock);
+
+    free(buffer);
+}
+
+// A child process would share our FILE, and duplicate anything buffered in
+// it, so just stop tracing. The child can't safely fclose() it.
+static void trace_atfork_child(void)
+{
+    trace_enabled = false;
+    trace_file    = NULL;
+}
+
+static void trace_init(void)
+{
+    pthread_key_create(&trace_key, trace_thread_exit);
+    pthread_atfork(NULL, NULL, trace_atfork_child);
+}
+
+static struct trace_buffer *trace_buffer_create(void)
+{
+    struct trace_buffer *buffer;
+
+    if (!(buffer = calloc(1, sizeof *buffer))) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+
+    buffer->tid   = ++trace_threads;
+    buffer->next  = trace_buffers;
+    trace_buffers = buffer;
+
+    pthread_mutex_unlock(&trace_lock);
+
+    pthread_setspecific(trace_key, buffer);
+
+    return trace_local = buffer;
+}
+
+void trace_event_(char phase,
+                  const char *name,
+                  const char *category,
+                  const char *section)
+{
+    struct trace_buffer *buffer = trace_local;
+    struct trace_event *event;
+
+    if (!buffer && !(buffer = trace_buffer_create())) {
+        return;
+    }
+
+    if (buffer->count == kTraceBufferEvents) {
+        pthread_mutex_lock(&trace_lock);
+        trace_flush_buffer(buffer);
+        pthread_mutex_unlock(&trace_lock);
+    }
+
+    event = &buffer->events[buffer->count++];
+
+    event->timestamp = trace_clock();
+    event->name      = name;
+    event->category  = category;
+    event->section   = section;
+    event->phase     = phase;
+}
+
+// Start writing a trace to prefix.<pid>.json, each process that loads the
+// wrapper gets its own file.
+bool trace_open(const char *prefix)
+{
+    char path[PATH_MAX];
+
+    // Replace any existing trace.
+    trace_close();
+
+    pthread_once(&trace_once, trace_init);
+
+    snprintf(path, sizeof path, "%s.%u.json", prefix, getpid());
+
+    pthread_mutex_lock(&trace_lock);
+
+    if (!(trace_file = file_create_private(path))) {
+        pthread_mutex_unlock(&trace_lock);
+        l_warning("failed to open trace file %s, %m", path);
+        return false;
+    }
+
+    trace_written = 0;
+
+    fputs("[\n", trace_file);
+
+    pthread_mutex_unlock(&trace_lock);
+
+    l_debug("writing trace events to %s", path);
+
+    trace_enabled = true;
+
+    return true;
+}
+
+// Write out every buffered event and finish the trace. This is only called
+// when no calls are in flight, other threads are not expected to be recording
+// events.
+void trace_close(void)
+{
+    struct trace_buffer *buffer;
+
+    trace_enabled = false;
+
+    pthread_mutex_lock(&trace_lock);
+
+    if (trace_file) {
+        for (buffer = trace_buffers; buffer; buffer = buffer->next) {
+            trace_flush_buffer(buffer);
+        }
+
+        fputs("\n]\n", trace_file);
+        fclose(trace_file);
+    }
+
+    trace_file = NULL;
+
+    pthread_mutex_unlock(&trace_lock);
+}
+
+#if defined(ENABLE_RUNTIME_TESTS)
+
+static void __constructor test_trace(void)
+{
+    char prefix[] = "/tmp/nssecurity-trace-test-XXXXXX";
+    char path[sizeof prefix + 32];
+    static char contents[1024 * 512];
+    size_t length;
+    unsigned i;
+    struct stat info;
+    FILE *file;
+    int fd;
+
+    assert((fd = mkstemp(prefix)) >= 0);
+    close(fd);
+    unlink(prefix);
+
+    sprintf(path, "%s.%u.json", prefix, getpid());
+
+    // Disabled trace points do nothing.
+    trace_begin("Ignored", "test", NULL);
+
+    assert(trace_open(prefix) == true);
+    assert(trace_enabled == true);
+
+    trace_begin("NPP_New", "shim", NULL);
+    trace_begin("NPP_New", "plugin", "Quote \" Section");
+    trace_end("NPP_New", "plugin", "Quote \" Section");
+    trace_end("NPP_New", "shim", NULL);
+
+    // Fill the buffer at least once.
+    for (i = 0; i < kTraceBufferEvents; i++) {
+        trace_begin("Test", "test", NULL);
+        trace_end("Test", "test", NULL);
+    }
+
+    trace_close();
+
+    assert(trace_enabled == false);
+
+    trace_begin("Ignored", "test", NULL);
+
+    assert(stat(path, &info) == 0 && (info.st_mode & 0777) == 0600);
+    assert((file = fopen(path, "r")));
+    length = fread(contents, 1, sizeof contents - 1, file);
+    contents[length] = '\0';
+    fclose(file);
+    unlink(path);
+
+    assert(strncmp(contents, "[\n{\"name\":\"NPP_New\",\"cat\":\"shim\",\"ph\":\"B\"", 40) == 0);
+    assert(strstr(contents, "\"args\":{\"section\":\"Quote \\\" Section\"}"));
+    assert(strcmp(contents + length - 4, "}\n]\n") == 0);
+    assert(strstr(contents, "Ignored") == NULL);
+    assert(trace_written == 4 + 2 * kTraceBufferEvents);
+}
+
+#endif
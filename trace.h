@@ -0,0 +1,28 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+// The environment variable that overrides the TraceFile directive.
+#define NSSECURITY_TRACE_ENV    "NSSECURITY_TRACE"
+
+// Tracing is off unless a TraceFile is configured, in which case this is
+// set. Disabled trace points cost a load and a predictable branch.
+extern bool trace_enabled;
+
+#define trace_begin(name, category, section) do {                       \
+        if (__builtin_expect(trace_enabled, 0))                         \
+            trace_event_('B', name, category, section);                 \
+    } while (false)
+
+#define trace_end(name, category, section) do {                         \
+        if (__builtin_expect(trace_enabled, 0))                         \
+            trace_event_('E', name, category, section);                 \
+    } while (false)
+
+bool trace_open(const char *prefix);
+void trace_close(void);
+void trace_event_(char phase,
+                  const char *name,
+                  const char *category,
+                  const char *section);
+
+#endif
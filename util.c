@@ -17,12 +17,18 @@
 // limitations under the License.
 //
 
+#define LOG_MODULE LOG_MODULE_UTIL
+
 #include <stdbool.h>
 #include <stdlib.h>
 #include <fnmatch.h>
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "log.h"
 #include "npapi.h"
@@ -34,6 +40,8 @@
 #include "npruntime.h"
 #include "config.h"
 #include "util.h"
+#include "probe.h"
+#include "trace.h"
 
 // Format string to encode a messsage to pass to the browser.
 static const char kJSDisplayEncodedMessageFormat[] =
@@ -49,6 +57,8 @@ static const size_t kNetscapeStringMax = 2048;
 static const size_t kMessageLengthMax = 2048;
 
 static bool encode_javascript_string(const char *message, char **output);
+static bool netscape_plugin_geturl_(NPP instance, char **url);
+static bool netscape_display_message_(NPP instance, const char *message);
 
 // We use this simple function for translating strings from the browser into
 // cstrings. These strings can be untrusted, so verify them carefully.
@@ -78,6 +88,19 @@ bool netscape_string_convert(NPString *string, char **output)
 // create our own windows. We can ask the browser to display it instead, but
 // have to be careful about what we send.
 bool netscape_display_message(NPP instance, const char *message)
+{
+    bool result;
+
+    trace_begin("display_message", "wrapper", NULL);
+
+    result = netscape_display_message_(instance, message);
+
+    trace_end("display_message", "wrapper", NULL);
+
+    return result;
+}
+
+static bool netscape_display_message_(NPP instance, const char *message)
 {
     void     *element;
     char     *encoded;
@@ -97,7 +120,7 @@ bool netscape_display_message(NPP instance, const char *message)
     }
 
     // Retrieve the plugin object.
-    if (registry.netscape_funcs->getvalue(instance,
+    if (registry_current()->netscape_funcs->getvalue(instance,
                                           NPNVPluginElementNPObject,
                                           &element) != NPERR_NO_ERROR) {
         l_debug("unable to retrieve element object to display message");
@@ -105,7 +128,7 @@ bool netscape_display_message(NPP instance, const char *message)
     }
 
     // We cannot display a message this way in Firefox due to a bug.
-    if (strstr(registry.netscape_funcs->uagent(instance), "Firefox")) {
+    if (strstr(registry_current()->netscape_funcs->uagent(instance), "Firefox")) {
         l_warning("FIXME: unable to display messages in FireFox due to a bug");
         return false;
     }
@@ -129,7 +152,7 @@ bool netscape_display_message(NPP instance, const char *message)
 
     // This should evaluate the script NPString in the context of the plugin
     // object.
-    result = registry.netscape_funcs->evaluate(instance,
+    result = registry_current()->netscape_funcs->evaluate(instance,
                                                element,
                                                &script,
                                                &output);
@@ -141,13 +164,32 @@ bool netscape_display_message(NPP instance, const char *message)
     }
 
     // Clean up.
-    registry.netscape_funcs->releasevariantvalue(&output);
+    registry_current()->netscape_funcs->releasevariantvalue(&output);
     free(encoded);
 
     return result == NPERR_NO_ERROR;
 }
 
+// This is a round trip through the browser, and can be slow, so the
+// geturl__entry and geturl__return probes bracket it.
 bool netscape_plugin_geturl(NPP instance, char **url)
+{
+    bool result;
+
+    PROBE1(geturl__entry, instance);
+
+    trace_begin("geturl", "wrapper", NULL);
+
+    result = netscape_plugin_geturl_(instance, url);
+
+    trace_end("geturl", "wrapper", NULL);
+
+    PROBE2(geturl__return, instance, result ? *url : NULL);
+
+    return result;
+}
+
+static bool netscape_plugin_geturl_(NPP instance, char **url)
 {
     void          *window;
     NPIdentifier  *locationid;
@@ -162,7 +204,7 @@ bool netscape_plugin_geturl(NPP instance, char **url)
     // fragile, it's actually the officially supported method of retrieving the
     // URL. Being able to fool it would break most popular plugins, so we can
     // rely on browser vendors maintaining it.
-    if (registry.netscape_funcs->getvalue(instance,
+    if (registry_current()->netscape_funcs->getvalue(instance,
                                           NPNVWindowNPObject,
                                           &window) != NPERR_NO_ERROR) {
         l_debug("failed to fetch window object for instance %p", instance);
@@ -179,11 +221,11 @@ bool netscape_plugin_geturl(NPP instance, char **url)
     // > "arbitrary"
     //
     // In fact the browser guarantees nothing except window.location.href.
-    locationid = registry.netscape_funcs->getstringidentifier("location");
-    hrefid = registry.netscape_funcs->getstringidentifier("href");
+    locationid = registry_current()->netscape_funcs->getstringidentifier("location");
+    hrefid = registry_current()->netscape_funcs->getstringidentifier("href");
 
     // Get the Location object.
-    if (!registry.netscape_funcs->getproperty(instance,
+    if (!registry_current()->netscape_funcs->getproperty(instance,
                                               window,
                                               locationid,
                                               &location)
@@ -193,7 +235,7 @@ bool netscape_plugin_geturl(NPP instance, char **url)
     }
 
     // Get the URL from the Location object via href.
-    if (!registry.netscape_funcs->getproperty(instance,
+    if (!registry_current()->netscape_funcs->getproperty(instance,
                                               location.value.objectValue,
                                               hrefid,
                                               &href)
@@ -203,7 +245,7 @@ bool netscape_plugin_geturl(NPP instance, char **url)
     }
 
     // No longer need location object.
-    registry.netscape_funcs->releasevariantvalue(&location);
+    registry_current()->netscape_funcs->releasevariantvalue(&location);
 
     // Finally, Convert the NPString returned into a C string.
     if (!netscape_string_convert(&NPVARIANT_TO_STRING(href), url)) {
@@ -212,11 +254,101 @@ bool netscape_plugin_geturl(NPP instance, char **url)
     }
 
     // Clear the NPString.
-    registry.netscape_funcs->releasevariantvalue(&href);
+    registry_current()->netscape_funcs->releasevariantvalue(&href);
+
+    return true;
+}
+
+// Append length bytes of string, keeping the result nul terminated. The
+// caller owns builder->data, and should free() it.
+bool string_builder_append(struct string_builder *builder,
+                           const char *string,
+                           size_t length)
+{
+    char   *data;
+    size_t  capacity = builder->capacity ? builder->capacity : 256;
+
+    while (builder->length + length + 1 > capacity)
+        capacity *= 2;
+
+    if (capacity != builder->capacity) {
+        if (!(data = realloc(builder->data, capacity))) {
+            l_debug("memory allocation failure growing string to %zu", capacity);
+            return false;
+        }
+
+        builder->data     = data;
+        builder->capacity = capacity;
+    }
+
+    memcpy(builder->data + builder->length, string, length);
+
+    builder->length += length;
+    builder->data[builder->length] = '\0';
 
     return true;
 }
 
+// Create a file for writing that only we can read, replacing anything already
+// at path. These often go in a shared directory like /tmp, so a link planted
+// there is never followed, and if someone else's file is in the way, this
+// fails rather than writing to it.
+FILE *file_create_private(const char *path)
+{
+    FILE *file;
+    int   fd;
+
+    unlink(path);
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600)) < 0) {
+        return NULL;
+    }
+
+    if (!(file = fdopen(fd, "w"))) {
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+
+    return file;
+}
+
+// Strings that must outlive any registry, such as section names recorded by
+// the flight recorder and the trace, are kept here and never freed. There are
+// only ever a few distinct sections, so a list is fine.
+struct interned_string {
+    struct interned_string *next;
+    char                    string[];
+};
+
+static struct interned_string *interned_strings;
+static pthread_mutex_t         interned_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Return a copy of string that is never freed, and must not be modified.
+// Equal strings always return the same copy.
+char *string_intern(const char *string)
+{
+    struct interned_string *current;
+
+    pthread_mutex_lock(&interned_lock);
+
+    for (current = interned_strings; current; current = current->next) {
+        if (strcmp(current->string, string) == 0)
+            goto finished;
+    }
+
+    if ((current = malloc(sizeof *current + strlen(string) + 1))) {
+        strcpy(current->string, string);
+        current->next    = interned_strings;
+        interned_strings = current;
+    }
+
+  finished:
+    pthread_mutex_unlock(&interned_lock);
+
+    return current ? current->string : NULL;
+}
+
 // Used to percent encode messages so we can ignore sanitisation.
 static bool encode_javascript_string(const char *message, char **output)
 {
@@ -253,4 +385,64 @@ static void __constructor test_encoding_message(void)
 
     assert(encode_javascript_string(NULL, &output) == false);
 }
+
+static void __constructor test_string_builder(void)
+{
+    struct string_builder builder = {0};
+    unsigned i;
+
+    for (i = 0; i < 1000; i++) {
+        assert(string_builder_append(&builder, "abc;", 3) == true);
+    }
+
+    assert(builder.length == 3000);
+    assert(strlen(builder.data) == 3000);
+    assert(strncmp(builder.data, "abcabc", 6) == 0);
+    assert(builder.capacity >= 3001);
+
+    free(builder.data);
+}
+
+static void __constructor test_file_create_private(void)
+{
+    char        path[] = "/tmp/nssecurity-util-test-XXXXXX";
+    char        link[sizeof path + 5];
+    struct stat info;
+    FILE       *file;
+    int         fd;
+
+    assert((fd = mkstemp(path)) >= 0);
+    assert(fchmod(fd, 0644) == 0);
+    close(fd);
+
+    // An existing file is replaced, and made private.
+    assert((file = file_create_private(path)));
+    assert(fputs("test", file) >= 0);
+    assert(fclose(file) == 0);
+    assert(lstat(path, &info) == 0);
+    assert(S_ISREG(info.st_mode) && (info.st_mode & 0777) == 0600);
+    assert(info.st_size == 4);
+
+    // A link is replaced, not followed.
+    sprintf(link, "%s.link", path);
+    assert(symlink(path, link) == 0);
+    assert((file = file_create_private(link)));
+    assert(fclose(file) == 0);
+    assert(lstat(link, &info) == 0 && S_ISREG(info.st_mode));
+    assert(stat(path, &info) == 0 && info.st_size == 4);
+
+    unlink(link);
+    unlink(path);
+}
+
+static void __constructor test_string_intern(void)
+{
+    char  buffer[] = "Test Section";
+    char *interned = string_intern(buffer);
+
+    assert(interned != buffer);
+    assert(strcmp(interned, "Test Section") == 0);
+    assert(string_intern("Test Section") == interned);
+    assert(string_intern("Other Section") != interned);
+}
 #endif
@@ -11,6 +11,19 @@
                                     (len));
 #endif
 
+// A growable string, appending is amortised constant time per character.
+struct string_builder {
+    char    *data;
+    size_t   length;
+    size_t   capacity;
+};
+
+bool string_builder_append(struct string_builder *builder,
+                           const char *string,
+                           size_t length);
+
+char *string_intern(const char *string);
+FILE *file_create_private(const char *path);
 bool netscape_string_convert(NPString *string, char **output);
 bool netscape_display_message(NPP instance, const char *message);
 bool netscape_plugin_geturl(NPP instance, char **url);
@@ -0,0 +1,399 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Author: taviso@google.com
+//
+// Detection of plugins that have stopped responding.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#define LOG_MODULE LOG_MODULE_WATCHDOG
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <execinfo.h>
+
+#include "npapi.h"
+#include "npfunctions.h"
+#include "config.h"
+#include "log.h"
+#include "histogram.h"
+#include "shim.h"
+#include "stats.h"
+#include "watchdog.h"
+
+// A plugin that blocks in NPP_HandleEvent or NPP_Write freezes the browser,
+// and usually the only evidence is a user complaining. If WatchdogThreshold
+// is set, the shims publish a heartbeat describing the call currently
+// forwarded to a plugin, and a background thread checks it periodically. A
+// call that takes longer than the threshold is reported as a stall, and
+// counted in the statistics so plugins can be ranked by how often they freeze
+// the browser.
+//
+// If WatchdogSample is also set, we send the stuck thread a signal and log
+// its stack, which usually shows exactly what the plugin is waiting for.
+
+// The signal used to sample the stuck thread, which is ignored by default so
+// is unlikely to be in use.
+#define kWatchdogSignal     SIGURG
+
+// Maximum number of frames sampled.
+#define kWatchdogFrames     32
+
+bool watchdog_enabled;
+
+static struct watchdog_heartbeat watchdog_beat;
+static uint64_t         watchdog_threshold;
+static bool             watchdog_sample;
+static bool             watchdog_stopping;
+static pthread_t        watchdog_thread;
+static pthread_mutex_t  watchdog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   watchdog_cond  = PTHREAD_COND_INITIALIZER;
+
+// Written by the signal handler on the stuck thread.
+static void            *watchdog_frames[kWatchdogFrames];
+static int              watchdog_frame_count;
+
+// Publish the call currently forwarded to a plugin, or a start of zero when
+// there isn't one.
+void watchdog_heartbeat(unsigned entry, struct plugin *plugin, uint64_t start)
+{
+    __atomic_store_n(&watchdog_beat.sequence,
+                     watchdog_beat.sequence + 1,
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    watchdog_beat.entry   = entry;
+    watchdog_beat.start   = start;
+    watchdog_beat.section = plugin ? plugin->section : NULL;
+    watchdog_beat.stats   = plugin ? plugin->stats : NULL;
+    watchdog_beat.thread  = pthread_self();
+
+    __atomic_store_n(&watchdog_beat.sequence,
+                     watchdog_beat.sequence + 1,
+                     __ATOMIC_RELEASE);
+}
+
+// Take a consistent copy of the heartbeat.
+static void watchdog_read(struct watchdog_heartbeat *beat)
+{
+    uint32_t sequence;
+
+    do {
+        while ((sequence = __atomic_load_n(&watchdog_beat.sequence,
+                                           __ATOMIC_ACQUIRE)) & 1)
+            sched_yield();
+
+        beat->entry   = watchdog_beat.entry;
+        beat->start   = watchdog_beat.start;
+        beat->section = watchdog_beat.section;
+        beat->stats   = watchdog_beat.stats;
+        beat->thread  = watchdog_beat.thread;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&watchdog_beat.sequence, __ATOMIC_RELAXED) != sequence);
+}
+
+// Runs on the stuck thread, backtrace() is safe here because it was called
+// once before the handler was installed, which loads everything it needs.
+static void watchdog_signal_handler(int signum __unused)
+{
+    int count = backtrace(watchdog_frames, kWatchdogFrames);
+
+    __atomic_store_n(&watchdog_frame_count, count, __ATOMIC_RELEASE);
+}
+
+// Sample the stack of the stuck thread and log it.
+static void watchdog_sample_stack(pthread_t thread)
+{
+    char **symbols;
+    int count = 0;
+    int i;
+
+    __atomic_store_n(&watchdog_frame_count, 0, __ATOMIC_RELAXED);
+
+    if (pthread_kill(thread, kWatchdogSignal) != 0) {
+        return;
+    }
+
+    // Wait up to 100ms for the handler to run.
+    for (i = 0; i < 100; i++) {
+        if ((count = __atomic_load_n(&watchdog_frame_count, __ATOMIC_ACQUIRE)))
+            break;
+
+        usleep(1000);
+    }
+
+    if (!count) {
+        l_warning("stuck thread did not respond to sampling signal");
+        return;
+    }
+
+    // Symbolizing is slow, and needs the loader lock which the stuck thread
+    // might be holding, so don't bother if nobody will see it.
+    if (!l_enabled(LOG_LEVEL_WARNING)) {
+        return;
+    }
+
+    symbols = backtrace_symbols(watchdog_frames, count);
+
+    // Skip the handler and the signal trampoline.
+    for (i = 2; i < count; i++) {
+        l_warning("  #%d %s", i - 2, symbols ? symbols[i] : "?");
+    }
+
+    free(symbols);
+}
+
+// Report a stall, called once per stuck call.
+static void watchdog_stalled(struct watchdog_heartbeat *beat, uint64_t elapsed)
+{
+    stats_inc(global_stats->stalls);
+
+    if (beat->stats) {
+        stats_inc(beat->stats->stalls);
+    }
+
+    l_warning("plugin %s has not returned from %s for %llums",
+              beat->section ? beat->section : "<unknown>",
+              beat->entry < SHIM_MAX ? kShimNames[beat->entry] : "<unknown>",
+              (unsigned long long) elapsed / 1000000);
+
+    if (watchdog_sample) {
+        watchdog_sample_stack(beat->thread);
+    }
+}
+
+// Called when a stalled call finally returns.
+static void watchdog_recovered(struct watchdog_heartbeat *beat, uint64_t elapsed)
+{
+    if (beat->stats) {
+        stats_add(beat->stats->stall_time, elapsed);
+    }
+
+    l_message("plugin %s returned from %s after at least %llums",
+              beat->section ? beat->section : "<unknown>",
+              beat->entry < SHIM_MAX ? kShimNames[beat->entry] : "<unknown>",
+              (unsigned long long) elapsed / 1000000);
+}
+
+static void *watchdog_worker(void *param __unused)
+{
+    struct watchdog_heartbeat beat;
+    struct watchdog_heartbeat stalled = {0};
+    struct timespec deadline;
+    uint64_t interval;
+    uint64_t now;
+
+    // Check four times per threshold, so stalls are noticed promptly.
+    interval = watchdog_threshold / 4;
+
+    pthread_mutex_lock(&watchdog_mutex);
+
+    while (!watchdog_stopping) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+
+        deadline.tv_sec  += (deadline.tv_nsec + interval) / 1000000000;
+        deadline.tv_nsec  = (deadline.tv_nsec + interval) % 1000000000;
+
+        pthread_cond_timedwait(&watchdog_cond, &watchdog_mutex, &deadline);
+
+        if (watchdog_stopping)
+            break;
+
+        watchdog_read(&beat);
+
+        now = shim_clock();
+
+        // If the call we reported has finished, say how long it took. This
+        // is a lower bound, we only notice when we next check.
+        if (stalled.start && stalled.start != beat.start) {
+            watchdog_recovered(&stalled, now - stalled.start);
+            stalled.start = 0;
+        }
+
+        if (!beat.start || beat.start == stalled.start)
+            continue;
+
+        if (now - beat.start >= watchdog_threshold) {
+            pthread_mutex_unlock(&watchdog_mutex);
+            watchdog_stalled(&beat, now - beat.start);
+            pthread_mutex_lock(&watchdog_mutex);
+            stalled = beat;
+        }
+    }
+
+    pthread_mutex_unlock(&watchdog_mutex);
+
+    return NULL;
+}
+
+// The watchdog thread doesn't exist in a child, and the child may not call
+// plugins at all.
+static void watchdog_atfork_child(void)
+{
+    watchdog_enabled = false;
+}
+
+// Start the watchdog, reporting calls that take longer than threshold
+// milliseconds. A threshold of zero disables it.
+bool watchdog_start(unsigned threshold)
+{
+    static bool registered;
+
+    watchdog_stop();
+
+    if (!threshold) {
+        return true;
+    }
+
+    if (!registered) {
+        pthread_atfork(NULL, NULL, watchdog_atfork_child);
+        registered = true;
+    }
+
+    watchdog_threshold = threshold * 1000000ULL;
+    watchdog_stopping  = false;
+
+    if (pthread_create(&watchdog_thread, NULL, watchdog_worker, NULL) != 0) {
+        l_warning("failed to create watchdog thread");
+        return false;
+    }
+
+    watchdog_enabled = true;
+
+    return true;
+}
+
+void watchdog_stop(void)
+{
+    if (!watchdog_enabled) {
+        return;
+    }
+
+    watchdog_enabled = false;
+
+    pthread_mutex_lock(&watchdog_mutex);
+    watchdog_stopping = true;
+    pthread_cond_signal(&watchdog_cond);
+    pthread_mutex_unlock(&watchdog_mutex);
+
+    pthread_join(watchdog_thread, NULL);
+}
+
+// Enable sampling the stack of stuck threads. We only install our handler if
+// the signal isn't already in use.
+void watchdog_sampling(bool enabled)
+{
+    struct sigaction action = {
+        .sa_handler = watchdog_signal_handler,
+        .sa_flags   = SA_RESTART,
+    };
+    struct sigaction previous;
+    void *frame;
+
+    if (!enabled) {
+        watchdog_sample = false;
+        return;
+    }
+
+    if (sigaction(kWatchdogSignal, NULL, &previous) != 0) {
+        return;
+    }
+
+    if (previous.sa_handler != watchdog_signal_handler
+            && previous.sa_handler != SIG_DFL
+            && previous.sa_handler != SIG_IGN) {
+        l_warning("signal %d is already in use, stack sampling disabled",
+                  kWatchdogSignal);
+        return;
+    }
+
+    // Make sure backtrace() has loaded anything it needs before it's used in
+    // a signal handler.
+    backtrace(&frame, 1);
+
+    sigemptyset(&action.sa_mask);
+    sigaction(kWatchdogSignal, &action, NULL);
+
+    watchdog_sample = true;
+}
+
+static void __destructor fini_watchdog(void)
+{
+    watchdog_stop();
+}
+
+#if defined(ENABLE_RUNTIME_TESTS)
+
+static void __constructor test_watchdog(void)
+{
+    struct plugin plugin = {0};
+    struct shim_call call;
+    unsigned char saved[LOG_MODULE_MAX];
+    uint64_t stalls = global_stats->stalls;
+    uint64_t start;
+
+    memcpy(saved, log_verbosity, sizeof saved);
+    log_set_verbosity("none");
+
+    plugin.section = "Watchdog Test";
+    plugin.stats   = stats_plugin_slot(plugin.section);
+
+    assert(plugin.stats);
+    assert(watchdog_start(20) == true);
+    assert(watchdog_enabled == true);
+
+    watchdog_sampling(true);
+
+    // A quick call is not a stall.
+    shim_enter(&call, SHIM_WRITE, NULL);
+    shim_forward(&call, &plugin);
+    shim_return(&call);
+    shim_leave(&call);
+
+    // Now block for a while, the sampling signal will interrupt the sleep.
+    shim_enter(&call, SHIM_EVENT, NULL);
+    shim_forward(&call, &plugin);
+        for (start = shim_clock(); shim_clock() - start < 150000000;)
+            usleep(10000);
+    shim_return(&call);
+    shim_leave(&call);
+
+    // Give the watchdog time to notice we returned.
+    usleep(50000);
+
+    assert(plugin.stats->stalls == 1);
+    assert(plugin.stats->stall_time >= 100000000);
+    assert(global_stats->stalls == stalls + 1);
+    assert(watchdog_frame_count > 2);
+
+    watchdog_stop();
+    watchdog_sampling(false);
+
+    assert(watchdog_enabled == false);
+
+    memcpy(log_verbosity, saved, sizeof saved);
+}
+
+#endif
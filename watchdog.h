@@ -0,0 +1,28 @@
+#ifndef __WATCHDOG_H
+#define __WATCHDOG_H
+
+// The call currently forwarded to a plugin, written by the shims and read by
+// the watchdog thread. The browser only calls plugins from one thread, so
+// there is a single writer. The sequence is odd while an update is in
+// progress. The plugin itself isn't recorded, because a reload can free it
+// while the watchdog is still reporting on the call, but its section name and
+// statistics are never freed.
+struct watchdog_heartbeat {
+    uint32_t            sequence;
+    uint32_t            entry;
+    uint64_t            start;
+    const char         *section;
+    struct stats_plugin *stats;
+    pthread_t           thread;
+};
+
+// Set while the watchdog thread is running, the shims only write heartbeats
+// when this is set.
+extern bool watchdog_enabled;
+
+bool watchdog_start(unsigned threshold);
+void watchdog_stop(void);
+void watchdog_sampling(bool enabled);
+void watchdog_heartbeat(unsigned entry, struct plugin *plugin, uint64_t start);
+
+#endif